@@ -0,0 +1,550 @@
+/* This is the driver for AHCI host controllers (SATA).
+ *
+ * Every port gets three frames: the command list (32 headers, 1K) followed
+ * by the received FIS area (256 bytes) in the first one, and the 32 command
+ * tables (256 bytes each, room for AHCI_PRDT_ENTRIES entries) in the other
+ * two. Command slot n always uses command table n, and with NCQ it is also
+ * tag n.
+ *
+ * A slot is busy from ahci_submit until ahci_complete releases it. Whoever
+ * notices a slot has finished, the interrupt handler or a waiter polling
+ * with interrupts off, moves it to done. A task file error fails every
+ * outstanding command of the port and restarts it.
+ */
+
+#include <ahci.h>
+#include <ata.h>
+#include <pci.h>
+#include <mem.h>
+#include <hw.h>
+#include <pic.h>
+#include <interrupts.h>
+#include <timer.h>
+#include <string.h>
+#include <fb.h>
+#include <typedef.h>
+
+/* PCI class of AHCI controllers: mass storage, SATA, AHCI 1.0. */
+#define AHCI_PCI_CLASS            0x01
+#define AHCI_PCI_SUBCLASS         0x06
+#define AHCI_PCI_PROGIF           0x01
+#define AHCI_PCI_ABAR             5
+
+/* HBA registers. */
+#define AHCI_CAP_SNCQ             0x40000000
+#define AHCI_CAP_NCS(cap)         ((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_GHC_HR               0x00000001
+#define AHCI_GHC_IE               0x00000002
+#define AHCI_GHC_AE               0x80000000
+#define AHCI_CAP2_BOH             0x00000001
+#define AHCI_BOHC_BOS             0x00000001  /* BIOS owns the HBA. */
+#define AHCI_BOHC_OOS             0x00000002  /* OS owns the HBA. */
+#define AHCI_BOHC_BB              0x00000010  /* BIOS busy cleaning up. */
+
+/* Port registers. */
+#define AHCI_PxCMD_ST             0x00000001
+#define AHCI_PxCMD_FRE            0x00000010
+#define AHCI_PxCMD_FR             0x00004000
+#define AHCI_PxCMD_CR             0x00008000
+#define AHCI_PxIS_DHRS            0x00000001  /* D2H register FIS. */
+#define AHCI_PxIS_PSS             0x00000002  /* PIO setup FIS. */
+#define AHCI_PxIS_DSS             0x00000004  /* DMA setup FIS. */
+#define AHCI_PxIS_SDBS            0x00000008  /* Set device bits FIS. */
+#define AHCI_PxIS_ERRORS          0x7d800000  /* TFES, HBFS, HBDS, IFS, ... */
+#define AHCI_PxIS_COMPLETIONS     (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | \
+                                   AHCI_PxIS_DSS | AHCI_PxIS_SDBS)
+#define AHCI_PxSSTS_DET(ssts)     ((ssts) & 0x0f)
+#define AHCI_DET_PRESENT          0x03
+#define AHCI_SIG_ATA              0x00000101
+
+/* FIS and commands. */
+#define AHCI_FIS_H2D              0x27
+#define AHCI_FIS_COMMAND          0x80
+#define AHCI_FIS_LBA              0x40
+#define AHCI_CMD_IDENTIFY         0xec
+#define AHCI_CMD_READ_DMA_EXT     0x25
+#define AHCI_CMD_WRITE_DMA_EXT    0x35
+#define AHCI_CMD_READ_FPDMA       0x60
+#define AHCI_CMD_WRITE_FPDMA      0x61
+#define AHCI_HDR_CFL              5     /* H2D FIS length in dwords. */
+#define AHCI_HDR_WRITE            0x0040
+
+/* IDENTIFY words. */
+#define AHCI_IDENT_QUEUE_DEPTH    75
+#define AHCI_IDENT_SATA_CAPS      76
+#define AHCI_SATA_CAPS_NCQ        0x0100
+
+#define AHCI_PORT_FRAMES          3
+#define AHCI_SPIN                 1000000 /* Polls of a register. */
+#define AHCI_RESET_MS             1000    /* HBA reset, as the spec allows. */
+#define AHCI_HANDOFF_MS           25      /* BIOS to release the HBA, */
+#define AHCI_HANDOFF_BUSY_MS      2000    /* or to finish if it's busy. */
+#define AHCI_DET_MS               10      /* PHY to come up after reset. */
+
+typedef volatile struct ahci_port_regs {
+  u32 clb, clbu, fb, fbu, is, ie, cmd, rsv0;
+  u32 tfd, sig, ssts, sctl, serr, sact, ci, sntf;
+  u32 fbs, rsv1[11], vendor[4];
+} ahci_port_regs_t;
+
+typedef volatile struct ahci_hba {
+  u32 cap, ghc, is, pi, vs, ccc_ctl, ccc_ports, em_loc;
+  u32 em_ctl, cap2, bohc, rsv[29], vendor[24];
+  ahci_port_regs_t ports[32];
+} ahci_hba_t;
+
+struct ahci_cmd_header {
+  u16 flags;                    /* CFL, W, ... */
+  u16 prdtl;                    /* PRDT entries. */
+  volatile u32 prdbc;           /* Bytes transferred. */
+  u32 ctba, ctbau;              /* Command table. */
+  u32 rsv[4];
+};
+
+struct ahci_prd {
+  u32 dba, dbau, rsv;
+  u32 dbc;                      /* Byte count - 1. */
+};
+
+struct ahci_cmd_table {
+  u8 cfis[64];
+  u8 acmd[16];
+  u8 rsv[48];
+  struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+};
+
+struct ahci_port {
+  ahci_port_regs_t *regs;
+  ata_dev_t *dev;
+  u8 ncq;                       /* Use NCQ commands. */
+  u32 slots;                    /* Usable slots mask. */
+  struct ahci_cmd_header *cl;
+  struct ahci_cmd_table *ct;
+  u32 busy;                     /* Submitted and not released. */
+  volatile u32 done;            /* Finished, successfully or not. */
+  volatile u32 failed;
+  ahci_stats_t stats;
+};
+
+static ahci_hba_t *ahci_hba;
+static struct ahci_port ahci_ports[AHCI_MAX_DEVICES];
+static int ahci_count;
+static u8 ahci_irq_ready;
+static u8 ahci_ident[512];
+
+static int ahci_read(ata_dev_t *dev, int start, int count, void *buf);
+static int ahci_write(ata_dev_t *dev, int start, int count, void *buf);
+
+static ata_dev_ops_t ahci_ops = {ahci_read, ahci_write};
+
+/* Spins until (*reg & mask) == value. Returns -1 if it never happens. */
+static int ahci_spin(volatile u32 *reg, u32 mask, u32 value) {
+  u32 i;
+
+  for (i = 0; i < AHCI_SPIN; i++)
+    if ((*reg & mask) == value)
+      return 0;
+  return -1;
+}
+
+/* Same, but gives up after about ms milliseconds. Needs the timer. */
+static int ahci_wait(volatile u32 *reg, u32 mask, u32 value, u32 ms) {
+  u32 t0 = timer_ticks(), ticks = ms * timer_hz() / 1000 + 1;
+
+  while ((*reg & mask) != value)
+    if (timer_ticks() - t0 > ticks)
+      return -1;
+  return 0;
+}
+
+/* Takes the HBA from the BIOS if it supports the handoff. */
+static void ahci_handoff() {
+  if (!(ahci_hba->cap2 & AHCI_CAP2_BOH))
+    return;
+  ahci_hba->bohc |= AHCI_BOHC_OOS;
+  if (ahci_wait(&ahci_hba->bohc, AHCI_BOHC_BOS, 0, AHCI_HANDOFF_MS) == 0)
+    return;
+  if (ahci_hba->bohc & AHCI_BOHC_BB)
+    ahci_wait(&ahci_hba->bohc, AHCI_BOHC_BOS, 0, AHCI_HANDOFF_BUSY_MS);
+}
+
+static int ahci_port_stop(ahci_port_regs_t *r) {
+  r->cmd &= ~AHCI_PxCMD_ST;
+  if (ahci_spin(&r->cmd, AHCI_PxCMD_CR, 0) == -1)
+    return -1;
+  r->cmd &= ~AHCI_PxCMD_FRE;
+  return ahci_spin(&r->cmd, AHCI_PxCMD_FR, 0);
+}
+
+static void ahci_port_start(ahci_port_regs_t *r) {
+  r->serr = 0xffffffff;
+  r->is = 0xffffffff;
+  r->cmd |= AHCI_PxCMD_FRE;
+  r->cmd |= AHCI_PxCMD_ST;
+}
+
+/* Fails everything outstanding and restarts the port. */
+static void ahci_port_recover(struct ahci_port *p) {
+  p->stats.errors++;
+  p->failed |= p->busy & ~p->done;
+  p->done |= p->busy;
+  ahci_port_stop(p->regs);
+  ahci_port_start(p->regs);
+}
+
+/* Moves the slots that finished to done. Must run with interrupts off. */
+static void ahci_port_reap(struct ahci_port *p) {
+  u32 is;
+
+  is = p->regs->is;
+  p->regs->is = is;
+  if (is & AHCI_PxIS_ERRORS) {
+    ahci_port_recover(p);
+    return;
+  }
+  p->done |= p->busy & ~(p->regs->ci | p->regs->sact);
+}
+
+void ahci_interrupt_handler(itr_cpu_regs_t regs,
+                            itr_intr_data_t intr,
+                            itr_stack_state_t stack) {
+  u32 is;
+  int i;
+
+  is = ahci_hba->is;
+  for (i = 0; i < ahci_count; i++) {
+    if (is & (1 << (ahci_ports[i].regs - ahci_hba->ports))) {
+      ahci_ports[i].stats.irqs++;
+      ahci_port_reap(ahci_ports + i);
+    }
+  }
+  ahci_hba->is = is;
+  pic_send_eoi(intr.irq);
+}
+
+/* Fills slot with cmd and issues it. count goes to the FIS, bytes to the
+ * PRDT. Must run with interrupts off. */
+static void ahci_issue(struct ahci_port *p, int slot, u8 cmd, u32 lba,
+                       u32 count, void *buf, u32 bytes, int write) {
+  struct ahci_cmd_header *h = p->cl + slot;
+  struct ahci_cmd_table *t = p->ct + slot;
+  u8 *fis = t->cfis;
+  u32 n, addr = (u32)buf;
+  int queued = cmd == AHCI_CMD_READ_FPDMA || cmd == AHCI_CMD_WRITE_FPDMA;
+
+  memset(fis, 0, 20);
+  fis[0] = AHCI_FIS_H2D;
+  fis[1] = AHCI_FIS_COMMAND;
+  fis[2] = cmd;
+  if (cmd != AHCI_CMD_IDENTIFY) {
+    fis[4] = lba & 0xff;
+    fis[5] = (lba >> 8) & 0xff;
+    fis[6] = (lba >> 16) & 0xff;
+    fis[7] = AHCI_FIS_LBA;
+    fis[8] = (lba >> 24) & 0xff;
+  }
+  if (queued) {
+    /* NCQ moves the count to the features and the tag to the count. */
+    fis[3] = count & 0xff;
+    fis[11] = (count >> 8) & 0xff;
+    fis[12] = slot << 3;
+  }
+  else {
+    fis[12] = count & 0xff;
+    fis[13] = (count >> 8) & 0xff;
+  }
+
+  for (n = 0; bytes > 0; n++) {
+    t->prdt[n].dba = addr;
+    t->prdt[n].dbau = 0;
+    t->prdt[n].rsv = 0;
+    t->prdt[n].dbc = (bytes > AHCI_PRD_BYTES ? AHCI_PRD_BYTES : bytes) - 1;
+    addr += t->prdt[n].dbc + 1;
+    bytes -= t->prdt[n].dbc + 1;
+  }
+
+  h->flags = AHCI_HDR_CFL | (write ? AHCI_HDR_WRITE : 0);
+  h->prdtl = n;
+  h->prdbc = 0;
+
+  p->busy |= 1 << slot;
+  p->done &= ~(1 << slot);
+  p->failed &= ~(1 << slot);
+  p->stats.commands++;
+  if (queued) {
+    p->stats.queued++;
+    p->regs->sact = 1 << slot;
+  }
+  p->regs->ci = 1 << slot;
+
+  for (n = 0, addr = p->busy; addr != 0; addr &= addr - 1, n++);
+  if (n > p->stats.depth)
+    p->stats.depth = n;
+}
+
+/* Takes a free slot, or returns -1 if there's none. */
+static int ahci_slot(struct ahci_port *p) {
+  u32 free = p->slots & ~p->busy;
+  int slot;
+
+  if (free == 0)
+    return -1;
+  for (slot = 0; !(free & (1 << slot)); slot++);
+  return slot;
+}
+
+int ahci_submit(ata_dev_t *dev, int write, u32 lba, u32 count, void *buf) {
+  struct ahci_port *p = (struct ahci_port *)dev->priv;
+  int slot;
+  u32 flags, end = (u32)buf + count * 512;
+  u8 cmd;
+
+  /* The HBA sees physical addresses, which is what buf is everywhere but in
+   * the mmap window. */
+  if (count == 0 || count > AHCI_MAX_SECTORS || lba + count > dev->size ||
+      lba + count < lba || ((u32)buf & 1) || end < (u32)buf ||
+      (end > MEM_MMAP_ADDR && (u32)buf < MEM_MMAP_ADDR + MEM_MMAP_SIZE))
+    return -1;
+
+  if (p->ncq)
+    cmd = write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA;
+  else
+    cmd = write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT;
+
+  flags = hw_cli_save();
+  if ((slot = ahci_slot(p)) != -1)
+    ahci_issue(p, slot, cmd, lba, count, buf, count * 512, write);
+  hw_restore_flags(flags);
+  return slot;
+}
+
+int ahci_complete(ata_dev_t *dev, int tag) {
+  struct ahci_port *p = (struct ahci_port *)dev->priv;
+  u32 bit = 1 << tag, t0, flags, spins = 0;
+  int ret;
+
+  if (tag < 0 || tag >= AHCI_SLOTS || !(p->busy & bit))
+    return -1;
+
+  /* Callers may have interrupts off, e.g. the page fault handler. Then the
+   * timer doesn't tick either, so the timeout is counted in polls. */
+  flags = hw_cli_save();
+  t0 = timer_ticks();
+  while (1) {
+    ahci_port_reap(p);
+    if (p->done & bit)
+      break;
+    if (timer_ticks() - t0 > AHCI_TIMEOUT_TICKS || spins == AHCI_SPIN) {
+      ahci_port_recover(p);
+      break;
+    }
+    /* Sleep until the completion interrupt, or just poll without it. */
+    if (!(flags & HW_EFLAGS_IF))
+      spins++;
+    else if (ahci_irq_ready)
+      hw_sti_hlt();
+    else
+      hw_sti();
+    hw_cli();
+  }
+
+  ret = p->failed & bit ? -1 : 0;
+  p->busy &= ~bit;
+  p->done &= ~bit;
+  p->failed &= ~bit;
+  hw_restore_flags(flags);
+  return ret;
+}
+
+/* Splits the request in chunks and keeps as many in flight as there are
+ * slots, releasing them oldest first. */
+static int ahci_rw(ata_dev_t *dev, int write, int start, int count,
+                   void *buf) {
+  int tags[AHCI_SLOTS], head = 0, n = 0, tag, ret = 0;
+  u32 c;
+  u8 *ptr = (u8 *)buf;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  while (n > 0 || (count > 0 && ret == 0)) {
+    if (count > 0 && ret == 0) {
+      c = count > AHCI_CHUNK_SECTORS ? AHCI_CHUNK_SECTORS : count;
+      tag = ahci_submit(dev, write, start, c, ptr);
+      if (tag != -1) {
+        tags[(head + n) % AHCI_SLOTS] = tag;
+        n++;
+        start += c;
+        count -= c;
+        ptr += c * 512;
+        continue;
+      }
+      if (n == 0)
+        return -1;
+    }
+
+    if (ahci_complete(dev, tags[head]) == -1)
+      ret = -1;
+    head = (head + 1) % AHCI_SLOTS;
+    n--;
+  }
+  return ret;
+}
+
+static int ahci_read(ata_dev_t *dev, int start, int count, void *buf) {
+  return ahci_rw(dev, 0, start, count, buf);
+}
+
+static int ahci_write(ata_dev_t *dev, int start, int count, void *buf) {
+  return ahci_rw(dev, 1, start, count, buf);
+}
+
+/* Gives the port its command list, FIS area and command tables and starts
+ * it. */
+static int ahci_port_init(struct ahci_port *p, ahci_port_regs_t *r) {
+  u8 *mem;
+  int i;
+
+  if (ahci_port_stop(r) == -1)
+    return -1;
+  mem = (u8 *)mem_allocate_frames(AHCI_PORT_FRAMES, MEM_KERNEL_FIRST_FRAME,
+                                  MEM_USER_FIRST_FRAME);
+  if (mem == NULL)
+    return -1;
+  memset(mem, 0, AHCI_PORT_FRAMES * MEM_FRAME_SIZE);
+
+  p->regs = r;
+  p->cl = (struct ahci_cmd_header *)mem;
+  p->ct = (struct ahci_cmd_table *)(mem + MEM_FRAME_SIZE);
+  p->busy = 0;
+  p->done = 0;
+  p->failed = 0;
+  memset(&p->stats, 0, sizeof(p->stats));
+  for (i = 0; i < AHCI_SLOTS; i++) {
+    p->cl[i].ctba = (u32)(p->ct + i);
+    p->cl[i].ctbau = 0;
+  }
+
+  r->clb = (u32)p->cl;
+  r->clbu = 0;
+  r->fb = (u32)(mem + AHCI_SLOTS * sizeof(struct ahci_cmd_header));
+  r->fbu = 0;
+  r->ie = AHCI_PxIS_COMPLETIONS | AHCI_PxIS_ERRORS;
+  ahci_port_start(r);
+  return 0;
+}
+
+/* Identifies the disk on p and fills dev. */
+static int ahci_port_identify(struct ahci_port *p, ata_dev_t *dev) {
+  u16 *words = (u16 *)ahci_ident;
+  u32 depth, flags;
+  int ret;
+
+  p->slots = 1;
+  p->ncq = 0;
+  dev->priv = p;
+  dev->size = 0;
+
+  flags = hw_cli_save();
+  ahci_issue(p, 0, AHCI_CMD_IDENTIFY, 0, 0, ahci_ident, 512, 0);
+  hw_restore_flags(flags);
+  ret = ahci_complete(dev, 0);
+  if (ret == -1)
+    return -1;
+
+  memset(dev, 0, sizeof(ata_dev_t));
+  ata_parse_identify(dev, (char *)ahci_ident);
+  dev->present = ATA_DEVICE_PRESENT;
+  dev->channel = p->regs - ahci_hba->ports;   /* The AHCI port. */
+  dev->drive = 0;
+  dev->type = ATA_TYPE_SATA;
+  dev->flags = ATA_FLAG_IDENTIFIED;
+  dev->ops = &ahci_ops;
+  dev->priv = p;
+  p->dev = dev;
+
+  /* Use as many slots as both the HBA and the disk can take. */
+  depth = AHCI_CAP_NCS(ahci_hba->cap);
+  if ((ahci_hba->cap & AHCI_CAP_SNCQ) &&
+      (words[AHCI_IDENT_SATA_CAPS] & AHCI_SATA_CAPS_NCQ)) {
+    p->ncq = 1;
+    if ((words[AHCI_IDENT_QUEUE_DEPTH] & 0x1f) + 1 < depth)
+      depth = (words[AHCI_IDENT_QUEUE_DEPTH] & 0x1f) + 1;
+  }
+  p->slots = depth == AHCI_SLOTS ? 0xffffffff : (1u << depth) - 1;
+  return 0;
+}
+
+int ahci_init(ata_dev_t *devs[], int count) {
+  pci_addr_t pci;
+  ahci_port_regs_t *r;
+  u32 line, i;
+
+  ahci_count = 0;
+  ahci_irq_ready = 0;
+
+  pci = pci_find_class(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, AHCI_PCI_PROGIF, 0);
+  if (pci == PCI_NONE)
+    return 0;
+
+  /* Let it decode its registers and master the bus for DMA. */
+  pci_write(pci, PCI_REG_COMMAND,
+            (pci_read(pci, PCI_REG_COMMAND) | PCI_COMMAND_MEMORY |
+             PCI_COMMAND_MASTER) & ~PCI_COMMAND_INTX_DISABLE);
+  ahci_hba = (ahci_hba_t *)(pci_read(pci, PCI_REG_BAR(AHCI_PCI_ABAR)) & ~0xf);
+
+  ahci_handoff();
+  ahci_hba->ghc |= AHCI_GHC_AE;
+  ahci_hba->ghc |= AHCI_GHC_HR;
+  if (ahci_wait(&ahci_hba->ghc, AHCI_GHC_HR, 0, AHCI_RESET_MS) == -1)
+    return 0;
+  ahci_hba->ghc |= AHCI_GHC_AE;
+
+  /* Polled until the interrupt handler is in place. The reset takes the
+   * links down, give every PHY a moment to come back up. */
+  for (i = 0; i < 32 && ahci_count < count &&
+              ahci_count < AHCI_MAX_DEVICES; i++) {
+    r = ahci_hba->ports + i;
+    if (!(ahci_hba->pi & (1 << i)) ||
+        ahci_wait(&r->ssts, 0x0f, AHCI_DET_PRESENT, AHCI_DET_MS) == -1 ||
+        r->sig != AHCI_SIG_ATA)
+      continue;
+    if (ahci_port_init(ahci_ports + ahci_count, r) == -1)
+      continue;
+    if (ahci_port_identify(ahci_ports + ahci_count, devs[ahci_count]) == -1) {
+      ahci_port_stop(r);
+      continue;
+    }
+    ahci_count++;
+  }
+
+  /* The legacy IRQ line the BIOS routed the controller to. */
+  line = pci_read(pci, PCI_REG_INTERRUPT) & 0xff;
+  if (ahci_count > 0 && line < 16) {
+    line += line < 8 ? PIC_MASTER_BASE_IRQ : PIC_SLAVE_BASE_IRQ - 8;
+    itr_set_interrupt_handler(line, ahci_interrupt_handler,
+                              IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+    ahci_hba->is = 0xffffffff;
+    ahci_hba->ghc |= AHCI_GHC_IE;
+    pic_unmask_dev(PIC_SLAVE_PIC_IRQ);
+    pic_unmask_dev((enum pic_dev)line);
+    ahci_irq_ready = 1;
+  }
+
+  return ahci_count;
+}
+
+void ahci_stats(ata_dev_t *dev, ahci_stats_t *stats) {
+  *stats = ((struct ahci_port *)dev->priv)->stats;
+}
+
+void ahci_report(ata_dev_t *dev) {
+  struct ahci_port *p = (struct ahci_port *)dev->priv;
+  ahci_stats_t *s = &p->stats;
+
+  fb_printf("ahci_report: port %dd, %s\n", dev->channel,
+            p->ncq ? "ncq" : "dma");
+  fb_printf("commands { issued: %dd, queued: %dd, depth: %dd }\n",
+            s->commands, s->queued, s->depth);
+  fb_printf("irqs: %dd, errors: %dd\n", s->irqs, s->errors);
+}
@@ -0,0 +1,129 @@
+/* This is the arena allocator used for boot-time and scratch memory.
+ *
+ * Every chunk starts with a header holding the offset of its first free
+ * byte. Allocations are only served from the current chunk, the first of
+ * the list; when it is full the rest of it is wasted and a new one takes
+ * its place. Allocations too big for a chunk get one of their own, put
+ * right behind the current one.
+ */
+
+#include <arena.h>
+#include <mem.h>
+#include <typedef.h>
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  u32 frames;
+  u32 used;                     /* Bytes used, header included. */
+};
+
+arena_t arena_boot;
+
+void arena_boot_init() {
+  arena_init(&arena_boot, "boot", ARENA_BOOT_FRAMES);
+}
+
+void arena_init(arena_t *arena, char *name, u32 chunk_frames) {
+  arena->name = name;
+  arena->chunk_frames = chunk_frames == 0 ? 1 : chunk_frames;
+  arena->chunks = NULL;
+  arena->stats.chunks = 0;
+  arena->stats.frames = 0;
+  arena->stats.bytes = 0;
+  arena->stats.allocs = 0;
+  arena->stats.failures = 0;
+  arena->stats.resets = 0;
+}
+
+/* Returns the address in c where bytes bytes aligned to align fit, or 0. */
+static u32 arena_fit(struct arena_chunk *c, u32 bytes, u32 align) {
+  u32 p = ((u32)c + c->used + align - 1) & ~(align - 1);
+
+  if (p - (u32)c > c->frames * MEM_FRAME_SIZE ||
+      bytes > c->frames * MEM_FRAME_SIZE - (p - (u32)c))
+    return 0;
+  return p;
+}
+
+void *arena_alloc_aligned(arena_t *arena, u32 bytes, u32 align) {
+  struct arena_chunk *c = arena->chunks;
+  u32 p, frames;
+
+  if (align == 0 || (align & (align - 1)) != 0 || align > MEM_FRAME_SIZE)
+    return NULL;
+
+  if (c == NULL || (p = arena_fit(c, bytes, align)) == 0) {
+    /* Chunks are frame aligned, so the padding never exceeds align. */
+    frames = (sizeof(struct arena_chunk) + align + bytes +
+              MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE;
+    if (bytes > frames * MEM_FRAME_SIZE) { /* Wrapped around. */
+      arena->stats.failures++;
+      return NULL;
+    }
+    if (frames < arena->chunk_frames)
+      frames = arena->chunk_frames;
+    c = (struct arena_chunk *)mem_allocate_kernel_frames(frames);
+    if (c == NULL) {
+      arena->stats.failures++;
+      return NULL;
+    }
+    c->frames = frames;
+    c->used = sizeof(struct arena_chunk);
+    if (frames > arena->chunk_frames && arena->chunks != NULL) {
+      /* A big allocation of its own, the current chunk stays current. */
+      c->next = arena->chunks->next;
+      arena->chunks->next = c;
+    }
+    else {
+      c->next = arena->chunks;
+      arena->chunks = c;
+    }
+    arena->stats.chunks++;
+    arena->stats.frames += frames;
+    p = arena_fit(c, bytes, align);
+  }
+
+  arena->stats.bytes += p + bytes - ((u32)c + c->used);
+  arena->stats.allocs++;
+  c->used = p + bytes - (u32)c;
+  return (void *)p;
+}
+
+void *arena_alloc(arena_t *arena, u32 bytes) {
+  return arena_alloc_aligned(arena, bytes, ARENA_ALIGN);
+}
+
+/* Gives back c and the chunks after it and restarts the counters. */
+static void arena_drop(arena_t *arena, struct arena_chunk *c) {
+  struct arena_chunk *n;
+
+  for (; c != NULL; c = n) {
+    n = c->next;
+    arena->stats.chunks--;
+    arena->stats.frames -= c->frames;
+    mem_release_kernel_frames(c, c->frames);
+  }
+  arena->stats.bytes = 0;
+  arena->stats.allocs = 0;
+  arena->stats.resets++;
+}
+
+void arena_reset(arena_t *arena) {
+  struct arena_chunk *c = arena->chunks;
+
+  /* The current chunk is kept, big allocations never take its place. */
+  if (c != NULL) {
+    arena_drop(arena, c->next);
+    c->next = NULL;
+    c->used = sizeof(struct arena_chunk);
+  }
+}
+
+void arena_release(arena_t *arena) {
+  arena_drop(arena, arena->chunks);
+  arena->chunks = NULL;
+}
+
+void arena_stats(arena_t *arena, arena_stats_t *stats) {
+  *stats = arena->stats;
+}
@@ -4,6 +4,12 @@
 #include <device.h>
 #include <string.h>
 #include <mem.h>
+#include <hw.h>
+#include <pic.h>
+#include <interrupts.h>
+#include <timer.h>
+#include <trace.h>
+#include <qos.h>
 
 /* Status */
 #define ATA_SR_BSY                  0x80    /* Busy */
@@ -39,6 +45,8 @@
 #define ATA_CMD_PACKET              0xA0    /* Packet (ATAPI perhaps?) */
 #define ATA_CMD_IDENTIFY_PACKET     0xA1    /* Identify Packet (ATAPI?) */
 #define ATA_CMD_IDENTIFY            0xEC    /* Identify */
+#define ATA_CMD_READ_VERIFY         0x40    /* Read verify sectors, LBA28 */
+#define ATA_CMD_READ_VERIFY_EXT     0x42    /* Read verify sectors, LBA48 */
 
 /* Words in the Identification Space*/
 #define ATA_IDENT_DEVICETYPE   0
@@ -93,6 +101,20 @@
 #define ATA_CH_REG_CONTROL(base)    ((base) + 0x00)   /*      W       8      */
 #define ATA_CH_REG_ALTSTATUS(base)  ((base) + 0x00)   /*      R       8      */
 
+/* Control register bits */
+#define ATA_CTRL_NIEN               0x02    /* Disable device interrupts */
+#define ATA_CTRL_SRST               0x04    /* Software reset */
+#define ATA_CTRL_HOB                0x80    /* Read back high order bytes */
+
+/* Sector size in bytes. */
+#define ATA_SECTOR_SIZE             512
+
+/* Addressing limits. A single LBA28 command moves at most 256 sectors (a
+ * count of 0 means 256) and can't reach beyond sector 2^28 - 1. */
+#define ATA_MAX_SECTORS             256
+#define ATA_LBA28_LIMIT             0x10000000
+#define ATA_SUPPORTS_LBA48(dev)     ((dev)->commandsets & (1 << 26))
+
 /* Standard IRQs */
 #define ATA_CH_PRI_IRQ              14
 #define ATA_CH_SEC_IRQ              15
@@ -104,6 +126,34 @@ u16 ata_bus_port[] = {ATA_CH_PRI_BASE, ATA_CH_SEC_BASE,
 u16 ata_bus_control[] = {ATA_CH_PRI_CONTROL_BASE, ATA_CH_SEC_CONTROL_BASE, 
                           ATA_CH_THIRD_CONTROL_BASE, ATA_CH_FOURTH_CONTROL_BASE};
 
+/* Completion strategy. Waiting for a data block can be done either spinning
+ * on the alternate status register, which costs CPU for as long as the
+ * device takes, or sleeping until the device raises its IRQ, which costs a
+ * halt/interrupt round trip. Each drive keeps a moving average of how long
+ * its waits take and spins whenever that's below ata_spin_threshold. Only
+ * spun waits are measured, a slept one would count the round trip too; the
+ * average decays on every sleep instead, so a drive that got faster is
+ * spun on again after a few waits. */
+#define ATA_SLOTS                   4
+#define ATA_SLOT(dev)               ((dev)->channel * 2 + (dev)->drive)
+#define ATA_DEFAULT_SPIN_THRESHOLD  20000   /* TSC cycles */
+#define ATA_IRQ_TIMEOUT_TICKS       2       /* Give up on a missing IRQ. */
+
+static ata_completion_stats_t ata_stats[ATA_SLOTS];
+static u32 ata_spin_threshold;
+static volatile u8 ata_irq_fired[2];      /* One per channel. */
+static u8 ata_irq_ready;                  /* Handlers are in place. */
+
+/* Devices handed to ata_init, identified on their first use. */
+static ata_dev_t *ata_devs[ATA_SLOTS];
+static char ata_ident[512];
+
+static u8 ata_probe(u8 idx);
+
+void ata_interrupt_handler(itr_cpu_regs_t regs,
+                           itr_intr_data_t intr,
+                           itr_stack_state_t stack);
+
 void detail_dev(ata_dev_t* dev)
 {
   fb_printf("present = %dd\n", dev->present);
@@ -126,11 +176,21 @@ void delay(u16 dev, int ns)
     inb(ATA_REG_STATUS(dev));
 }
 
+/* The 400ns the drive needs to update its status, as four reads of the
+ * alternate status register of the channel whose control base is ctrl. */
+static void ata_delay400(u16 ctrl)
+{
+  inb(ATA_CH_REG_ALTSTATUS(ctrl));
+  inb(ATA_CH_REG_ALTSTATUS(ctrl));
+  inb(ATA_CH_REG_ALTSTATUS(ctrl));
+  inb(ATA_CH_REG_ALTSTATUS(ctrl));
+}
+
 //Detect ATA-ATAPI Devices:
 u8 identify_command(ata_dev_t * dev, u8 idx, char * buffer)
 {
   u8 lba1, lba2;
-  u8 status = 0, error;
+  u8 status = 0, error = 0;
   u8 _channel = idx / 2;          /* ATA_CHANNEL_* */
   u8 _drive = idx % 2;
   u16 i;
@@ -193,6 +253,16 @@ u8 identify_command(ata_dev_t * dev, u8 idx, char * buffer)
 
   dev->channel = _channel;
   dev->drive = _drive;
+  ata_parse_identify(dev, buffer);
+
+  return 0;
+}
+
+/* Fills dev from the 512 bytes returned by IDENTIFY (PACKET) DEVICE. */
+void ata_parse_identify(ata_dev_t *dev, char *buffer)
+{
+  u16 i;
+
   dev->signature    = *((u16*) (buffer + ATA_IDENT_DEVICETYPE));
   dev->capabilities = *((u16*) (buffer + ATA_IDENT_CAPABILITIES));
   dev->commandsets  = *((u32*) (buffer + ATA_IDENT_COMMANDSETS));
@@ -213,8 +283,6 @@ u8 identify_command(ata_dev_t * dev, u8 idx, char * buffer)
     dev->model[i+1] = buffer[ATA_IDENT_MODEL + i];
   }
   dev->model[40] = '\0';
-
-  return 0;
 }
 
 
@@ -234,14 +302,93 @@ int ata_init(ata_dev_t* devs[])
    *       En caso de encontrarse algún error se deberá de retornar -1, en
    *       caso contrario 0. */
 
-   char buffer[512];
-   u8 i, error = 0;
+   u8 i;
+
+   ata_spin_threshold = ATA_DEFAULT_SPIN_THRESHOLD;
+   memset(ata_stats, 0, sizeof(ata_stats));
+   ata_irq_fired[0] = ata_irq_fired[1] = 0;
+   ata_irq_ready = 0;
+
+   /* Make sure the devices raise interrupts. */
+   outb(ATA_CH_REG_CONTROL(ata_bus_control[ATA_CHANNEL_PRIMARY]), 0);
+   outb(ATA_CH_REG_CONTROL(ata_bus_control[ATA_CHANNEL_SECONDARY]), 0);
    
+   /* Only look for the devices here. IDENTIFY is left for their first use
+    * or for ata_identify_step, whichever comes first. */
    for(i = 0; i < 4; ++i)
-      if(identify_command(devs[i], i, buffer))
-        error = -1;
+   {
+      ata_devs[i] = devs[i];
+      memset(devs[i], 0, sizeof(ata_dev_t));
+      devs[i]->channel = i / 2;
+      devs[i]->drive = i % 2;
+      devs[i]->present = ata_probe(i);
+   }
+
+  itr_set_interrupt_handler(PIC_PRIMARY_ATA_IRQ, ata_interrupt_handler,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+  itr_set_interrupt_handler(PIC_SECONDARY_ATA_IRQ, ata_interrupt_handler,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+  pic_unmask_dev(PIC_SLAVE_PIC_IRQ);
+  pic_unmask_dev(PIC_PRIMARY_ATA_IRQ);
+  pic_unmask_dev(PIC_SECONDARY_ATA_IRQ);
+  ata_irq_ready = 1;
+
+  return 0;
+}
+
+/* Runs IDENTIFY on dev unless it already went through it. Returns -1 if
+ * there's no usable device behind dev. */
+int ata_identify(ata_dev_t *dev)
+{
+  u8 ret;
+
+  if(ATA_IS_VIRTUAL(dev) || (dev->flags & ATA_FLAG_IDENTIFIED))
+    return dev->present == ATA_DEVICE_PRESENT ? 0 : -1;
+  if(dev->present != ATA_DEVICE_PRESENT)
+    return -1;
+
+  IO_ACCT_BEGIN(IO_OP_ATA_IDENTIFY);
+  ret = identify_command(dev, ATA_SLOT(dev), ata_ident);
+  IO_ACCT_END();
 
-  return error;
+  /* Don't try again on devices that didn't answer. */
+  dev->flags |= ATA_FLAG_IDENTIFIED;
+  if(ret)
+    dev->present = ATA_DEVICE_EMPTY;
+  return dev->present == ATA_DEVICE_PRESENT ? 0 : -1;
+}
+
+/* Identifies one device found by ata_init that hasn't been used yet, if the
+ * idle class is admitted. Returns 1 if it did, 0 otherwise. */
+int ata_identify_step()
+{
+  u8 i;
+
+  for(i = 0; i < ATA_SLOTS; ++i)
+  {
+    if(ata_devs[i] == NULL || ata_devs[i]->present != ATA_DEVICE_PRESENT ||
+       (ata_devs[i]->flags & ATA_FLAG_IDENTIFIED))
+      continue;
+    if(!qos_admit(QOS_IDLE, 1))
+      return 0;
+    ata_identify(ata_devs[i]);
+    return 1;
+  }
+  return 0;
+}
+
+/* Cheap presence check: selects the drive and looks at its status without
+ * issuing any command. A floating bus reads 0xff and an empty slot 0. */
+static u8 ata_probe(u8 idx)
+{
+  u8 status;
+  u16 ch = ata_bus_port[idx / 2];
+
+  outb(ATA_REG_DEVSEL(ch), ATA_IDENTIFY_CMD_MASTER | ((idx % 2) << 4));
+  ata_delay400(ata_bus_control[idx / 2]);
+  status = inb(ATA_REG_STATUS(ch));
+
+  return status == 0 || status == 0xff ? ATA_DEVICE_EMPTY : ATA_DEVICE_PRESENT;
 }
 
 int poll(int channel)
@@ -266,39 +413,275 @@ int poll(int channel)
   return 0;
 }
 
-/* Read count sectors, starting at start, from dev into buf. */
-int ata_read(ata_dev_t *dev, int start, int count, void *buf) {
-  /* TODO: Esta función deberá leer count sectores, comenzando en el sector
-   *       start, del dispositivo dev al buffer buf.
-   *       Solo es necesario realizar la lectura en dispositivos ATA, no ATAPI.
-   *       La función debe de garantizar que se ha leído todo lo que se
-   *       solicitó, de lo contrario deberá reportar un error.
-   *       0 como valor de retorno indica éxito, -1 indica fallo. */
-  int i, j;
+/* Selects dev and programs the task file for a command over count sectors
+ * (1 to ATA_MAX_SECTORS) starting at start. Ranges reaching beyond the LBA28
+ * limit are sent with 48-bit addressing using cmd_ext instead of cmd.
+ * Returns 1 if the command went out as LBA48, 0 if LBA28 and -1 if the range
+ * can't be addressed by the device. */
+int ata_issue(ata_dev_t *dev, u8 cmd, u8 cmd_ext, u32 start, u32 count)
+{
   u16 ch = ata_bus_port[dev->channel];
-  u16 *ptr = (u16*)buf;
+
+  if(ata_identify(dev) == -1)
+    return -1;
 
   while(inb(ATA_REG_STATUS(ch)) & ATA_SR_BSY);
 
-  outb(ATA_REG_DEVSEL(ch), 0xE0 | ((dev->drive) << 4) );
-  outb(ATA_REG_ERROR(ch), 0);
-  outb(ATA_REG_SECCOUNT0(ch), count);
-  outb(ATA_REG_LBA0(ch),(start & 0x000000FF));
-  outb(ATA_REG_LBA1(ch),((start & 0x0000FF00)>>8));
-  outb(ATA_REG_LBA2(ch),((start & 0x00FF0000)>>16));
-  outb(ATA_REG_COMMAND(ch),ATA_CMD_READ_PIO);
+  ata_irq_fired[dev->channel] = 0;
+
+  if(start + count <= ATA_LBA28_LIMIT)
+  {
+    outb(ATA_REG_DEVSEL(ch), 0xE0 | ((dev->drive) << 4) | ((start >> 24) & 0x0F));
+    outb(ATA_REG_ERROR(ch), 0);
+    outb(ATA_REG_SECCOUNT0(ch), (unsigned char)count);
+    outb(ATA_REG_LBA0(ch),(unsigned char)(start & 0x000000FF));
+    outb(ATA_REG_LBA1(ch),(unsigned char)((start & 0x0000FF00)>>8));
+    outb(ATA_REG_LBA2(ch),(unsigned char)((start & 0x00FF0000)>>16));
+    outb(ATA_REG_COMMAND(ch), cmd);
+    return 0;
+  }
+
+  if(!ATA_SUPPORTS_LBA48(dev))
+    return -1;
+
+  /* LBA48 registers are two bytes deep: high order bytes go first. Our
+   * sector numbers are 32 bits wide, so bits 32 to 47 are always zero. */
+  outb(ATA_REG_DEVSEL(ch), ATA_USE_LBA | ((dev->drive) << 4));
+  outb(ATA_REG_SECCOUNT0(ch), (unsigned char)(count >> 8));
+  outb(ATA_REG_LBA0(ch), (unsigned char)(start >> 24));
+  outb(ATA_REG_LBA1(ch), 0);
+  outb(ATA_REG_LBA2(ch), 0);
+  outb(ATA_REG_SECCOUNT0(ch), (unsigned char)count);
+  outb(ATA_REG_LBA0(ch),(unsigned char)(start & 0x000000FF));
+  outb(ATA_REG_LBA1(ch),(unsigned char)((start & 0x0000FF00)>>8));
+  outb(ATA_REG_LBA2(ch),(unsigned char)((start & 0x00FF0000)>>16));
+  outb(ATA_REG_COMMAND(ch), cmd_ext);
+  return 1;
+}
+
+/* After a failed command the task file holds the address of the first
+ * sector the device could not handle. */
+u32 ata_error_lba(ata_dev_t *dev, int lba48)
+{
+  u16 ch = ata_bus_port[dev->channel];
+  u16 ctrl = ata_bus_control[dev->channel];
+  u32 lba;
+
+  lba = inb(ATA_REG_LBA0(ch)) |
+        (inb(ATA_REG_LBA1(ch)) << 8) |
+        (inb(ATA_REG_LBA2(ch)) << 16);
+
+  if(lba48)
+  {
+    outb(ATA_CH_REG_CONTROL(ctrl), ATA_CTRL_HOB);
+    lba |= inb(ATA_REG_LBA0(ch)) << 24;
+    outb(ATA_CH_REG_CONTROL(ctrl), 0);
+  }
+  else
+    lba |= (inb(ATA_REG_DEVSEL(ch)) & 0x0F) << 24;
+
+  return lba;
+}
+
+/* Handles IRQs 14 and 15. Reading the regular status register acknowledges
+ * the interrupt on the device side. */
+void ata_interrupt_handler(itr_cpu_regs_t regs,
+                           itr_intr_data_t intr,
+                           itr_stack_state_t stack)
+{
+  u8 channel = intr.irq == PIC_PRIMARY_ATA_IRQ ? ATA_CHANNEL_PRIMARY
+                                               : ATA_CHANNEL_SECONDARY;
+  IO_ACCT_BEGIN(IO_OP_ATA_IRQ);
+
+  inb(ATA_REG_STATUS(ata_bus_port[channel]));
+  ata_irq_fired[channel] = 1;
+  pic_send_eoi(intr.irq);
+  IO_ACCT_END();
+}
+
+/* Waits until dev is ready to move the next data block. Drives whose recent
+ * waits were short are spun on; the rest sleep until their IRQ arrives, if
+ * the caller says the device will raise one. */
+int ata_wait_data(ata_dev_t *dev, int irq_expected)
+{
+  u8 status, slept = 0;
+  u32 elapsed, start_tick, flags;
+  u64 start;
+  u16 ctrl = ata_bus_control[dev->channel];
+  ata_completion_stats_t *st = ata_stats + ATA_SLOT(dev);
+
+  start = hw_rdtsc();
+  ata_delay400(ctrl);
+
+  /* Callers may have interrupts off, e.g. the page fault handler reading in
+   * a mapped page. No IRQ can wake them, so they always spin. */
+  flags = hw_cli_save();
+  if(irq_expected && ata_irq_ready && (flags & HW_EFLAGS_IF) &&
+     st->latency >= ata_spin_threshold)
+  {
+    st->sleeps++;
+    slept = 1;
+    start_tick = timer_ticks();
+    while(!ata_irq_fired[dev->channel])
+    {
+      if(timer_ticks() - start_tick > ATA_IRQ_TIMEOUT_TICKS)
+      {
+        st->timeouts++;
+        break;
+      }
+      hw_sti_hlt();
+      hw_cli();
+    }
+  }
+  else
+    st->spins++;
+  hw_restore_flags(flags);
+
+  /* Either we are spinning or the IRQ said the device is done, so this is
+   * at most a few reads. ALTSTATUS doesn't acknowledge the interrupt. */
+  while((status = inb(ATA_CH_REG_ALTSTATUS(ctrl))) & ATA_SR_BSY);
+  while(!(status & (ATA_SR_DRQ | ATA_SR_ERR | ATA_SR_DF)))
+    status = inb(ATA_CH_REG_ALTSTATUS(ctrl));
+
+  elapsed = (u32)(hw_rdtsc() - start);
+  if(slept)
+    st->latency -= st->latency / 8;
+  else
+    st->latency = st->latency - st->latency / 8 + elapsed / 8;
+
+  if((status & ATA_SR_ERR) || (status & ATA_SR_DF))
+    return -1;
+  return 0;
+}
+
+/* Split-phase transfers. ata_start_read/ata_start_write only issue the
+ * command, leaving the caller to move each of the count sectors with
+ * ata_pio_in/ata_pio_out whenever it suits it, e.g. while the drive on the
+ * other channel is busy. count must not exceed ATA_MAX_SECTORS. */
+int ata_start_read(ata_dev_t *dev, u32 start, u32 count)
+{
+  return ata_issue(dev, ATA_CMD_READ_PIO, ATA_CMD_READ_PIO_EXT, start, count)
+         == -1 ? -1 : 0;
+}
+
+int ata_start_write(ata_dev_t *dev, u32 start, u32 count)
+{
+  return ata_issue(dev, ATA_CMD_WRITE_PIO, ATA_CMD_WRITE_PIO_EXT, start, count)
+         == -1 ? -1 : 0;
+}
+
+/* Moves the next sector of an outstanding read command into buf. */
+int ata_pio_in(ata_dev_t *dev, void *buf)
+{
+  int j;
+  u16 ch = ata_bus_port[dev->channel];
+  u16 *ptr = (u16 *)buf;
+
+  if(ata_wait_data(dev, TRUE))
+    return -1;
+  ata_irq_fired[dev->channel] = 0;
+  for(j = 0; j < 256; ++j)
+    ptr[j] = inw(ATA_REG_DATA(ch));
+  return 0;
+}
+
+/* Moves the next sector of an outstanding write command from buf. The
+ * device raises no IRQ before the first sector of a write, so first must
+ * be set for it. */
+int ata_pio_out(ata_dev_t *dev, void *buf, int first)
+{
+  int j;
+  u16 ch = ata_bus_port[dev->channel];
+  u16 *ptr = (u16 *)buf;
 
-  for(i = 0; i < count; ++i)
+  if(ata_wait_data(dev, !first))
+    return -1;
+  ata_irq_fired[dev->channel] = 0;
+  for(j = 0; j < 256; ++j)
+    outw(ATA_REG_DATA(ch), ptr[j]);
+  return 0;
+}
+
+/* PIO data-in transfer of count sectors from start into buf. */
+static int ata_pio_read(ata_dev_t *dev, int start, int count, void *buf)
+{
+  int i, n;
+  u8 *ptr = (u8 *)buf;
+
+  for(; count > 0; start += n, count -= n)
   {
-    if(poll(ch))
+    n = count > ATA_MAX_SECTORS ? ATA_MAX_SECTORS : count;
+    if(ata_issue(dev, ATA_CMD_READ_PIO, ATA_CMD_READ_PIO_EXT, start, n) == -1)
       return -1;
-    for(j = 0; j < 256; ++j)
-      ptr[i*256 + j] = inw(ATA_REG_DATA(ch));
+
+    for(i = 0; i < n; ++i, ptr += ATA_SECTOR_SIZE)
+      if(ata_pio_in(dev, ptr))
+        return -1;
   }
 
   return 0;
 }
 
+/* PIO data-out transfer of count sectors from buf to start, verified
+ * afterwards if the device asks for it. */
+static int ata_pio_write(ata_dev_t *dev, int start, int count, void *buf)
+{
+  int i, n;
+  u32 bad;
+  u8 *ptr = (u8 *)buf;
+
+  for(; count > 0; start += n, count -= n)
+  {
+    n = count > ATA_MAX_SECTORS ? ATA_MAX_SECTORS : count;
+    if(ata_issue(dev, ATA_CMD_WRITE_PIO, ATA_CMD_WRITE_PIO_EXT, start, n) == -1)
+      return -1;
+
+    for(i = 0; i < n; ++i, ptr += ATA_SECTOR_SIZE)
+      if(ata_pio_out(dev, ptr, i == 0))
+        return -1;
+
+    if(dev->flags & ATA_FLAG_VERIFY)
+    {
+      /* The data must reach the media before asking the drive to check it,
+       * otherwise we could be verifying its write cache. */
+      if(ata_flush(dev))
+        return -1;
+      if(ata_verify(dev, start, n, &bad))
+      {
+        fb_printf("ata: verify failed in [%dd, %dd), bad lba %dd\n",
+                  start, start + n, bad);
+        return -1;
+      }
+    }
+  }
+  
+  return 0;
+
+}
+
+/* Read count sectors, starting at start, from dev into buf. */
+int ata_read(ata_dev_t *dev, int start, int count, void *buf) {
+  /* TODO: Esta función deberá leer count sectores, comenzando en el sector
+   *       start, del dispositivo dev al buffer buf.
+   *       Solo es necesario realizar la lectura en dispositivos ATA, no ATAPI.
+   *       La función debe de garantizar que se ha leído todo lo que se
+   *       solicitó, de lo contrario deberá reportar un error.
+   *       0 como valor de retorno indica éxito, -1 indica fallo. */
+  int ret;
+  u64 t0;
+
+  if(ATA_IS_VIRTUAL(dev))
+    return dev->ops->read(dev, start, count, buf);
+
+  IO_ACCT_BEGIN(IO_OP_ATA_READ);
+  t0 = hw_rdtsc();
+  ret = ata_pio_read(dev, start, count, buf);
+  trace_record(TRACE_OP_READ, dev, start, count, t0, ret);
+  qos_account(qos_class(), count, hw_rdtsc() - t0);
+  IO_ACCT_END();
+  return ret;
+}
+
 int ata_write(ata_dev_t *dev, int start, int count, void *buf) {
   /* TODO: Esta función deberá escribir count sectores, comenzando en el sector
    *       start, hacia el dispositivo dev desde el buffer buf.
@@ -306,29 +689,202 @@ int ata_write(ata_dev_t *dev, int start, int count, void *buf) {
    *       ATAPI. La función debe de garantizar que se ha escrito todo lo que
    *       se solicitó, de lo contrario deberá reportar un error.
    *       0 como valor de retorno indica éxito, -1 indica fallo. */
-  
-  int i, j;
+  int ret;
+  u64 t0;
+
+  if(ATA_IS_VIRTUAL(dev))
+    return dev->ops->write(dev, start, count, buf);
+
+  IO_ACCT_BEGIN(IO_OP_ATA_WRITE);
+  t0 = hw_rdtsc();
+  ret = ata_pio_write(dev, start, count, buf);
+  trace_record(TRACE_OP_WRITE, dev, start, count, t0, ret);
+  qos_account(qos_class(), count, hw_rdtsc() - t0);
+  IO_ACCT_END();
+  return ret;
+}
+
+/* Waits for the drive on dev to leave BSY after a non-data command or
+ * after the last sector of a write. */
+int ata_wait_done(ata_dev_t *dev)
+{
+  u8 status;
   u16 ch = ata_bus_port[dev->channel];
-  u16 *ptr = (u16 *)buf;
 
+  delay(ch, 400);
+  while((status = inb(ATA_REG_STATUS(ch))) & ATA_SR_BSY);
+
+  if((status & ATA_SR_ERR) || (status & ATA_SR_DF))
+    return -1;
+  return 0;
+}
+
+/* Flushes the device's write cache. */
+int ata_flush(ata_dev_t *dev)
+{
+  int ret;
+  u16 ch = ata_bus_port[dev->channel];
+
+  if(ata_identify(dev) == -1)
+    return -1;
+
+  IO_ACCT_BEGIN(IO_OP_ATA_FLUSH);
   while(inb(ATA_REG_STATUS(ch)) & ATA_SR_BSY);
+  outb(ATA_REG_DEVSEL(ch), 0xE0 | ((dev->drive) << 4));
+  outb(ATA_REG_COMMAND(ch), ATA_SUPPORTS_LBA48(dev) ? ATA_CMD_CACHE_FLUSH_EXT
+                                                     : ATA_CMD_CACHE_FLUSH);
+  ret = ata_wait_done(dev);
+  IO_ACCT_END();
+  return ret;
+}
 
-  outb(ATA_REG_DEVSEL(ch), 0xE0 | ((dev->drive) << 4) );
-  outb(ATA_REG_ERROR(ch), 0);
-  outb(ATA_REG_SECCOUNT0(ch), (unsigned char)count);
-  outb(ATA_REG_LBA0(ch),(unsigned char)(start & 0x000000FF));
-  outb(ATA_REG_LBA1(ch),(unsigned char)((start & 0x0000FF00)>>8));
-  outb(ATA_REG_LBA2(ch),(unsigned char)((start & 0x00FF0000)>>16));
-  outb(ATA_REG_COMMAND(ch),ATA_CMD_WRITE_PIO);
+/* Asks the drive to read count sectors from start and check them against
+ * their ECC without moving any data over the bus. On failure, the first
+ * sector the drive could not read is stored in bad. */
+int ata_verify(ata_dev_t *dev, int start, int count, u32 *bad)
+{
+  int n, lba48, ret = 0;
+  IO_ACCT_BEGIN(IO_OP_ATA_VERIFY);
 
-  for(i = 0;i < count; ++i)
+  for(; count > 0; start += n, count -= n)
   {
-    if(poll(ch))
+    n = count > ATA_MAX_SECTORS ? ATA_MAX_SECTORS : count;
+    lba48 = ata_issue(dev, ATA_CMD_READ_VERIFY, ATA_CMD_READ_VERIFY_EXT,
+                      start, n);
+    if(lba48 == -1)
+    {
+      *bad = start;
+      ret = -1;
+      break;
+    }
+    if(ata_wait_done(dev))
+    {
+      *bad = ata_error_lba(dev, lba48);
+      ret = -1;
+      break;
+    }
+  }
+
+  IO_ACCT_END();
+  return ret;
+}
+
+/* Turns verify-after-write on or off for dev. */
+void ata_set_verify(ata_dev_t *dev, int on)
+{
+  if(on)
+    dev->flags |= ATA_FLAG_VERIFY;
+  else
+    dev->flags &= ~ATA_FLAG_VERIFY;
+}
+
+/* Copies the completion counters of dev into stats. */
+void ata_completion_stats(ata_dev_t *dev, ata_completion_stats_t *stats)
+{
+  *stats = ata_stats[ATA_SLOT(dev)];
+}
+
+/* Sets the expected latency, in TSC cycles, below which waits spin. 0 makes
+ * every wait sleep on the IRQ, 0xffffffff makes every wait spin. */
+void ata_set_spin_threshold(u32 cycles)
+{
+  ata_spin_threshold = cycles;
+}
+
+/* Bounce buffer for the partial sectors at the edges of ata_pread and
+ * ata_pwrite. Whole sectors never go through it. */
+static u8 ata_bounce[ATA_SECTOR_SIZE];
+
+/* Reads len bytes starting at byte offset of dev into buf. Only the first
+ * and last sectors, when partially covered, go through the bounce buffer;
+ * every whole sector in between is read straight into buf. */
+int ata_pread(ata_dev_t *dev, u64 offset, u32 len, void *buf)
+{
+  u32 lba, skip, n, sectors;
+  u8 *dst = (u8 *)buf;
+
+  lba = (u32)(offset / ATA_SECTOR_SIZE);
+  skip = (u32)(offset % ATA_SECTOR_SIZE);
+
+  /* Unaligned head. */
+  if(len > 0 && (skip != 0 || len < ATA_SECTOR_SIZE))
+  {
+    if(ata_read(dev, lba, 1, ata_bounce))
       return -1;
-    for(j = 0;j < 256 ; ++j)
-      outw(ATA_REG_DATA(ch),ptr[i*256 + j]);
+    n = ATA_SECTOR_SIZE - skip < len ? ATA_SECTOR_SIZE - skip : len;
+    memcpy(dst, ata_bounce + skip, n);
+    dst += n;
+    len -= n;
+    lba++;
   }
-  
+
+  /* Whole sectors. */
+  sectors = len / ATA_SECTOR_SIZE;
+  if(sectors > 0)
+  {
+    if(ata_read(dev, lba, sectors, dst))
+      return -1;
+    dst += sectors * ATA_SECTOR_SIZE;
+    len -= sectors * ATA_SECTOR_SIZE;
+    lba += sectors;
+  }
+
+  /* Partial tail. */
+  if(len > 0)
+  {
+    if(ata_read(dev, lba, 1, ata_bounce))
+      return -1;
+    memcpy(dst, ata_bounce, len);
+  }
+
   return 0;
+}
 
+/* Writes len bytes from buf to dev starting at byte offset. Partially
+ * covered sectors at both ends are read, patched and written back; whole
+ * sectors are written straight from buf. */
+int ata_pwrite(ata_dev_t *dev, u64 offset, u32 len, void *buf)
+{
+  u32 lba, skip, n, sectors;
+  u8 *src = (u8 *)buf;
+
+  lba = (u32)(offset / ATA_SECTOR_SIZE);
+  skip = (u32)(offset % ATA_SECTOR_SIZE);
+
+  /* Unaligned head. */
+  if(len > 0 && (skip != 0 || len < ATA_SECTOR_SIZE))
+  {
+    if(ata_read(dev, lba, 1, ata_bounce))
+      return -1;
+    n = ATA_SECTOR_SIZE - skip < len ? ATA_SECTOR_SIZE - skip : len;
+    memcpy(ata_bounce + skip, src, n);
+    if(ata_write(dev, lba, 1, ata_bounce))
+      return -1;
+    src += n;
+    len -= n;
+    lba++;
+  }
+
+  /* Whole sectors. */
+  sectors = len / ATA_SECTOR_SIZE;
+  if(sectors > 0)
+  {
+    if(ata_write(dev, lba, sectors, src))
+      return -1;
+    src += sectors * ATA_SECTOR_SIZE;
+    len -= sectors * ATA_SECTOR_SIZE;
+    lba += sectors;
+  }
+
+  /* Partial tail. */
+  if(len > 0)
+  {
+    if(ata_read(dev, lba, 1, ata_bounce))
+      return -1;
+    memcpy(ata_bounce, src, len);
+    if(ata_write(dev, lba, 1, ata_bounce))
+      return -1;
+  }
+
+  return 0;
 }
@@ -0,0 +1,463 @@
+/* This is the block cache that sits in front of slow devices.
+ *
+ * Block b of a cached device covers sectors b * BCACHE_BLOCK_SECTORS onwards
+ * of its backing device; the last one may be short. Every cached block
+ * counts its hits, halved on every hint save so old heat fades away, and
+ * the blocks with the most hits are the ones saved as hints. A prefetched
+ * block starts with no hits, so if nobody reads it before the next save it
+ * drops out of the hints.
+ */
+
+#include <bcache.h>
+#include <ata.h>
+#include <mem.h>
+#include <iobuf.h>
+#include <timer.h>
+#include <qos.h>
+#include <string.h>
+#include <fb.h>
+#include <typedef.h>
+
+#define BCACHE_FRAMES             ((BCACHE_BLOCKS * BCACHE_BLOCK_BYTES + \
+                                    MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE)
+#define BCACHE_MAX_EXTENTS        ((BCACHE_HINT_SECTORS * 512 - \
+                                    sizeof(struct bcache_header)) / \
+                                   sizeof(struct bcache_extent))
+
+/* Entry flags. */
+#define BCACHE_VALID              0x01
+#define BCACHE_PREFETCHED         0x02  /* Loaded from the hints, not hit. */
+
+struct bcache_header {
+  u32 magic;
+  u32 version;
+  u32 count;                    /* Extents following the header. */
+  u32 sum;                      /* Checksum of the extents. */
+  u32 sizes[BCACHE_MAX_DEVICES];  /* Sectors of every device. */
+};
+
+struct bcache_extent {
+  u16 slot;                     /* Device, in creation order. */
+  u16 blocks;
+  u32 block;                    /* First block. */
+};
+
+struct bcache_entry {
+  u32 block;
+  u32 stamp;                    /* Last use, for LRU. */
+  u16 hits;
+  u8 slot;
+  u8 flags;                     /* BCACHE_VALID, ... */
+};
+
+struct bcache_dev {
+  ata_dev_t *backing;
+};
+
+static int bcache_read(ata_dev_t *dev, int start, int count, void *buf);
+static int bcache_write(ata_dev_t *dev, int start, int count, void *buf);
+
+static ata_dev_ops_t bcache_ops = {bcache_read, bcache_write};
+
+static struct bcache_dev bcache_devs[BCACHE_MAX_DEVICES];
+static int bcache_count;
+static struct bcache_entry bcache_entries[BCACHE_BLOCKS];
+static u8 *bcache_data;
+static u32 bcache_clock;
+static bcache_stats_t bcache_counters;
+
+static ata_dev_t *bcache_hint_dev;
+static u32 bcache_hint_lba;
+static u8 bcache_hints_loaded;
+static u8 bcache_changed;       /* Heat changed since the last save. */
+static u32 bcache_saved;        /* Tick of the last save. */
+static u8 bcache_hints[BCACHE_HINT_SECTORS * 512];
+static u8 bcache_order[BCACHE_BLOCKS];
+
+void bcache_init() {
+  bcache_count = 0;
+  bcache_data = NULL;
+  bcache_clock = 0;
+  bcache_hint_dev = NULL;
+  bcache_hints_loaded = 0;
+  bcache_changed = 0;
+  bcache_saved = timer_ticks();
+  memset(bcache_entries, 0, sizeof(bcache_entries));
+  memset(&bcache_counters, 0, sizeof(bcache_counters));
+}
+
+static u8 *bcache_block(int i) {
+  return bcache_data + i * BCACHE_BLOCK_BYTES;
+}
+
+/* Sectors of block of the device in slot, the last one may be short. */
+static u32 bcache_block_sectors(int slot, u32 block) {
+  u32 size = bcache_devs[slot].backing->size;
+
+  if (size - block * BCACHE_BLOCK_SECTORS < BCACHE_BLOCK_SECTORS)
+    return size - block * BCACHE_BLOCK_SECTORS;
+  return BCACHE_BLOCK_SECTORS;
+}
+
+static int bcache_lookup(int slot, u32 block) {
+  int i;
+
+  for (i = 0; i < BCACHE_BLOCKS; i++)
+    if ((bcache_entries[i].flags & BCACHE_VALID) &&
+        bcache_entries[i].slot == slot && bcache_entries[i].block == block)
+      return i;
+  return -1;
+}
+
+/* Frees the least recently used entry, or takes an empty one. */
+static int bcache_evict() {
+  int i, victim = 0;
+
+  for (i = 0; i < BCACHE_BLOCKS; i++) {
+    if (!(bcache_entries[i].flags & BCACHE_VALID))
+      return i;
+    if (bcache_entries[i].stamp < bcache_entries[victim].stamp)
+      victim = i;
+  }
+  if (bcache_entries[victim].hits > 0)
+    bcache_changed = 1;
+  bcache_entries[victim].flags = 0;
+  return victim;
+}
+
+static void bcache_fill(int i, int slot, u32 block, u16 hits, u8 flags) {
+  bcache_entries[i].slot = slot;
+  bcache_entries[i].block = block;
+  bcache_entries[i].hits = hits;
+  bcache_entries[i].stamp = ++bcache_clock;
+  bcache_entries[i].flags = BCACHE_VALID | flags;
+}
+
+/* Returns the entry with block of the device in slot, reading it on a
+ * miss, or -1 on failure. */
+static int bcache_get(int slot, u32 block) {
+  struct bcache_entry *e;
+  int i, hit;
+
+  i = bcache_lookup(slot, block);
+  hit = i != -1;
+  if (bcache_counters.boot_lookups < BCACHE_BOOT_LOOKUPS) {
+    bcache_counters.boot_lookups++;
+    bcache_counters.boot_hits += hit;
+  }
+
+  if (hit) {
+    e = bcache_entries + i;
+    bcache_counters.hits++;
+    if (e->flags & BCACHE_PREFETCHED) {
+      bcache_counters.useful++;
+      e->flags &= ~BCACHE_PREFETCHED;
+    }
+    if (e->hits == 0)
+      bcache_changed = 1;
+    if (e->hits < 0xffff)
+      e->hits++;
+    e->stamp = ++bcache_clock;
+    return i;
+  }
+
+  bcache_counters.misses++;
+  i = bcache_evict();
+  if (ata_read(bcache_devs[slot].backing, block * BCACHE_BLOCK_SECTORS,
+               bcache_block_sectors(slot, block), bcache_block(i)) == -1)
+    return -1;
+  bcache_fill(i, slot, block, 1, 0);
+  bcache_changed = 1;
+  return i;
+}
+
+static int bcache_read(ata_dev_t *dev, int start, int count, void *buf) {
+  int slot = (struct bcache_dev *)dev->priv - bcache_devs;
+  u32 block, first, n;
+  u8 *ptr = (u8 *)buf;
+  int i;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  while (count > 0) {
+    block = start / BCACHE_BLOCK_SECTORS;
+    first = start % BCACHE_BLOCK_SECTORS;
+    n = BCACHE_BLOCK_SECTORS - first;
+    if (n > count)
+      n = count;
+    if ((i = bcache_get(slot, block)) == -1)
+      return -1;
+    memcpy(ptr, bcache_block(i) + first * 512, n * 512);
+    ptr += n * 512;
+    start += n;
+    count -= n;
+  }
+  return 0;
+}
+
+/* Writes through and patches the cached blocks the request covers. If the
+ * write fails they're dropped, since nobody knows what the disk holds. */
+/* Brings the cached blocks of the device in slot up to date with count
+ * sectors at start just written from buf, or drops them if the write
+ * failed and the disk may hold anything. */
+static void bcache_update(int slot, u32 start, u32 count, u8 *buf,
+                          int failed) {
+  u32 block, first, n;
+  int i;
+
+  while (count > 0) {
+    block = start / BCACHE_BLOCK_SECTORS;
+    first = start % BCACHE_BLOCK_SECTORS;
+    n = BCACHE_BLOCK_SECTORS - first;
+    if (n > count)
+      n = count;
+    if ((i = bcache_lookup(slot, block)) != -1) {
+      if (failed)
+        bcache_entries[i].flags = 0;
+      else
+        memcpy(bcache_block(i) + first * 512, buf, n * 512);
+    }
+    buf += n * 512;
+    start += n;
+    count -= n;
+  }
+}
+
+static int bcache_write(ata_dev_t *dev, int start, int count, void *buf) {
+  struct bcache_dev *d = (struct bcache_dev *)dev->priv;
+  int ret;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  ret = ata_write(d->backing, start, count, buf);
+  bcache_update(d - bcache_devs, start, count, (u8 *)buf, ret == -1);
+  return ret;
+}
+
+static u32 bcache_sum(struct bcache_extent *x, u32 count) {
+  u32 i, sum = count;
+
+  for (i = 0; i < count; i++) {
+    sum = (sum << 5 | sum >> 27) + ((u32)x[i].slot << 16 | x[i].blocks);
+    sum = (sum << 5 | sum >> 27) + x[i].block;
+  }
+  return sum;
+}
+
+int bcache_set_hints(ata_dev_t *dev, u32 lba) {
+  struct bcache_header *h = (struct bcache_header *)bcache_hints;
+
+  bcache_hint_dev = NULL;
+  bcache_hints_loaded = 0;
+  if (ata_identify(dev) == -1 || lba + BCACHE_HINT_SECTORS > dev->size ||
+      ata_read(dev, lba, BCACHE_HINT_SECTORS, bcache_hints) == -1)
+    return -1;
+  bcache_hint_dev = dev;
+  bcache_hint_lba = lba;
+
+  if (h->magic != BCACHE_MAGIC || h->version != BCACHE_VERSION ||
+      h->count > BCACHE_MAX_EXTENTS ||
+      h->sum != bcache_sum((struct bcache_extent *)(h + 1), h->count))
+    return 0;
+  bcache_hints_loaded = 1;
+  return h->count;
+}
+
+/* Reads the extents the hints list for the device in slot, in batches of
+ * up to BCACHE_BATCH_BLOCKS. They were saved sorted, so the disk sees a
+ * sequential sweep. */
+static void bcache_prefetch(int slot) {
+  struct bcache_header *h = (struct bcache_header *)bcache_hints;
+  struct bcache_extent *x = (struct bcache_extent *)(h + 1);
+  ata_dev_t *backing = bcache_devs[slot].backing;
+  u32 i, block, end, n, j, sectors;
+  u8 *batch;
+  int e;
+
+  if (!bcache_hints_loaded || h->sizes[slot] != backing->size)
+    return;
+  batch = (u8 *)iobuf_get(BCACHE_BATCH_BLOCKS * BCACHE_BLOCK_BYTES);
+  if (batch == NULL)
+    return;
+
+  for (i = 0; i < h->count; i++) {
+    if (x[i].slot != slot)
+      continue;
+    block = x[i].block;
+    end = block + x[i].blocks;
+    if (end * BCACHE_BLOCK_SECTORS > backing->size)
+      continue;
+    for (; block < end; block += n) {
+      n = end - block > BCACHE_BATCH_BLOCKS ? BCACHE_BATCH_BLOCKS :
+                                              end - block;
+      sectors = n * BCACHE_BLOCK_SECTORS;
+      if (ata_read(backing, block * BCACHE_BLOCK_SECTORS, sectors,
+                   batch) == -1)
+        continue;
+      bcache_counters.batches++;
+      for (j = 0; j < n; j++) {
+        if (bcache_lookup(slot, block + j) != -1)
+          continue;
+        e = bcache_evict();
+        memcpy(bcache_block(e), batch + j * BCACHE_BLOCK_BYTES,
+               BCACHE_BLOCK_BYTES);
+        bcache_fill(e, slot, block + j, 0, BCACHE_PREFETCHED);
+        bcache_counters.prefetched++;
+      }
+    }
+  }
+  iobuf_put(batch);
+}
+
+int bcache_create(ata_dev_t *dev, ata_dev_t *backing) {
+  int slot;
+
+  if (bcache_count == BCACHE_MAX_DEVICES || ata_identify(backing) == -1 ||
+      backing->size == 0)
+    return -1;
+  if (bcache_data == NULL) {
+    bcache_data = (u8 *)mem_allocate_kernel_frames(BCACHE_FRAMES);
+    if (bcache_data == NULL)
+      return -1;
+  }
+
+  slot = bcache_count++;
+  bcache_devs[slot].backing = backing;
+
+  memset(dev, 0, sizeof(ata_dev_t));
+  dev->present = ATA_DEVICE_PRESENT;
+  dev->flags = ATA_FLAG_IDENTIFIED;
+  dev->type = backing->type;
+  dev->size = backing->size;
+  memcpy(dev->model, "Block cache", 12);
+  dev->ops = &bcache_ops;
+  dev->priv = bcache_devs + slot;
+
+  bcache_prefetch(slot);
+  return 0;
+}
+
+/* Orders bcache_order[0..n) by (slot, block) of the entries. */
+static void bcache_sort(int n) {
+  struct bcache_entry *a, *b;
+  int i, j;
+  u8 t;
+
+  for (i = 1; i < n; i++) {
+    t = bcache_order[i];
+    b = bcache_entries + t;
+    for (j = i; j > 0; j--) {
+      a = bcache_entries + bcache_order[j - 1];
+      if (a->slot < b->slot || (a->slot == b->slot && a->block < b->block))
+        break;
+      bcache_order[j] = bcache_order[j - 1];
+    }
+    bcache_order[j] = t;
+  }
+}
+
+int bcache_save_hints() {
+  struct bcache_header *h = (struct bcache_header *)bcache_hints;
+  struct bcache_extent *x = (struct bcache_extent *)(h + 1);
+  struct bcache_entry *e;
+  int i, j, n = 0, ret;
+
+  if (bcache_hint_dev == NULL)
+    return -1;
+
+  /* Keep the BCACHE_HINT_BLOCKS hottest blocks, hottest first. */
+  for (i = 0; i < BCACHE_BLOCKS; i++) {
+    e = bcache_entries + i;
+    if (!(e->flags & BCACHE_VALID) || e->hits == 0)
+      continue;
+    for (j = n; j > 0 && bcache_entries[bcache_order[j - 1]].hits < e->hits;
+         j--)
+      if (j < BCACHE_HINT_BLOCKS)
+        bcache_order[j] = bcache_order[j - 1];
+    if (j < BCACHE_HINT_BLOCKS)
+      bcache_order[j] = i;
+    if (n < BCACHE_HINT_BLOCKS)
+      n++;
+  }
+
+  /* And save them sorted by position, merged in extents. */
+  bcache_sort(n);
+  memset(bcache_hints, 0, sizeof(bcache_hints));
+  for (i = 0; i < n; i++) {
+    e = bcache_entries + bcache_order[i];
+    if (h->count > 0 && x[h->count - 1].slot == e->slot &&
+        x[h->count - 1].block + x[h->count - 1].blocks == e->block) {
+      x[h->count - 1].blocks++;
+      continue;
+    }
+    x[h->count].slot = e->slot;
+    x[h->count].block = e->block;
+    x[h->count].blocks = 1;
+    h->count++;
+  }
+  for (i = 0; i < bcache_count; i++)
+    h->sizes[i] = bcache_devs[i].backing->size;
+  h->magic = BCACHE_MAGIC;
+  h->version = BCACHE_VERSION;
+  h->sum = bcache_sum(x, h->count);
+
+  /* The heat fades with every save. */
+  for (i = 0; i < BCACHE_BLOCKS; i++)
+    bcache_entries[i].hits >>= 1;
+  bcache_changed = 0;
+  bcache_saved = timer_ticks();
+  bcache_hints_loaded = 0;
+
+  /* Through the cache, which may hold the hint area of a cached disk. */
+  ret = ata_write(bcache_hint_dev, bcache_hint_lba, BCACHE_HINT_SECTORS,
+                  bcache_hints);
+  for (i = 0; i < bcache_count; i++)
+    if (bcache_devs[i].backing == bcache_hint_dev)
+      bcache_update(i, bcache_hint_lba, BCACHE_HINT_SECTORS, bcache_hints,
+                    ret == -1);
+  if (ret == -1)
+    return -1;
+  bcache_counters.saves++;
+  return 0;
+}
+
+int bcache_step() {
+  u8 prev;
+  int ret;
+
+  if (bcache_hint_dev == NULL || !bcache_changed ||
+      timer_ticks() - bcache_saved < BCACHE_HINT_INTERVAL ||
+      !qos_admit(QOS_BACKGROUND, BCACHE_HINT_SECTORS))
+    return 0;
+
+  prev = qos_set_class(QOS_BACKGROUND);
+  ret = bcache_save_hints() == 0;
+  qos_set_class(prev);
+  return ret;
+}
+
+void bcache_stats(bcache_stats_t *stats) {
+  u32 lookups;
+
+  *stats = bcache_counters;
+  lookups = stats->hits + stats->misses;
+  stats->hit_rate = lookups == 0 ? 0 :
+    (u32)div64((u64)stats->hits * 100, lookups);
+  stats->boot_hit_rate = stats->boot_lookups == 0 ? 0 :
+    stats->boot_hits * 100 / stats->boot_lookups;
+}
+
+void bcache_report() {
+  bcache_stats_t s;
+
+  bcache_stats(&s);
+  fb_printf("bcache_report:\n");
+  fb_printf("lookups { hits: %dd, misses: %dd }, hit rate: %dd%%\n",
+            s.hits, s.misses, s.hit_rate);
+  fb_printf("after boot { hits: %dd/%dd }, hit rate: %dd%%\n",
+            s.boot_hits, s.boot_lookups, s.boot_hit_rate);
+  fb_printf("prefetch { blocks: %dd, useful: %dd, reads: %dd }, saves: %dd\n",
+            s.prefetched, s.useful, s.batches, s.saves);
+}
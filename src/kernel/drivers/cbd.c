@@ -0,0 +1,459 @@
+/* This is the driver for the compressed virtual block device.
+ *
+ * Every request is broken in chunks. A chunk that is read is loaded whole
+ * and decompressed; a chunk that is partially written is loaded, patched
+ * and stored back whole. A stored chunk takes the sectors its compressed
+ * image needs, or CBD_CHUNK_SECTORS if it doesn't shrink by at least one
+ * sector, in which case it is stored raw.
+ *
+ * A chunk is never rewritten in place: every store takes a new extent, and
+ * the old one is only retired to the pending list, since the map on disk
+ * may still point to it. cbd_sync moves the pending extents to the free
+ * lists once the map is written, and runs by itself when the pending list
+ * fills up.
+ */
+
+#include <cbd.h>
+#include <ata.h>
+#include <lz.h>
+#include <mem.h>
+#include <timer.h>
+#include <string.h>
+#include <fb.h>
+#include <typedef.h>
+
+#define CBD_MAP_PER_SECTOR        (512 / sizeof(struct cbd_extent))
+
+struct cbd_header {
+  u32 magic;
+  u32 version;
+  u32 chunk_sectors;
+  u32 chunks;
+  u32 map_sectors;
+  u32 next_free;                /* First never used sector. */
+};
+
+struct cbd_extent {
+  u32 lba;                      /* Relative to the start of the partition. */
+  u16 sectors;                  /* 0 for holes. */
+  u16 bytes;                    /* Compressed size, 0 if stored raw. */
+};
+
+struct cbd {
+  ata_dev_t *backing;
+  u32 start;                    /* Partition on the backing device. */
+  u32 sectors;
+  u32 chunks;
+  u32 map_sectors;
+  u32 next_free;
+  struct cbd_extent *map;
+  u32 nfree[CBD_CHUNK_SECTORS];
+  u32 free[CBD_CHUNK_SECTORS][CBD_FREE_SLOTS];
+  u32 npending;
+  struct cbd_extent pending[CBD_PENDING_SLOTS];  /* Freed since the last
+                                                  * sync. */
+  cbd_stats_t stats;
+  u8 chunk[CBD_CHUNK_BYTES];    /* Decompressed chunk. */
+  u8 packed[CBD_CHUNK_BYTES];   /* Compressed chunk. */
+  u8 header[512];               /* Header sector, for cbd_flush. */
+};
+
+static int cbd_read(ata_dev_t *dev, int start, int count, void *buf);
+static int cbd_write(ata_dev_t *dev, int start, int count, void *buf);
+
+static ata_dev_ops_t cbd_ops = {cbd_read, cbd_write};
+
+static void cbd_release(struct cbd *c, u32 lba, u32 n) {
+  if (lba + n == c->next_free)
+    c->next_free -= n;
+  else if (c->nfree[n - 1] < CBD_FREE_SLOTS)
+    c->free[n - 1][c->nfree[n - 1]++] = lba;
+  else
+    c->stats.leaked += n;
+}
+
+/* Allocates an extent of n sectors. Returns its LBA or -1. */
+static int cbd_alloc(struct cbd *c, u32 n) {
+  u32 k, lba;
+
+  if (c->nfree[n - 1] > 0)
+    return c->free[n - 1][--c->nfree[n - 1]];
+
+  if (c->next_free + n <= c->sectors) {
+    lba = c->next_free;
+    c->next_free += n;
+    return lba;
+  }
+
+  /* Out of fresh space, split a bigger free extent. */
+  for (k = n + 1; k <= CBD_CHUNK_SECTORS; k++) {
+    if (c->nfree[k - 1] == 0)
+      continue;
+    lba = c->free[k - 1][--c->nfree[k - 1]];
+    cbd_release(c, lba + n, k - n);
+    return lba;
+  }
+  return -1;
+}
+
+static void cbd_mark(u8 *used, u32 lba, u32 n) {
+  for (; n > 0; lba++, n--)
+    used[lba / 8] |= 1 << (lba % 8);
+}
+
+/* Rebuilds the free lists from the map, getting back what full free lists
+ * leaked and, after a reopen, the holes left by chunks rewritten before.
+ * Extents in the pending list are still in use. */
+static int cbd_rebuild(struct cbd *c) {
+  u32 i, lba, n, first, leaked, size = (c->sectors + 7) / 8;
+  u8 *used;
+
+  if ((used = (u8 *)kalloc(size)) == NULL)
+    return -1;
+  memset(used, 0, size);
+  first = 1 + c->map_sectors;
+  cbd_mark(used, 0, first);
+  for (i = 0; i < c->chunks; i++)
+    if (c->map[i].sectors != 0)
+      cbd_mark(used, c->map[i].lba, c->map[i].sectors);
+  for (i = 0; i < c->npending; i++)
+    cbd_mark(used, c->pending[i].lba, c->pending[i].sectors);
+
+  for (c->next_free = c->sectors;
+       c->next_free > first && !(used[(c->next_free - 1) / 8] &
+                                 (1 << ((c->next_free - 1) % 8)));
+       c->next_free--);
+
+  /* Runs longer than a chunk are handed out in chunk sized pieces. Nothing
+   * is lost for good here, so don't count what doesn't fit as leaked. */
+  memset(c->nfree, 0, sizeof(c->nfree));
+  leaked = c->stats.leaked;
+  for (lba = first; lba < c->next_free; lba += n) {
+    for (n = 0; lba + n < c->next_free && n < CBD_CHUNK_SECTORS &&
+                !(used[(lba + n) / 8] & (1 << ((lba + n) % 8))); n++);
+    if (n == 0)
+      n = 1;
+    else
+      cbd_release(c, lba, n);
+  }
+  c->stats.leaked = leaked;
+  kfree(used);
+  return 0;
+}
+
+/* Writes the header and map of c back to the backing device and hands the
+ * pending extents to the free lists. */
+static int cbd_flush(struct cbd *c) {
+  struct cbd_header *h = (struct cbd_header *)c->header;
+  u32 i;
+
+  memset(c->header, 0, 512);
+  h->magic = CBD_MAGIC;
+  h->version = CBD_VERSION;
+  h->chunk_sectors = CBD_CHUNK_SECTORS;
+  h->chunks = c->chunks;
+  h->map_sectors = c->map_sectors;
+  h->next_free = c->next_free;
+
+  /* Map first, so a crash in between leaves the old header with a map
+   * whose every entry is either old or new, and both still hold their
+   * data. cbd_create takes care of a next_free that is behind the map. */
+  if (ata_write(c->backing, c->start + 1, c->map_sectors, c->map) == -1 ||
+      ata_write(c->backing, c->start, 1, c->header) == -1)
+    return -1;
+
+  for (i = 0; i < c->npending; i++)
+    cbd_release(c, c->pending[i].lba, c->pending[i].sectors);
+  c->npending = 0;
+  return 0;
+}
+
+/* Retires an extent the map no longer points to. It can't be reused until
+ * the map on disk doesn't either. */
+static void cbd_retire(struct cbd *c, u32 lba, u32 n) {
+  if (c->npending == CBD_PENDING_SLOTS && cbd_flush(c) == -1) {
+    c->stats.leaked += n;
+    return;
+  }
+  c->pending[c->npending].lba = lba;
+  c->pending[c->npending].sectors = n;
+  c->npending++;
+}
+
+/* Loads chunk idx, decompressed, into out. */
+static int cbd_load(struct cbd *c, u32 idx, u8 *out) {
+  struct cbd_extent *e = c->map + idx;
+
+  if (e->sectors == 0) {
+    memset(out, 0, CBD_CHUNK_BYTES);
+    return 0;
+  }
+
+  c->stats.physical += e->sectors;
+  if (e->bytes == 0)
+    return ata_read(c->backing, c->start + e->lba, e->sectors, out);
+
+  if (ata_read(c->backing, c->start + e->lba, e->sectors, c->packed) == -1 ||
+      lz_decompress(c->packed, e->bytes, out, CBD_CHUNK_BYTES) !=
+      CBD_CHUNK_BYTES)
+    return -1;
+  return 0;
+}
+
+/* Stores the CBD_CHUNK_BYTES at data as chunk idx. */
+static int cbd_store(struct cbd *c, u32 idx, u8 *data) {
+  struct cbd_extent *e = c->map + idx;
+  struct cbd_extent old = *e;
+  u32 i, len, n;
+  int lba;
+  u8 *src;
+
+  for (i = 0; i < CBD_CHUNK_BYTES && data[i] == 0; i++);
+  if (i == CBD_CHUNK_BYTES) {
+    e->sectors = 0;
+    e->bytes = 0;
+    if (old.sectors != 0)
+      cbd_retire(c, old.lba, old.sectors);
+    c->stats.holes++;
+    return 0;
+  }
+
+  /* Only worth it if it saves at least one sector. */
+  len = lz_compress(data, CBD_CHUNK_BYTES, c->packed, CBD_CHUNK_BYTES - 512);
+  if (len == 0) {
+    n = CBD_CHUNK_SECTORS;
+    src = data;
+  }
+  else {
+    n = (len + 511) / 512;
+    memset(c->packed + len, 0, n * 512 - len);
+    src = c->packed;
+  }
+
+  /* Out of space, the retired extents and what the free lists leaked may
+   * be enough. */
+  if ((lba = cbd_alloc(c, n)) == -1) {
+    if (c->npending > 0 && cbd_flush(c) == -1)
+      return -1;
+    if (cbd_rebuild(c) == -1 || (lba = cbd_alloc(c, n)) == -1)
+      return -1;
+  }
+
+  /* Never referenced by any map, so it can be freed right away. */
+  if (ata_write(c->backing, c->start + lba, n, src) == -1) {
+    cbd_release(c, lba, n);
+    return -1;
+  }
+
+  e->lba = lba;
+  e->sectors = n;
+  e->bytes = len;
+  if (old.sectors != 0)
+    cbd_retire(c, old.lba, old.sectors);
+  c->stats.physical += n;
+  c->stats.in += CBD_CHUNK_SECTORS;
+  c->stats.out += n;
+  return 0;
+}
+
+static int cbd_read(ata_dev_t *dev, int start, int count, void *buf) {
+  struct cbd *c = (struct cbd *)dev->priv;
+  u32 idx, off, n, t0;
+  u8 *dst = (u8 *)buf;
+  int ret = 0;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  t0 = timer_ticks();
+  c->stats.reads++;
+  c->stats.logical += count;
+  while (count > 0) {
+    idx = start / CBD_CHUNK_SECTORS;
+    off = start % CBD_CHUNK_SECTORS;
+    n = CBD_CHUNK_SECTORS - off;
+    if (n > (u32)count)
+      n = count;
+
+    if (n == CBD_CHUNK_SECTORS) {
+      if ((ret = cbd_load(c, idx, dst)) == -1)
+        break;
+    }
+    else {
+      if ((ret = cbd_load(c, idx, c->chunk)) == -1)
+        break;
+      memcpy(dst, c->chunk + off * 512, n * 512);
+    }
+
+    start += n;
+    count -= n;
+    dst += n * 512;
+  }
+  c->stats.ticks += timer_ticks() - t0;
+  return ret;
+}
+
+static int cbd_write(ata_dev_t *dev, int start, int count, void *buf) {
+  struct cbd *c = (struct cbd *)dev->priv;
+  u32 idx, off, n, t0;
+  u8 *src = (u8 *)buf;
+  int ret = 0;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  t0 = timer_ticks();
+  c->stats.writes++;
+  c->stats.logical += count;
+  while (count > 0) {
+    idx = start / CBD_CHUNK_SECTORS;
+    off = start % CBD_CHUNK_SECTORS;
+    n = CBD_CHUNK_SECTORS - off;
+    if (n > (u32)count)
+      n = count;
+
+    if (n == CBD_CHUNK_SECTORS) {
+      if ((ret = cbd_store(c, idx, src)) == -1)
+        break;
+    }
+    else {
+      if ((ret = cbd_load(c, idx, c->chunk)) == -1)
+        break;
+      memcpy(c->chunk + off * 512, src, n * 512);
+      if ((ret = cbd_store(c, idx, c->chunk)) == -1)
+        break;
+    }
+
+    start += n;
+    count -= n;
+    src += n * 512;
+  }
+  c->stats.ticks += timer_ticks() - t0;
+  return ret;
+}
+
+int cbd_create(ata_dev_t *dev, ata_dev_t *backing, u32 start, u32 sectors,
+               u32 logical) {
+  struct cbd *c;
+  struct cbd_header *h;
+  struct cbd_extent *e;
+  u32 chunks, map_sectors, i;
+
+  chunks = (logical + CBD_CHUNK_SECTORS - 1) / CBD_CHUNK_SECTORS;
+  map_sectors = (chunks + CBD_MAP_PER_SECTOR - 1) / CBD_MAP_PER_SECTOR;
+  if (ata_identify(backing) == -1 ||
+      logical == 0 || start + sectors > backing->size ||
+      start + sectors < start || 1 + map_sectors >= sectors)
+    return -1;
+
+  if ((c = (struct cbd *)kalloc(sizeof(struct cbd))) == NULL)
+    return -1;
+  if ((c->map = (struct cbd_extent *)kalloc(map_sectors * 512)) == NULL) {
+    kfree(c);
+    return -1;
+  }
+
+  memset(c->nfree, 0, sizeof(c->nfree));
+  memset(&c->stats, 0, sizeof(c->stats));
+  c->npending = 0;
+  c->backing = backing;
+  c->start = start;
+  c->sectors = sectors;
+  c->chunks = chunks;
+  c->map_sectors = map_sectors;
+
+  /* Open it if the geometry matches, format it otherwise. A header or map
+   * that can't be read is an error, formatting would wipe the device. */
+  h = (struct cbd_header *)c->header;
+  if (ata_read(backing, start, 1, c->header) == -1)
+    goto fail;
+  if (h->magic == CBD_MAGIC && h->version == CBD_VERSION &&
+      h->chunk_sectors == CBD_CHUNK_SECTORS && h->chunks == chunks &&
+      h->map_sectors == map_sectors && h->next_free <= sectors) {
+    if (ata_read(backing, start + 1, map_sectors, c->map) == -1)
+      goto fail;
+    /* A crash in the middle of a sync can leave extents of the new map
+     * beyond the old header's next_free. An extent outside the data area
+     * means the map is corrupt, and trusting it would overrun buffers. */
+    c->next_free = h->next_free;
+    for (i = 0, e = c->map; i < chunks; i++, e++) {
+      if (e->sectors == 0)
+        continue;
+      if (e->sectors > CBD_CHUNK_SECTORS || e->lba < 1 + map_sectors ||
+          e->lba + e->sectors > sectors || e->lba + e->sectors < e->lba)
+        goto fail;
+      if (e->lba + e->sectors > c->next_free)
+        c->next_free = e->lba + e->sectors;
+    }
+    if (cbd_rebuild(c) == -1)
+      goto fail;
+  }
+  else {
+    memset(c->map, 0, map_sectors * 512);
+    c->next_free = 1 + map_sectors;
+  }
+
+  dev->present = ATA_DEVICE_PRESENT;
+  dev->channel = backing->channel;
+  dev->drive = backing->drive;
+  dev->flags = 0;
+  dev->type = ATA_TYPE_ATA;
+  dev->signature = 0;
+  dev->capabilities = 0;
+  dev->commandsets = 0;
+  dev->size = logical;
+  strcpy(dev->model, "Compressed block device");
+  dev->ops = &cbd_ops;
+  dev->priv = c;
+
+  if (cbd_sync(dev) == -1) {
+    dev->present = ATA_DEVICE_EMPTY;
+    dev->ops = NULL;
+    dev->priv = NULL;
+    goto fail;
+  }
+  return 0;
+
+fail:
+  kfree(c->map);
+  kfree(c);
+  return -1;
+}
+
+int cbd_sync(ata_dev_t *dev) {
+  return cbd_flush((struct cbd *)dev->priv);
+}
+
+int cbd_close(ata_dev_t *dev) {
+  struct cbd *c = (struct cbd *)dev->priv;
+  int ret;
+
+  ret = cbd_sync(dev);
+  dev->present = ATA_DEVICE_EMPTY;
+  dev->ops = NULL;
+  dev->priv = NULL;
+  kfree(c->map);
+  kfree(c);
+  return ret;
+}
+
+void cbd_stats(ata_dev_t *dev, cbd_stats_t *stats) {
+  struct cbd *c = (struct cbd *)dev->priv;
+
+  *stats = c->stats;
+  stats->ratio = stats->out == 0 ? 0 : stats->in * 100 / stats->out;
+  stats->rate = stats->ticks == 0 ? 0 :
+                (u32)div64((u64)stats->logical * timer_hz(), stats->ticks);
+}
+
+void cbd_report(ata_dev_t *dev) {
+  cbd_stats_t s;
+
+  cbd_stats(dev, &s);
+  fb_printf("cbd_report:\n");
+  fb_printf("requests { reads: %dd, writes: %dd }\n", s.reads, s.writes);
+  fb_printf("sectors { logical: %dd, physical: %dd, holes: %dd, "
+            "leaked: %dd }\n", s.logical, s.physical, s.holes, s.leaked);
+  fb_printf("ratio: %dd.%dd%dd, rate: %dd sectors/s\n", s.ratio / 100,
+            s.ratio / 10 % 10, s.ratio % 10, s.rate);
+}
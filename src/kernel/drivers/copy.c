@@ -0,0 +1,223 @@
+/* This is the engine that copies sectors from one device to another.
+ *
+ * The pipelined path keeps one command outstanding on each channel:
+ *
+ *   source  | read N |------ read N+1 -----|------ read N+2 ----- ...
+ *   CPU     | pull N | push N | pull N+1  | push N+1 | pull N+2  ...
+ *   dest    |        | write N ---------->| write N+1 -------->  ...
+ *
+ * As soon as chunk N has been pulled from the source the read of chunk N+1
+ * is issued, so the source drive seeks and fills its buffer while the CPU
+ * pushes chunk N to the destination, and the destination drive commits
+ * chunk N while the CPU pulls chunk N+1. Chunk N is pushed in full before
+ * chunk N+1 is pulled, so a single buffer is all it takes.
+ */
+
+#include <copy.h>
+#include <ata.h>
+#include <iobuf.h>
+#include <fb.h>
+#include <timer.h>
+#include <qos.h>
+#include <trace.h>
+#include <hw.h>
+#include <string.h>
+#include <typedef.h>
+
+#define COPY_SECTOR_SIZE          512
+#define COPY_CHUNK_BYTES          (COPY_CHUNK_SECTORS * COPY_SECTOR_SIZE)
+#define COPY_PROGRESS_STEPS       16
+
+static int copy_is_zero(void *buf, u32 sectors) {
+  u32 i, *p = (u32 *)buf;
+
+  for (i = 0; i < sectors * COPY_SECTOR_SIZE / sizeof(u32); i++)
+    if (p[i] != 0)
+      return 0;
+  return 1;
+}
+
+static void copy_progress(u32 flags, u32 done, u32 count, u32 *step) {
+  u32 s;
+
+  if (!(flags & COPY_VERBOSE))
+    return;
+  s = (u32)div64((u64)done * COPY_PROGRESS_STEPS, count);
+  if (s == *step && done != count)
+    return;
+  *step = s;
+  fb_printf("copy: %dd/%dd sectors\r", done, count);
+}
+
+/* Plain copy for devices sharing a channel, where nothing can overlap. */
+static int copy_sequential(ata_dev_t *src, u32 src_lba, ata_dev_t *dst,
+                           u32 dst_lba, u32 count, u32 flags, u8 *buf,
+                           copy_stats_t *st) {
+  u32 n, done, step = 0;
+
+  for (done = 0; done < count; done += n) {
+    n = count - done < COPY_CHUNK_SECTORS ? count - done : COPY_CHUNK_SECTORS;
+    qos_wait(QOS_BACKGROUND, n);
+    if (ata_read(src, src_lba + done, n, buf))
+      return -1;
+    st->sectors += n;
+    if ((flags & COPY_SKIP_ZERO) && copy_is_zero(buf, n)) {
+      st->skipped += n;
+    }
+    else {
+      qos_wait(QOS_BACKGROUND, n);
+      if (ata_write(dst, dst_lba + done, n, buf))
+        return -1;
+      st->written += n;
+    }
+    copy_progress(flags, done + n, count, &step);
+  }
+  return 0;
+}
+
+/* Waits for the destination to finish the write of the n sectors at lba
+ * issued at t0, then verifies them if dst asks for it, like ata_write does. */
+static int copy_finish_write(ata_dev_t *dst, u32 lba, u32 n, u64 t0) {
+  u32 bad;
+  int ret;
+
+  ret = ata_wait_done(dst);
+  if (ret == 0 && (dst->flags & ATA_FLAG_VERIFY)) {
+    if (ata_flush(dst) || ata_verify(dst, lba, n, &bad)) {
+      fb_printf("copy: verify failed in [%dd, %dd)\n", lba, lba + n);
+      ret = -1;
+    }
+  }
+  trace_record(TRACE_OP_WRITE, dst, lba, n, t0, ret);
+  qos_account(QOS_BACKGROUND, n, hw_rdtsc() - t0);
+  return ret;
+}
+
+/* The split-phase requests bypass ata_read and ata_write, so they are
+ * accounted to QoS and the trace here. On failure neither channel is left
+ * with a command outstanding: the sectors of a read that were not pulled
+ * are drained into buf and a pending write is waited for. */
+static int copy_pipelined(ata_dev_t *src, u32 src_lba, ata_dev_t *dst,
+                          u32 dst_lba, u32 count, u32 flags, u8 *buf,
+                          copy_stats_t *st) {
+  u32 i, n, next, done, pending, wr_lba = 0, wr_n = 0, step = 0;
+  u64 t_rd, t_wr = 0;
+  int writing = 0;
+
+  n = count < COPY_CHUNK_SECTORS ? count : COPY_CHUNK_SECTORS;
+  qos_wait(QOS_BACKGROUND, n);
+  t_rd = hw_rdtsc();
+  if (ata_start_read(src, src_lba, n)) {
+    trace_record(TRACE_OP_READ, src, src_lba, n, t_rd, -1);
+    return -1;
+  }
+  pending = n;
+
+  for (done = 0; done < count; done += n) {
+    n = pending;
+
+    /* Pull chunk N. A failed sector ends the command. */
+    for (i = 0; i < n; i++) {
+      if (ata_pio_in(src, buf + i * COPY_SECTOR_SIZE)) {
+        pending = 0;
+        trace_record(TRACE_OP_READ, src, src_lba + done, n, t_rd, -1);
+        goto fail;
+      }
+    }
+    pending = 0;
+    st->sectors += n;
+    trace_record(TRACE_OP_READ, src, src_lba + done, n, t_rd, 0);
+    qos_account(QOS_BACKGROUND, n, hw_rdtsc() - t_rd);
+
+    /* Get the source drive going on chunk N+1. */
+    next = count - done - n;
+    if (next > COPY_CHUNK_SECTORS)
+      next = COPY_CHUNK_SECTORS;
+    if (next > 0) {
+      qos_wait(QOS_BACKGROUND, next);
+      t_rd = hw_rdtsc();
+      if (ata_start_read(src, src_lba + done + n, next)) {
+        trace_record(TRACE_OP_READ, src, src_lba + done + n, next, t_rd, -1);
+        goto fail;
+      }
+      pending = next;
+    }
+
+    /* Push chunk N once the destination is done with chunk N-1. */
+    if (writing) {
+      writing = 0;
+      if (copy_finish_write(dst, wr_lba, wr_n, t_wr))
+        goto fail;
+    }
+    if ((flags & COPY_SKIP_ZERO) && copy_is_zero(buf, n)) {
+      st->skipped += n;
+    }
+    else {
+      qos_wait(QOS_BACKGROUND, n);
+      t_wr = hw_rdtsc();
+      wr_lba = dst_lba + done;
+      wr_n = n;
+      if (ata_start_write(dst, wr_lba, n)) {
+        trace_record(TRACE_OP_WRITE, dst, wr_lba, n, t_wr, -1);
+        goto fail;
+      }
+      for (i = 0; i < n; i++) {
+        if (ata_pio_out(dst, buf + i * COPY_SECTOR_SIZE, i == 0)) {
+          trace_record(TRACE_OP_WRITE, dst, wr_lba, n, t_wr, -1);
+          goto fail;
+        }
+      }
+      st->written += n;
+      writing = 1;
+    }
+
+    copy_progress(flags, done + n, count, &step);
+  }
+
+  if (writing && copy_finish_write(dst, wr_lba, wr_n, t_wr))
+    return -1;
+  return 0;
+
+fail:
+  while (pending > 0 && ata_pio_in(src, buf) == 0)
+    pending--;
+  if (writing)
+    copy_finish_write(dst, wr_lba, wr_n, t_wr);
+  return -1;
+}
+
+int copy_run(ata_dev_t *src, u32 src_lba, ata_dev_t *dst, u32 dst_lba,
+             u32 count, u32 flags, copy_stats_t *stats) {
+  copy_stats_t st;
+  u8 *buf;
+  u32 t0;
+  int ret;
+  u8 prev;
+
+  memset(&st, 0, sizeof(st));
+  if ((buf = (u8 *)iobuf_get(COPY_CHUNK_BYTES)) == NULL)
+    return -1;
+
+  prev = qos_set_class(QOS_BACKGROUND);
+  t0 = timer_ticks();
+  if (count == 0)
+    ret = 0;
+  else if (!ATA_IS_VIRTUAL(src) && !ATA_IS_VIRTUAL(dst) &&
+           src->channel != dst->channel)
+    ret = copy_pipelined(src, src_lba, dst, dst_lba, count, flags, buf, &st);
+  else
+    ret = copy_sequential(src, src_lba, dst, dst_lba, count, flags, buf, &st);
+
+  st.ticks = timer_ticks() - t0;
+  qos_set_class(prev);
+  st.rate = st.ticks == 0 ? 0 :
+            (u32)div64((u64)st.sectors * timer_hz(), st.ticks);
+  if (flags & COPY_VERBOSE)
+    fb_printf("\ncopy: %dd sectors, %dd written, %dd skipped, %dd sectors/s\n",
+              st.sectors, st.written, st.skipped, st.rate);
+
+  iobuf_put(buf);
+  if (stats != NULL)
+    *stats = st;
+  return ret;
+}
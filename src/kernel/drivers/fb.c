@@ -91,11 +91,13 @@ fb_col_t fb_cur_col() {
 
 void fb_set_cur(fb_row_t r, fb_col_t c) {
   if (r < FB_ROWS && c < FB_COLS) {
+    IO_ACCT_BEGIN(IO_OP_FB_CURSOR);
     cur = FB_COORDS(r, c);
     outb(VGA_CRT_ADDR_PORT, VGA_CRT_CURSOR_LOCATION_HIGH_REGISTER);
     outb(VGA_CRT_DATA_PORT, (unsigned char)(cur >> 8));
     outb(VGA_CRT_ADDR_PORT, VGA_CRT_CURSOR_LOCATION_LOW_REGISTER);
     outb(VGA_CRT_DATA_PORT, (unsigned char)(cur));
+    IO_ACCT_END();
   }
 }
 
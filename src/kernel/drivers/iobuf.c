@@ -0,0 +1,124 @@
+/* This is the pool of aligned buffers used for sector I/O.
+ *
+ * The buffers of a class are one run of frames from the buddy allocator,
+ * which aligns a run of 2^n frames to its size, so every buffer in it is
+ * aligned to its own size too. Free buffers are kept in a stack linked
+ * through their first word, and the class of a buffer is found from the
+ * run its address falls in. A bit per buffer says whether it is handed out,
+ * so iobuf_put can turn down pointers it never gave and double puts.
+ */
+
+#include <iobuf.h>
+#include <mem.h>
+#include <fb.h>
+#include <string.h>
+#include <typedef.h>
+
+struct iobuf_class {
+  u8 *base;
+  void *free;                   /* Top of the free stack. */
+  /* A bit per handed out buffer, sized for the small class, the largest. */
+  u32 used[(IOBUF_SMALL_COUNT + 31) / 32];
+  iobuf_stats_t stats;
+};
+
+static struct iobuf_class iobuf_classes[IOBUF_CLASSES];
+
+static u32 iobuf_sizes[IOBUF_CLASSES] = {512, 4096, 65536};
+static u32 iobuf_counts[IOBUF_CLASSES] = {
+  IOBUF_SMALL_COUNT, IOBUF_PAGE_COUNT, IOBUF_LARGE_COUNT
+};
+
+static char *iobuf_names[IOBUF_CLASSES] = {"512", "4K", "64K"};
+
+int iobuf_init() {
+  struct iobuf_class *c;
+  u32 i, j, frames;
+  u8 *buf;
+
+  for (i = 0; i < IOBUF_CLASSES; i++) {
+    c = iobuf_classes + i;
+    frames = (iobuf_sizes[i] * iobuf_counts[i] + MEM_FRAME_SIZE - 1) /
+             MEM_FRAME_SIZE;
+    c->base = (u8 *)mem_allocate_kernel_frames(frames);
+    if (c->base == NULL)
+      return -1;
+    c->free = NULL;
+    memset(c->used, 0, sizeof(c->used));
+    for (j = iobuf_counts[i]; j > 0; j--) {
+      buf = c->base + (j - 1) * iobuf_sizes[i];
+      *(void **)buf = c->free;
+      c->free = buf;
+    }
+    c->stats.size = iobuf_sizes[i];
+    c->stats.count = iobuf_counts[i];
+    c->stats.used = 0;
+    c->stats.peak = 0;
+    c->stats.gets = 0;
+    c->stats.failures = 0;
+  }
+  return 0;
+}
+
+void *iobuf_get(u32 bytes) {
+  struct iobuf_class *c;
+  void *buf;
+  u32 j;
+  u8 i;
+
+  for (i = 0; i < IOBUF_CLASSES && iobuf_sizes[i] < bytes; i++);
+  if (i == IOBUF_CLASSES)
+    return NULL;
+
+  c = iobuf_classes + i;
+  if ((buf = c->free) == NULL) {
+    c->stats.failures++;
+    return NULL;
+  }
+  c->free = *(void **)buf;
+  j = ((u8 *)buf - c->base) / iobuf_sizes[i];
+  c->used[j / 32] |= 1 << (j % 32);
+  c->stats.gets++;
+  if (++c->stats.used > c->stats.peak)
+    c->stats.peak = c->stats.used;
+  return buf;
+}
+
+void iobuf_put(void *buf) {
+  struct iobuf_class *c;
+  u32 off, j;
+  u8 i;
+
+  for (i = 0; i < IOBUF_CLASSES; i++) {
+    c = iobuf_classes + i;
+    if ((u8 *)buf >= c->base &&
+        (u8 *)buf < c->base + iobuf_sizes[i] * iobuf_counts[i]) {
+      off = (u8 *)buf - c->base;
+      j = off / iobuf_sizes[i];
+      if (off % iobuf_sizes[i] != 0 || !(c->used[j / 32] & (1 << (j % 32))))
+        return; /* Inside a buffer, or a double put. */
+      c->used[j / 32] &= ~(1 << (j % 32));
+      *(void **)buf = c->free;
+      c->free = buf;
+      c->stats.used--;
+      return;
+    }
+  }
+}
+
+void iobuf_stats(u8 cls, iobuf_stats_t *stats) {
+  *stats = iobuf_classes[cls].stats;
+}
+
+void iobuf_report() {
+  iobuf_stats_t *s;
+  u8 i;
+
+  fb_printf("iobuf_report:\n");
+  for (i = 0; i < IOBUF_CLASSES; i++) {
+    s = &iobuf_classes[i].stats;
+    fb_printf("%s { used: %dd/%dd, peak: %dd, gets: %dd, failures: %dd }\n",
+              iobuf_names[i], s->used, s->count, s->peak, s->gets,
+              s->failures);
+  }
+}
@@ -5,6 +5,7 @@
 #include <io.h>
 #include <interrupts.h>
 #include <mem.h>
+#include <arena.h>
 
 /* These are the ports managing the keyboard. Many registers are associated to
  * them. However, none of them is read/write, thus the operation itself
@@ -35,7 +36,7 @@ static int kb_buf_count;      /* Total scan codes in buf */
 int kb_init() {
   kb_buf_head = 0;
   kb_buf_count = 0;
-  kb_buffer = (char *)kalloc(KB_BUF_LEN);
+  kb_buffer = (char *)arena_alloc(&arena_boot, KB_BUF_LEN);
   if (kb_buffer == NULL)
     return -1;
   itr_set_interrupt_handler(PIC_KEYBOARD_IRQ, kb_interrupt_handler,
@@ -50,6 +51,7 @@ void kb_interrupt_handler(itr_cpu_regs_t regs,
   static int len = 0;
 
   int i;
+  IO_ACCT_BEGIN(IO_OP_KB_IRQ);
   partial[len++] = inb(KB_ENCODER_BUF);
 
   do {
@@ -80,6 +82,7 @@ void kb_interrupt_handler(itr_cpu_regs_t regs,
   pic_send_eoi(intr.irq); /* We do this because we're correct people, but the
                            * keyboard actually clears the line when you read
                            * from the encoder's buffer. */
+  IO_ACCT_END();
 }
 
 int kb_scan_code(char *buf) {
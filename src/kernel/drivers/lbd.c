@@ -0,0 +1,636 @@
+/* This is the driver for the log-structured virtual block device.
+ *
+ * Physical blocks are numbered across the segments, so block p lives at
+ * sector p * LBD_BLOCK_SECTORS of the segment area and belongs to segment
+ * p / LBD_SEGMENT_BLOCKS. Besides the map, the device keeps the owner of
+ * every physical block and the count of live blocks of every segment, both
+ * rebuilt from the map when a checkpoint is loaded.
+ *
+ * A segment freed after the last checkpoint may still hold blocks that
+ * checkpoint points to, so it stays pending, not free, until the next
+ * checkpoint is taken. Otherwise a crash could leave the map pointing to
+ * blocks that were already overwritten.
+ */
+
+#include <lbd.h>
+#include <ata.h>
+#include <mem.h>
+#include <timer.h>
+#include <qos.h>
+#include <string.h>
+#include <fb.h>
+#include <typedef.h>
+
+#define LBD_NONE                  0xffffffff
+#define LBD_MAP_PER_SECTOR        (512 / sizeof(u32))
+#define LBD_SEGMENT_BYTES         (LBD_SEGMENT_BLOCKS * LBD_BLOCK_BYTES)
+#define LBD_FRAMES                ((2 * LBD_SEGMENT_BYTES + \
+                                    MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE)
+#define LBD_MAX_RUN               32    /* Blocks read with one command. */
+
+/* Segment states. */
+#define LBD_FREE                  0x00
+#define LBD_OPEN                  0x01
+#define LBD_USED                  0x02
+#define LBD_PENDING               0x03  /* Empty, free after a checkpoint. */
+
+struct lbd_header {
+  u32 magic;
+  u32 version;
+  u32 block_sectors;
+  u32 segment_blocks;
+  u32 blocks;
+  u32 segments;
+  u32 seq;                      /* Checkpoint number, the newest wins. */
+  u32 sum;                      /* Checksum of seq and the map. */
+};
+
+struct lbd {
+  ata_dev_t *backing;
+  u32 start;                    /* Partition on the backing device. */
+  u32 sectors;
+  u32 blocks;                   /* Logical blocks. */
+  u32 map_sectors;
+  u32 data;                     /* First sector of the segment area. */
+  u32 nsegs;
+  u32 nfree;
+  u32 npending;
+  u32 seq;
+  u32 *map;                     /* Logical to physical block. */
+  u32 *owner;                   /* Physical to logical block. */
+  u16 *live;                    /* Live blocks per segment. */
+  u8 *state;                    /* LBD_FREE, ... per segment. */
+  u32 open;                     /* Open segment, nsegs if none. */
+  u32 fill;                     /* Blocks appended to it. */
+  u32 flushed;                  /* Blocks of it already on disk. */
+  u32 cursor;                   /* Where to look for the next free one. */
+  u8 dirty;                     /* Map changed since the checkpoint. */
+  u8 cleaning;
+  u8 *seg;                      /* Open segment. */
+  u8 *victim;                   /* Segment being cleaned. */
+  lbd_stats_t stats;
+  u8 block[LBD_BLOCK_BYTES];    /* Block being patched. */
+  u8 header[512];               /* Checkpoint header. */
+};
+
+static int lbd_read(ata_dev_t *dev, int start, int count, void *buf);
+static int lbd_write(ata_dev_t *dev, int start, int count, void *buf);
+
+static ata_dev_ops_t lbd_ops = {lbd_read, lbd_write};
+
+static struct lbd *lbd_devs[LBD_MAX_DEVICES];
+static int lbd_count;
+static int lbd_next;            /* Device to visit in the next step. */
+
+static u8 lbd_bench_buf[LBD_BLOCK_BYTES];
+
+void lbd_init() {
+  lbd_count = 0;
+  lbd_next = 0;
+}
+
+static u32 lbd_sum(struct lbd *l, u32 seq) {
+  u32 i, sum = seq;
+
+  for (i = 0; i < l->blocks; i++)
+    sum = (sum << 5 | sum >> 27) + l->map[i];
+  return sum;
+}
+
+/* Writes the blocks of the open segment that aren't on disk yet. */
+static int lbd_flush(struct lbd *l) {
+  u32 n = l->fill - l->flushed;
+
+  if (n == 0)
+    return 0;
+  if (ata_write(l->backing, l->start + l->data +
+                (l->open * LBD_SEGMENT_BLOCKS + l->flushed) *
+                LBD_BLOCK_SECTORS, n * LBD_BLOCK_SECTORS,
+                l->seg + l->flushed * LBD_BLOCK_BYTES) == -1)
+    return -1;
+  l->flushed = l->fill;
+  l->stats.segments++;
+  return 0;
+}
+
+static int lbd_checkpoint(struct lbd *l) {
+  struct lbd_header *h = (struct lbd_header *)l->header;
+  u32 i, base;
+
+  if (lbd_flush(l) == -1)
+    return -1;
+
+  /* Map first, the header that makes it valid last. */
+  base = l->start + (l->seq + 1) % 2 * (1 + l->map_sectors);
+  if (ata_write(l->backing, base + 1, l->map_sectors, l->map) == -1)
+    return -1;
+  memset(l->header, 0, 512);
+  h->magic = LBD_MAGIC;
+  h->version = LBD_VERSION;
+  h->block_sectors = LBD_BLOCK_SECTORS;
+  h->segment_blocks = LBD_SEGMENT_BLOCKS;
+  h->blocks = l->blocks;
+  h->segments = l->nsegs;
+  h->seq = l->seq + 1;
+  h->sum = lbd_sum(l, h->seq);
+  if (ata_write(l->backing, base, 1, l->header) == -1)
+    return -1;
+
+  l->seq++;
+  l->dirty = 0;
+  l->stats.checkpoints++;
+  for (i = 0; i < l->nsegs && l->npending > 0; i++) {
+    if (l->state[i] == LBD_PENDING) {
+      l->state[i] = LBD_FREE;
+      l->npending--;
+      l->nfree++;
+    }
+  }
+  return 0;
+}
+
+static void lbd_release(struct lbd *l, u32 seg) {
+  l->state[seg] = LBD_PENDING;
+  l->npending++;
+}
+
+/* Drops the copy of a block at p, if any. */
+static void lbd_invalidate(struct lbd *l, u32 p) {
+  u32 s;
+
+  if (p == LBD_NONE)
+    return;
+  s = p / LBD_SEGMENT_BLOCKS;
+  l->owner[p] = LBD_NONE;
+  l->live[s]--;
+  if (l->live[s] == 0 && l->state[s] == LBD_USED)
+    lbd_release(l, s);
+}
+
+static int lbd_open_segment(struct lbd *l) {
+  u32 i, s;
+
+  for (i = 0; i < l->nsegs; i++) {
+    s = (l->cursor + i) % l->nsegs;
+    if (l->state[s] == LBD_FREE) {
+      l->state[s] = LBD_OPEN;
+      l->nfree--;
+      l->open = s;
+      l->fill = 0;
+      l->flushed = 0;
+      l->cursor = s + 1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static void lbd_close_segment(struct lbd *l) {
+  if (l->live[l->open] == 0)
+    lbd_release(l, l->open);
+  else
+    l->state[l->open] = LBD_USED;
+  l->open = l->nsegs;
+}
+
+static int lbd_clean(struct lbd *l);
+
+/* Appends data as the new copy of logical block b. */
+static int lbd_append(struct lbd *l, u32 b, u8 *data) {
+  u32 p;
+  int ret;
+
+  while (l->open == l->nsegs || l->fill == LBD_SEGMENT_BLOCKS) {
+    if (l->open != l->nsegs) {
+      if (lbd_flush(l) == -1)
+        return -1;
+      lbd_close_segment(l);
+      continue;
+    }
+
+    /* The foreground leaves the reserve to the cleaner, whose appends
+     * may open the next segment themselves. */
+    if (!l->cleaning) {
+      while (l->nfree + l->npending <= LBD_RESERVE_SEGMENTS) {
+        if ((ret = lbd_clean(l)) == -1)
+          return -1;
+        if (ret == 0)
+          break;
+      }
+    }
+    if (l->nfree <= (l->cleaning ? 0 : LBD_RESERVE_SEGMENTS) &&
+        l->npending > 0 && lbd_checkpoint(l) == -1)
+      return -1;
+    if (l->open == l->nsegs && lbd_open_segment(l) == -1)
+      return -1;
+  }
+
+  p = l->open * LBD_SEGMENT_BLOCKS + l->fill;
+  memcpy(l->seg + l->fill * LBD_BLOCK_BYTES, data, LBD_BLOCK_BYTES);
+  lbd_invalidate(l, l->map[b]);
+  l->map[b] = p;
+  l->owner[p] = b;
+  l->live[l->open]++;
+  l->fill++;
+  l->dirty = 1;
+  return 0;
+}
+
+/* Moves the live blocks of the emptiest used segment to the head of the
+ * log. Returns 1 if a segment was emptied, 0 if there was nothing worth
+ * cleaning and -1 on failure. */
+static int lbd_clean(struct lbd *l) {
+  u32 i, v, p;
+  int ret = 1;
+
+  for (i = 0, v = l->nsegs; i < l->nsegs; i++) {
+    if (l->state[i] == LBD_USED && l->live[i] < LBD_SEGMENT_BLOCKS &&
+        (v == l->nsegs || l->live[i] < l->live[v]))
+      v = i;
+  }
+  if (v == l->nsegs)
+    return 0;
+
+  if (ata_read(l->backing, l->start + l->data + v * LBD_SEGMENT_SECTORS,
+               LBD_SEGMENT_SECTORS, l->victim) == -1)
+    return -1;
+
+  l->cleaning = 1;
+  for (i = 0; i < LBD_SEGMENT_BLOCKS; i++) {
+    p = v * LBD_SEGMENT_BLOCKS + i;
+    if (l->owner[p] == LBD_NONE)
+      continue;
+    if (lbd_append(l, l->owner[p], l->victim + i * LBD_BLOCK_BYTES) == -1) {
+      ret = -1;
+      break;
+    }
+    l->stats.cleaned++;
+  }
+  l->cleaning = 0;
+  return ret;
+}
+
+/* Loads logical block b into out. */
+static int lbd_load(struct lbd *l, u32 b, u8 *out) {
+  u32 p = l->map[b];
+
+  if (p == LBD_NONE) {
+    memset(out, 0, LBD_BLOCK_BYTES);
+    return 0;
+  }
+  if (p / LBD_SEGMENT_BLOCKS == l->open) {
+    memcpy(out, l->seg + (p % LBD_SEGMENT_BLOCKS) * LBD_BLOCK_BYTES,
+           LBD_BLOCK_BYTES);
+    return 0;
+  }
+  return ata_read(l->backing, l->start + l->data + p * LBD_BLOCK_SECTORS,
+                  LBD_BLOCK_SECTORS, out);
+}
+
+static int lbd_read(ata_dev_t *dev, int start, int count, void *buf) {
+  struct lbd *l = (struct lbd *)dev->priv;
+  u32 b, off, n, p, run;
+  u8 *dst = (u8 *)buf;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  l->stats.reads++;
+  while (count > 0) {
+    b = start / LBD_BLOCK_SECTORS;
+    off = start % LBD_BLOCK_SECTORS;
+    n = LBD_BLOCK_SECTORS - off;
+    if (n > (u32)count)
+      n = count;
+
+    if (n < LBD_BLOCK_SECTORS) {
+      if (lbd_load(l, b, l->block) == -1)
+        return -1;
+      memcpy(dst, l->block + off * 512, n * 512);
+    }
+    else if ((p = l->map[b]) == LBD_NONE ||
+             p / LBD_SEGMENT_BLOCKS == l->open) {
+      if (lbd_load(l, b, dst) == -1)
+        return -1;
+    }
+    else {
+      /* Blocks written together sit together, read them in one go. */
+      for (run = 1; run < LBD_MAX_RUN &&
+           (run + 1) * LBD_BLOCK_SECTORS <= (u32)count &&
+           l->map[b + run] == p + run &&
+           (p + run) / LBD_SEGMENT_BLOCKS != l->open; run++);
+      n = run * LBD_BLOCK_SECTORS;
+      if (ata_read(l->backing, l->start + l->data + p * LBD_BLOCK_SECTORS,
+                   n, dst) == -1)
+        return -1;
+    }
+
+    start += n;
+    count -= n;
+    dst += n * 512;
+  }
+  return 0;
+}
+
+static int lbd_write(ata_dev_t *dev, int start, int count, void *buf) {
+  struct lbd *l = (struct lbd *)dev->priv;
+  u32 b, off, n;
+  u8 *src = (u8 *)buf;
+
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+
+  l->stats.writes++;
+  while (count > 0) {
+    b = start / LBD_BLOCK_SECTORS;
+    off = start % LBD_BLOCK_SECTORS;
+    n = LBD_BLOCK_SECTORS - off;
+    if (n > (u32)count)
+      n = count;
+
+    if (n == LBD_BLOCK_SECTORS) {
+      if (lbd_append(l, b, src) == -1)
+        return -1;
+    }
+    else {
+      if (lbd_load(l, b, l->block) == -1)
+        return -1;
+      memcpy(l->block + off * 512, src, n * 512);
+      if (lbd_append(l, b, l->block) == -1)
+        return -1;
+    }
+    l->stats.appended++;
+
+    start += n;
+    count -= n;
+    src += n * 512;
+  }
+  return 0;
+}
+
+/* Loads the checkpoint in slot and stores its sequence number in seq, or 0
+ * if it isn't valid. Returns -1 if it couldn't be read. */
+static int lbd_load_checkpoint(struct lbd *l, u32 slot, u32 *seq) {
+  struct lbd_header *h = (struct lbd_header *)l->header;
+  u32 base;
+
+  *seq = 0;
+  base = l->start + slot * (1 + l->map_sectors);
+  if (ata_read(l->backing, base, 1, l->header) == -1)
+    return -1;
+  if (h->magic != LBD_MAGIC || h->version != LBD_VERSION ||
+      h->block_sectors != LBD_BLOCK_SECTORS ||
+      h->segment_blocks != LBD_SEGMENT_BLOCKS ||
+      h->blocks != l->blocks || h->segments != l->nsegs || h->seq == 0)
+    return 0;
+
+  if (ata_read(l->backing, base + 1, l->map_sectors, l->map) == -1)
+    return -1;
+  if (lbd_sum(l, h->seq) == h->sum)
+    *seq = h->seq;
+  return 0;
+}
+
+/* Loads the newest valid checkpoint and rebuilds the owners and live
+ * counts from it. Returns 0 on success, 1 if there's no valid checkpoint
+ * and -1 if the checkpoints couldn't be read. */
+static int lbd_mount(struct lbd *l) {
+  u32 seq0, seq1, i, p;
+
+  if (lbd_load_checkpoint(l, 0, &seq0) == -1 ||
+      lbd_load_checkpoint(l, 1, &seq1) == -1)
+    return -1;
+  if (seq0 == 0 && seq1 == 0)
+    return 1;
+  /* The map in memory may be the one of slot 1, valid or not. */
+  if (seq0 > seq1 &&
+      (lbd_load_checkpoint(l, 0, &seq0) == -1 || seq0 == 0))
+    return -1;
+  l->seq = seq0 > seq1 ? seq0 : seq1;
+
+  for (i = 0; i < l->nsegs * LBD_SEGMENT_BLOCKS; i++)
+    l->owner[i] = LBD_NONE;
+  for (i = 0; i < l->blocks; i++) {
+    p = l->map[i];
+    if (p == LBD_NONE)
+      continue;
+    if (p >= l->nsegs * LBD_SEGMENT_BLOCKS || l->owner[p] != LBD_NONE)
+      return 1;
+    l->owner[p] = i;
+    l->live[p / LBD_SEGMENT_BLOCKS]++;
+  }
+  return 0;
+}
+
+int lbd_create(ata_dev_t *dev, ata_dev_t *backing, u32 start, u32 sectors,
+               u32 logical) {
+  struct lbd *l;
+  u32 i, blocks, map_sectors, data, nsegs;
+  int ret;
+
+  if (lbd_count == LBD_MAX_DEVICES || ata_identify(backing) == -1 ||
+      logical == 0 ||
+      start + sectors > backing->size)
+    return -1;
+
+  blocks = (logical + LBD_BLOCK_SECTORS - 1) / LBD_BLOCK_SECTORS;
+  map_sectors = (blocks + LBD_MAP_PER_SECTOR - 1) / LBD_MAP_PER_SECTOR;
+  data = 2 * (1 + map_sectors);
+  if (data >= sectors)
+    return -1;
+  nsegs = (sectors - data) / LBD_SEGMENT_SECTORS;
+  if (nsegs < LBD_RESERVE_SEGMENTS + 2 ||
+      blocks > (nsegs - LBD_RESERVE_SEGMENTS - 1) * LBD_SEGMENT_BLOCKS)
+    return -1;
+
+  if ((l = (struct lbd *)kalloc(sizeof(struct lbd))) == NULL)
+    return -1;
+  l->map = (u32 *)kalloc(map_sectors * 512);
+  l->owner = (u32 *)kalloc(nsegs * LBD_SEGMENT_BLOCKS * sizeof(u32));
+  l->live = (u16 *)kalloc(nsegs * sizeof(u16));
+  l->state = (u8 *)kalloc(nsegs);
+  l->seg = (u8 *)mem_allocate_kernel_frames(LBD_FRAMES);
+  if (l->map == NULL || l->owner == NULL || l->live == NULL ||
+      l->state == NULL || l->seg == NULL)
+    goto fail;
+  l->victim = l->seg + LBD_SEGMENT_BYTES;
+
+  l->backing = backing;
+  l->start = start;
+  l->sectors = sectors;
+  l->blocks = blocks;
+  l->map_sectors = map_sectors;
+  l->data = data;
+  l->nsegs = nsegs;
+  l->npending = 0;
+  l->cursor = 0;
+  l->cleaning = 0;
+  memset(&l->stats, 0, sizeof(l->stats));
+  memset(l->live, 0, nsegs * sizeof(u16));
+
+  /* Open it if there's a valid checkpoint, format it otherwise. Not if the
+   * checkpoints couldn't be read, that would wipe a device that may be
+   * fine. */
+  l->dirty = 0;
+  if ((ret = lbd_mount(l)) == -1)
+    goto fail;
+  if (ret == 1) {
+    memset(l->live, 0, nsegs * sizeof(u16));
+    for (i = 0; i < nsegs * LBD_SEGMENT_BLOCKS; i++)
+      l->owner[i] = LBD_NONE;
+    for (i = 0; i < map_sectors * LBD_MAP_PER_SECTOR; i++)
+      l->map[i] = LBD_NONE;
+    l->seq = 0;
+    l->dirty = 1;
+  }
+
+  for (i = 0, l->nfree = 0; i < nsegs; i++) {
+    l->state[i] = l->live[i] == 0 ? LBD_FREE : LBD_USED;
+    if (l->state[i] == LBD_FREE)
+      l->nfree++;
+  }
+  l->open = nsegs;
+  l->fill = 0;
+  l->flushed = 0;
+  if (lbd_open_segment(l) == -1 || (l->dirty && lbd_checkpoint(l) == -1))
+    goto fail;
+
+  dev->present = ATA_DEVICE_PRESENT;
+  dev->channel = backing->channel;
+  dev->drive = backing->drive;
+  dev->flags = 0;
+  dev->type = ATA_TYPE_ATA;
+  dev->signature = 0;
+  dev->capabilities = 0;
+  dev->commandsets = 0;
+  dev->size = logical;
+  strcpy(dev->model, "Log-structured block device");
+  dev->ops = &lbd_ops;
+  dev->priv = l;
+
+  lbd_devs[lbd_count++] = l;
+  return 0;
+
+fail:
+  if (l->seg != NULL)
+    mem_release_kernel_frames(l->seg, LBD_FRAMES);
+  if (l->state != NULL)
+    kfree(l->state);
+  if (l->live != NULL)
+    kfree(l->live);
+  if (l->owner != NULL)
+    kfree(l->owner);
+  if (l->map != NULL)
+    kfree(l->map);
+  kfree(l);
+  return -1;
+}
+
+int lbd_sync(ata_dev_t *dev) {
+  struct lbd *l = (struct lbd *)dev->priv;
+
+  if (!l->dirty)
+    return lbd_flush(l);
+  return lbd_checkpoint(l);
+}
+
+int lbd_close(ata_dev_t *dev) {
+  struct lbd *l = (struct lbd *)dev->priv;
+  int i, ret;
+
+  ret = lbd_sync(dev);
+  for (i = 0; i < lbd_count && lbd_devs[i] != l; i++);
+  for (; i + 1 < lbd_count; i++)
+    lbd_devs[i] = lbd_devs[i + 1];
+  lbd_count--;
+  lbd_next = 0;
+
+  dev->present = ATA_DEVICE_EMPTY;
+  dev->ops = NULL;
+  dev->priv = NULL;
+  mem_release_kernel_frames(l->seg, LBD_FRAMES);
+  kfree(l->state);
+  kfree(l->live);
+  kfree(l->owner);
+  kfree(l->map);
+  kfree(l);
+  return ret;
+}
+
+int lbd_step() {
+  struct lbd *l;
+  int clean, ret = 0;
+  u8 prev;
+
+  if (lbd_count == 0)
+    return 0;
+
+  /* Clean ahead of need while a quarter of the log isn't free, then make
+   * the result durable. */
+  l = lbd_devs[lbd_next];
+  clean = l->nfree + l->npending < l->nsegs / 4 + LBD_RESERVE_SEGMENTS;
+  if (clean || l->dirty) {
+    if (!qos_admit(QOS_BACKGROUND, clean ? 2 * LBD_SEGMENT_SECTORS :
+                                           1 + l->map_sectors))
+      return 0;
+    prev = qos_set_class(QOS_BACKGROUND);
+    if (clean)
+      ret = lbd_clean(l) == 1;
+    if (ret == 0 && l->dirty)
+      ret = lbd_checkpoint(l) == 0;
+    qos_set_class(prev);
+  }
+
+  if (ret == 0)
+    lbd_next = (lbd_next + 1) % lbd_count;
+  return ret;
+}
+
+void lbd_stats(ata_dev_t *dev, lbd_stats_t *stats) {
+  struct lbd *l = (struct lbd *)dev->priv;
+
+  *stats = l->stats;
+  stats->free = l->nfree + l->npending;
+  stats->total = l->nsegs;
+  stats->amplification = stats->appended == 0 ? 0 :
+    (stats->appended + stats->cleaned) * 100 / stats->appended;
+}
+
+void lbd_report(ata_dev_t *dev) {
+  lbd_stats_t s;
+
+  lbd_stats(dev, &s);
+  fb_printf("lbd_report:\n");
+  fb_printf("requests { reads: %dd, writes: %dd }\n", s.reads, s.writes);
+  fb_printf("blocks { appended: %dd, cleaned: %dd }\n", s.appended,
+            s.cleaned);
+  fb_printf("segments { written: %dd, free: %dd/%dd }, checkpoints: %dd\n",
+            s.segments, s.free, s.total, s.checkpoints);
+  fb_printf("write amplification: %dd.%dd%dd\n", s.amplification / 100,
+            s.amplification / 10 % 10, s.amplification % 10);
+}
+
+u32 lbd_bench(ata_dev_t *dev, u32 sectors, u32 count) {
+  u32 i, blocks, seed, t0, ticks;
+
+  blocks = sectors / LBD_BLOCK_SECTORS;
+  if (blocks == 0)
+    return 0;
+  for (i = 0; i < LBD_BLOCK_BYTES; i++)
+    lbd_bench_buf[i] = (u8)i;
+
+  t0 = timer_ticks();
+  for (i = 0, seed = 1; i < count; i++) {
+    seed = seed * 1103515245 + 12345;
+    if (ata_write(dev, (seed >> 8) % blocks * LBD_BLOCK_SECTORS,
+                  LBD_BLOCK_SECTORS, lbd_bench_buf) == -1)
+      return 0;
+  }
+  if (dev->ops == &lbd_ops && lbd_sync(dev) == -1)
+    return 0;
+
+  ticks = timer_ticks() - t0;
+  if (ticks == 0)
+    ticks = 1;
+  return (u32)div64((u64)count * timer_hz(), ticks);
+}
@@ -55,11 +55,22 @@
  * very restricted, but our kernel is not too deep right now. And, if we ever
  * run out of memory, we can think of a better policy to distribute memory.
  * But later, not now.
+ *
+ * The bitmap only says what each frame is. Free frames are also kept by a
+ * buddy allocator: blocks of 2^order frames aligned to their size, in one
+ * free list per order, so finding a contiguous run doesn't mean walking the
+ * bitmap. The list links live in the first frame of each free block, which
+ * nobody else is using. A frame is FREE in the bitmap if and only if it is
+ * in one of those blocks, so the buddy of a block being released is free
+ * when its first frame is FREE and its header has the same order.
  */
 
 #include <mem.h>
+#include <slab.h>
+#include <arena.h>
 #include <string.h>
 #include <fb.h>
+#include <hw.h>
 
 void kalloc_init();
 
@@ -69,6 +80,16 @@ void kalloc_init();
 
 static u64 mem_total_frames;      /* Keeps the actual number of pages in main
                                   * memory. */
+static u32 mem_ram_end;           /* Frame past the last available one. */
+static u32 mem_kernel_used;       /* Frames the kernel holds above the user */
+static u32 mem_kernel_limit;      /* space base and how many it may hold. */
+static u32 mem_free_frames;
+static u32 mem_used_frames;
+static u32 mem_frame_allocs;
+static u32 mem_frame_frees;
+static u32 mem_frame_failures;
+static u32 mem_init_kcycles;      /* How long mem_init took. */
+static mem_reclaim_handler_t mem_reclaim_hook;
 
 /* During the initial, real-mode load of the kernel we used INT 0x12,
  * AX = 0xe820 to get a memory map, which we placed as a continuos list of
@@ -94,11 +115,33 @@ struct mem_bios_mmap_entry {
 #define MEM_BITMAP_BITS_PER_ENTRY             2 /* These two are closely */
 #define MEM_BITMAP_ENTRIES_PER_BYTE           4 /* related. */
 
+/* Frames a 32 bits address can reach, 4G worth. RAM above is ignored. */
+#define MEM_MAX_FRAMES                        0x00100000
+
 #define MEM_BITMAP_ENTRY_FREE                 0x00
 #define MEM_BITMAP_ENTRY_USED                 0x01
 #define MEM_BITMAP_ENTRY_RESERVED             0x02
 #define MEM_BITMAP_ENTRY_RESERVED2            0x03
 
+/* A byte with its four entries set to status. */
+#define MEM_BITMAP_PACK(status)               ((u8)((status) * 0x55))
+
+/* Blocks go up to 2^MEM_BUDDY_MAX_ORDER frames, i.e. 4G. */
+#define MEM_BUDDY_MAX_ORDER                   20
+
+/* Header of a free block, stored in its first frame. */
+struct mem_buddy_block {
+  struct mem_buddy_block *next;
+  struct mem_buddy_block *prev;
+  u32 order;
+};
+
+static struct mem_buddy_block *mem_buddy_lists[MEM_BUDDY_MAX_ORDER + 1];
+
+#define MEM_BUDDY_BLOCK(frame) \
+  ((struct mem_buddy_block *)((frame) * MEM_FRAME_SIZE))
+#define MEM_BUDDY_FRAME(block)                ((u32)(block) / MEM_FRAME_SIZE)
+
 /* Bitmap handling routines */
 void mem_bitmap_set_entry(u32 frame, u8 status) {
   u8 pack, *bm;
@@ -117,13 +160,128 @@ u8 mem_bitmap_get_entry(u32 frame) {
   return pack >> ((frame % MEM_BITMAP_ENTRIES_PER_BYTE) * 2) & 0x03;
 }
 
+/* Sets count entries from frame on to status. Only the entries at the edges
+ * are set one by one, the bytes in between are written whole, four at a
+ * time where they are aligned. */
+static void mem_bitmap_set_range(u32 frame, u32 count, u8 status) {
+  u8 *bm = (u8 *)MEM_BITMAP_ADDR;
+  u8 pack = MEM_BITMAP_PACK(status);
+  u32 last = frame + count, b, end;
+
+  for (; frame < last && frame % MEM_BITMAP_ENTRIES_PER_BYTE != 0; frame++)
+    mem_bitmap_set_entry(frame, status);
+
+  b = frame / MEM_BITMAP_ENTRIES_PER_BYTE;
+  end = last / MEM_BITMAP_ENTRIES_PER_BYTE;
+  for (; b < end && b % sizeof(u32) != 0; b++)
+    bm[b] = pack;
+  for (; b + sizeof(u32) <= end; b += sizeof(u32))
+    *(u32 *)(bm + b) = pack * 0x01010101;
+  for (; b < end; b++)
+    bm[b] = pack;
+
+  if (b * MEM_BITMAP_ENTRIES_PER_BYTE > frame)
+    frame = b * MEM_BITMAP_ENTRIES_PER_BYTE;
+  for (; frame < last; frame++)
+    mem_bitmap_set_entry(frame, status);
+}
+
+/* Returns the first frame in [frame, last) whose entry isn't status, or
+ * last if there's none. Whole bytes and words are compared the same way
+ * mem_bitmap_set_range writes them. */
+static u32 mem_bitmap_run_end(u32 frame, u32 last, u8 status) {
+  u8 *bm = (u8 *)MEM_BITMAP_ADDR;
+  u8 pack = MEM_BITMAP_PACK(status);
+  u32 b, end;
+
+  for (; frame < last && frame % MEM_BITMAP_ENTRIES_PER_BYTE != 0; frame++)
+    if (mem_bitmap_get_entry(frame) != status)
+      return frame;
+
+  b = frame / MEM_BITMAP_ENTRIES_PER_BYTE;
+  end = last / MEM_BITMAP_ENTRIES_PER_BYTE;
+  for (; b < end && b % sizeof(u32) != 0 && bm[b] == pack; b++);
+  if (b % sizeof(u32) == 0)
+    for (; b + sizeof(u32) <= end &&
+           *(u32 *)(bm + b) == pack * 0x01010101; b += sizeof(u32));
+  for (; b < end && bm[b] == pack; b++);
+
+  if (b * MEM_BITMAP_ENTRIES_PER_BYTE > frame)
+    frame = b * MEM_BITMAP_ENTRIES_PER_BYTE;
+  for (; frame < last; frame++)
+    if (mem_bitmap_get_entry(frame) != status)
+      return frame;
+  return last;
+}
+
+/* Buddy allocator routines */
+static void mem_buddy_push(u32 frame, u32 order) {
+  struct mem_buddy_block *b = MEM_BUDDY_BLOCK(frame);
+
+  mem_free_frames += 1 << order;
+  b->order = order;
+  b->prev = NULL;
+  b->next = mem_buddy_lists[order];
+  if (b->next != NULL)
+    b->next->prev = b;
+  mem_buddy_lists[order] = b;
+}
+
+static void mem_buddy_unlink(struct mem_buddy_block *b) {
+  mem_free_frames -= 1 << b->order;
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    mem_buddy_lists[b->order] = b->next;
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+}
+
+/* Gives the block back, merging it with its buddy as long as it is free. */
+static void mem_buddy_free(u32 frame, u32 order) {
+  struct mem_buddy_block *b;
+  u32 buddy;
+
+  mem_bitmap_set_range(frame, 1 << order, MEM_BITMAP_ENTRY_FREE);
+  while (order < MEM_BUDDY_MAX_ORDER) {
+    buddy = frame ^ (1 << order);
+    b = MEM_BUDDY_BLOCK(buddy);
+    if (buddy + (1 << order) > mem_total_frames ||
+        mem_bitmap_get_entry(buddy) != MEM_BITMAP_ENTRY_FREE ||
+        b->order != order)
+      break;
+    mem_buddy_unlink(b);
+    frame &= ~(1 << order);
+    order++;
+  }
+  mem_buddy_push(frame, order);
+}
+
+/* Gives back the frames in [first, last) in the largest aligned blocks. */
+static void mem_buddy_free_range(u32 first, u32 last) {
+  u32 order;
+
+  while (first < last) {
+    for (order = 0;
+         order < MEM_BUDDY_MAX_ORDER &&
+         (first & (1 << order)) == 0 &&
+         first + (2 << order) <= last;
+         order++);
+    mem_buddy_free(first, order);
+    first += 1 << order;
+  }
+}
+
 /* Intializes memory. It first reads the memory map obtained from the BIOS
  * and then creates a memory map with that info. It also intializes the bitmap
  * to keep track of all pages in the main memory. TODO: Fill the GDT. */
 int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
   struct mem_bios_mmap_entry *e;
   u64 max_addr;
-  u64 first_frame, last_frame;
+  u64 first_frame, last_frame, start;
+  u32 f, low;
+
+  start = hw_rdtsc();
 
   /* Scan the memory map obtained from BIOS and the total number of frames. */
   for (max_addr = 0, e = (struct mem_bios_mmap_entry *)mem_map;
@@ -132,7 +290,11 @@ int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
     if (e->base + e->size > max_addr)
       max_addr = e->base + e->size;
   }
+  /* Frames above 4G can't be reached with 32 bits addresses, their number
+   * times MEM_FRAME_SIZE would wrap around onto low memory. */
   mem_total_frames = max_addr / MEM_FRAME_SIZE;
+  if (mem_total_frames > MEM_MAX_FRAMES)
+    mem_total_frames = MEM_MAX_FRAMES;
 
   /* Verify we have enough space to hold the bitmap. */
   for (e = (struct mem_bios_mmap_entry*)mem_map;
@@ -141,7 +303,7 @@ int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
     if (e->type == MEM_BIOS_MEM_MAP_REGION_AVAILABLE) {
       if (e->base <= MEM_BITMAP_ADDR            &&
           e->base + e->size >= MEM_BITMAP_ADDR +
-                               mem_total_frames * MEM_BITMAP_BITS_PER_ENTRY) {
+                               mem_total_frames / MEM_BITMAP_ENTRIES_PER_BYTE) {
         break;
       }
     }
@@ -151,10 +313,10 @@ int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
   }
 
   /* Set initial configuration. */
-  /* Most memory will be free.  */
-  memset((void *)MEM_BITMAP_ADDR,
-         0,
-         mem_total_frames * MEM_BITMAP_BITS_PER_ENTRY);
+  /* Everything starts used, the free frames are handed to the buddy
+   * allocator at the end. This way frames in holes of the map, which no
+   * entry talks about, are never given away. */
+  mem_bitmap_set_range(0, mem_total_frames, MEM_BITMAP_ENTRY_USED);
   /* Then, set the configuration obtained from the BIOS. Since we won't
    * handle ACPI at all, we won't reclaim the memory either. */
   for (e = (struct mem_bios_mmap_entry*)mem_map;
@@ -162,33 +324,92 @@ int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
        e++) {
     if (e->type == MEM_BIOS_MEM_MAP_REGION_AVAILABLE)
       continue;
-    for (first_frame = e->base / MEM_FRAME_SIZE,
-         last_frame = (e->base + e->size) / MEM_FRAME_SIZE;
-         first_frame <= last_frame;
-         first_frame++) {
-      mem_bitmap_set_entry(first_frame, MEM_BITMAP_ENTRY_RESERVED);
-      /* This is just paranoia, but since I've run into this before I prefer
-       * to double check. */
-      if (mem_bitmap_get_entry(first_frame) != MEM_BITMAP_ENTRY_RESERVED) {
-        return -1;
-      }
+    first_frame = e->base / MEM_FRAME_SIZE;
+    last_frame = (e->base + e->size) / MEM_FRAME_SIZE;
+    if (first_frame >= mem_total_frames)
+      continue;
+    if (last_frame >= mem_total_frames)
+      last_frame = mem_total_frames - 1;
+    mem_bitmap_set_range(first_frame, last_frame - first_frame + 1,
+                         MEM_BITMAP_ENTRY_RESERVED);
+    /* This is just paranoia, but since I've run into this before I prefer
+     * to double check. The edges are where a range could go wrong. */
+    if (mem_bitmap_get_entry(first_frame) != MEM_BITMAP_ENTRY_RESERVED ||
+        mem_bitmap_get_entry(last_frame) != MEM_BITMAP_ENTRY_RESERVED) {
+      return -1;
     }
   }
+  /* The RAM under the mmap window would be hidden by the regions mapped
+   * there. */
+  if (mem_total_frames > MEM_MMAP_FIRST_FRAME)
+    mem_bitmap_set_range(MEM_MMAP_FIRST_FRAME,
+                         mem_total_frames - MEM_MMAP_FIRST_FRAME <
+                           MEM_MMAP_FRAMES ?
+                           mem_total_frames - MEM_MMAP_FIRST_FRAME :
+                           MEM_MMAP_FRAMES,
+                         MEM_BITMAP_ENTRY_RESERVED);
   /* Once done, let's reserve the memory we know we are using. However, since
    * we won't ever free it, let's mark it as reserved. */
-  for (first_frame = 0,
-       last_frame = (MEM_BITMAP_ADDR + mem_total_frames / MEM_BITMAP_ENTRIES_PER_BYTE) / MEM_FRAME_SIZE;
-       first_frame <= last_frame;
-       first_frame++) {
-    mem_bitmap_set_entry(first_frame, MEM_BITMAP_ENTRY_RESERVED);
-    /* And again, paranoia */
-    if (mem_bitmap_get_entry(first_frame) != MEM_BITMAP_ENTRY_RESERVED) {
-      return -1;
+  last_frame = (MEM_BITMAP_ADDR + mem_total_frames / MEM_BITMAP_ENTRIES_PER_BYTE) / MEM_FRAME_SIZE;
+  mem_bitmap_set_range(0, last_frame + 1, MEM_BITMAP_ENTRY_RESERVED);
+  /* And again, paranoia */
+  if (mem_bitmap_get_entry(0) != MEM_BITMAP_ENTRY_RESERVED ||
+      mem_bitmap_get_entry(last_frame) != MEM_BITMAP_ENTRY_RESERVED) {
+    return -1;
+  }
+
+  /* Now, every available frame that wasn't reserved above goes to the buddy
+   * allocator. */
+  for (first_frame = 0; first_frame <= MEM_BUDDY_MAX_ORDER; first_frame++)
+    mem_buddy_lists[first_frame] = NULL;
+  mem_free_frames = 0;
+  mem_used_frames = 0;
+  mem_frame_allocs = 0;
+  mem_frame_frees = 0;
+  mem_frame_failures = 0;
+  mem_ram_end = 0;
+  for (e = (struct mem_bios_mmap_entry*)mem_map;
+       e->size != 0 || e->base != 0 || e->type != 0;
+       e++) {
+    if (e->type != MEM_BIOS_MEM_MAP_REGION_AVAILABLE)
+      continue;
+    last_frame = (e->base + e->size) / MEM_FRAME_SIZE;
+    first_frame = (e->base + MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE;
+    if (last_frame > mem_total_frames)
+      last_frame = mem_total_frames;
+    if (last_frame > mem_ram_end)
+      mem_ram_end = last_frame;
+    while (first_frame < last_frame) {
+      f = mem_bitmap_run_end(first_frame, last_frame, MEM_BITMAP_ENTRY_USED);
+      if (f == first_frame) {
+        first_frame = mem_bitmap_run_end(first_frame + 1, last_frame,
+                                         MEM_BITMAP_ENTRY_RESERVED);
+        continue;
+      }
+      mem_buddy_free_range(first_frame, f);
+      first_frame = f;
     }
   }
 
-  /* Finally, let's intialize the logical allocator. */
+  /* The kernel may take part of what is free above the user space base,
+   * i.e. every free frame but the ones in the kernel heap. Holes, ROMs and
+   * the mmap window don't count. */
+  for (f = 0, low = 0; f < MEM_USER_FIRST_FRAME && f < mem_total_frames; f++) {
+    if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_FREE)
+      low++;
+  }
+  mem_kernel_used = 0;
+  mem_kernel_limit = (mem_free_frames - low) / 100 *
+                     MEM_KERNEL_POOL_PERCENT;
+  mem_reclaim_hook = NULL;
+
+  /* Finally, let's intialize the logical allocator, the slab caches and the
+   * boot arena. */
   kalloc_init();
+  slab_init();
+  arena_boot_init();
+
+  mem_init_kcycles = (u32)div64(hw_rdtsc() - start, 1000);
 
   return 0;
 }
@@ -196,37 +417,69 @@ int mem_init(void *gdt_base /* __attribute__((unused)) */, void *mem_map) {
 /* Tries to find an amount of count contigous free pages. Since we're not using
  * pagination at all we can't just find this space anywhere in the physical
  * memory, but we must know what are the limits we must respect. Frame 0 will
- * be always reserved, therefore we can use 0 to mark certain situations. */
+ * be always reserved, therefore we can use 0 to mark certain situations.
+ *
+ * The request is rounded up to a block of 2^order frames. Any free block of
+ * that order or above with an aligned 2^order run inside the window will do:
+ * it is split down to that run, the halves left over go back to the lists,
+ * and so do the frames of the run beyond count. */
 void * mem_allocate_frames(u32 count, u32 first, u32 last) {
-  /* This is the simplest, dummiest way to do this. */
-  u32 f, free_f;
+  struct mem_buddy_block *b;
+  u32 order, j, f, lo, end;
 
   if (last == 0 || last > mem_total_frames)
     last = mem_total_frames;
 
-  for (free_f = 0, f = first; f < last; f++) {
-    if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_FREE)
-      free_f++;
-    else
-      free_f = 0;
-    if (free_f == count) {
-      /* Good, we found a free spot :) */
-      while (free_f > 0) {
-        mem_bitmap_set_entry(f - free_f + 1, MEM_BITMAP_ENTRY_USED);
-        free_f--;
-      }
-      /* Now, we return the address to the first frame. */
-      return (void *)((f - count + 1) * MEM_FRAME_SIZE);
+  for (order = 0; order <= MEM_BUDDY_MAX_ORDER && (1u << order) < count;
+       order++);
+  if (count == 0 || order > MEM_BUDDY_MAX_ORDER) {
+    mem_frame_failures++;
+    return NULL;
+  }
+
+  lo = (first + (1 << order) - 1) & ~((1 << order) - 1);
+  for (j = order; j <= MEM_BUDDY_MAX_ORDER; j++) {
+    for (b = mem_buddy_lists[j]; b != NULL; b = b->next) {
+      f = MEM_BUDDY_FRAME(b);
+      end = f + (1 << j) < last ? f + (1 << j) : last;
+      if ((lo > f ? lo : f) + (1 << order) <= end)
+        break;
     }
+    if (b != NULL)
+      break;
   }
-  return NULL;
+  if (j > MEM_BUDDY_MAX_ORDER) {
+    mem_frame_failures++;
+    return NULL;
+  }
+
+  /* Split it, keeping the half the run lies in. */
+  if (lo < f)
+    lo = f;
+  mem_buddy_unlink(b);
+  while (j > order) {
+    j--;
+    if (lo < f + (1 << j)) {
+      mem_buddy_push(f + (1 << j), j);
+    }
+    else {
+      mem_buddy_push(f, j);
+      f += 1 << j;
+    }
+  }
+
+  mem_bitmap_set_range(f, 1 << order, MEM_BITMAP_ENTRY_USED);
+  mem_buddy_free_range(f + count, f + (1 << order));
+  mem_used_frames += count;
+  mem_frame_allocs++;
+  return (void *)(f * MEM_FRAME_SIZE);
 }
 
 /* Marks count frames from first_frame on as free. Of course, if any of the
  * frames in between are reserved we won't change them. Actually, if that
  * happens this call should be wrong. */
 void mem_release_frames(void *addr, u32 count) {
-  u32 f, last;
+  u32 f, last, run;
 
   f = (u32)addr / MEM_FRAME_SIZE;
   if (f >= mem_total_frames)
@@ -235,15 +488,71 @@ void mem_release_frames(void *addr, u32 count) {
   last = f + count;
   if (last > mem_total_frames)
     last = mem_total_frames;
+  mem_frame_frees++;
 
-  for (; f < last; f++) {
-    if (mem_bitmap_get_entry(f) == MEM_BITMAP_ENTRY_USED) {
-      // fb_printf("fr: %d\n", f);
-      mem_bitmap_set_entry(f, MEM_BITMAP_ENTRY_FREE);
+  /* Only runs of used frames go back to the buddy allocator. */
+  while (f < last) {
+    run = mem_bitmap_run_end(f, last, MEM_BITMAP_ENTRY_USED);
+    if (run == f) {
+      f++;
+      continue;
     }
+    mem_buddy_free_range(f, run);
+    mem_used_frames -= run - f;
+    f = run;
   }
 }
 
+void * mem_allocate_kernel_frames(u32 count) {
+  void *addr = NULL;
+
+  if (mem_kernel_used + count <= mem_kernel_limit)
+    addr = mem_allocate_frames(count, MEM_USER_FIRST_FRAME, 0);
+  if (addr != NULL) {
+    mem_kernel_used += count;
+    return addr;
+  }
+  addr = mem_allocate_frames(count, MEM_KERNEL_FIRST_FRAME,
+                             MEM_USER_FIRST_FRAME);
+  if (addr != NULL || mem_reclaim_hook == NULL ||
+      mem_kernel_used + count > mem_kernel_limit ||
+      mem_reclaim_hook(count) == 0)
+    return addr;
+
+  /* Whatever was reclaimed lies above the user space base. */
+  addr = mem_allocate_frames(count, MEM_USER_FIRST_FRAME, 0);
+  if (addr != NULL)
+    mem_kernel_used += count;
+  return addr;
+}
+
+void mem_set_reclaim_handler(mem_reclaim_handler_t handler) {
+  mem_reclaim_hook = handler;
+}
+
+void mem_release_kernel_frames(void *addr, u32 count) {
+  if ((u32)addr >= MEM_USER_SPACE_ADDR)
+    mem_kernel_used -= count;
+  mem_release_frames(addr, count);
+}
+
+void mem_set_kernel_limit(u32 frames) {
+  mem_kernel_limit = frames;
+}
+
+void mem_kernel_usage(u32 *used, u32 *limit) {
+  *used = mem_kernel_used;
+  *limit = mem_kernel_limit;
+}
+
+u32 mem_frames() {
+  return (u32)mem_total_frames;
+}
+
+u32 mem_ram_frames() {
+  return mem_ram_end;
+}
+
 void mem_inspect() {
   u8 v, w;
   u32 f, r_start;
@@ -264,140 +573,360 @@ void mem_inspect() {
  * Logical allocator                                                         *
  *****************************************************************************/
 
-/* Our logical allocator will use a double linked list. Each entry will contain
- * the amount of memory reserved by the entry and its status. Both free and
- * used entries will be linked together in the same list. */
-struct mem_entry {
-  struct mem_entry *next;       /* Pointer to next entry */
-  struct mem_entry *prev;       /* Pointer to prev entry */
-  u32 size;                     /* Memory associated to this entry in
-                                   sizeof(struct mem_entry) units. */
-  u32 flags;                    /* Status of the entry. Actually, this is
-                                   pretty wasteful but keeps alignment to
-                                   8-bytes boundaries. */
-}__attribute__((__packed__));
-
-#define MEM_ALLOC_ENTRY_NULL                0x00000000
-#define MEM_ALLOC_ENTRY_FREE                0x00000001
-#define MEM_ALLOC_ENTRY_USED                0x00000002
-
-static struct mem_entry mem_head;
+/* Our logical allocator carves blocks out of arenas, runs of frames taken
+ * from the physical allocator as the heap grows. Every block starts with a
+ * header tag and ends with a footer tag, both holding its size in bytes and
+ * whether it is free, so kfree finds the header right before the pointer
+ * and both neighbours through the tags next to it, with no list walking.
+ * Two adjacent blocks are never both free. The first and last tags of an
+ * arena are used tags of size 0 so merges never leave it.
+ *
+ *  +-------+----------+-----+------+--------+-----+-----+--------+----------+
+ *  | arena | prologue | hdr | data | footer | hdr | ... | footer | epilogue |
+ *  +-------+----------+-----+------+--------+-----+-----+--------+----------+
+ *
+ * Free blocks are kept in segregated lists by size class, class c holding
+ * sizes in [2^(c + 4), 2^(c + 5)), linked through their payload. kalloc
+ * looks at a few blocks of the class of the request and otherwise takes the
+ * first block of any bigger class, which always fits. */
+struct mem_tag {
+  u32 size;                     /* Whole block, tags included. */
+  u32 magic;                    /* MEM_ALLOC_TAG_* */
+};
+
+struct mem_block {
+  struct mem_tag tag;
+  struct mem_block *next;       /* Free list links, only while free. */
+  struct mem_block *prev;
+};
+
+struct mem_arena {
+  struct mem_arena *next;
+  u32 frames;
+  struct mem_tag prologue;
+};
+
+#define MEM_ALLOC_TAG_FREE                  0xf4eef4ee
+#define MEM_ALLOC_TAG_USED                  0x05ed05ed
+#define MEM_ALLOC_ALIGN                     8
+#define MEM_ALLOC_OVERHEAD                  (2 * sizeof(struct mem_tag))
+#define MEM_ALLOC_MIN_BLOCK                 (sizeof(struct mem_block) + \
+                                             sizeof(struct mem_tag))
+#define MEM_ALLOC_CLASSES                   16
+#define MEM_ALLOC_CLASS_SHIFT               4
+#define MEM_ALLOC_SCAN                      8   /* Blocks looked at in the
+                                                 * class of a request. */
+#define MEM_ALLOC_ARENA_FRAMES              4
+
+#define MEM_ALLOC_FOOTER(b) \
+  ((struct mem_tag *)((u8 *)(b) + (b)->tag.size) - 1)
+#define MEM_ALLOC_NEXT(b) \
+  ((struct mem_block *)((u8 *)(b) + (b)->tag.size))
+
+static struct mem_block *mem_free_lists[MEM_ALLOC_CLASSES];
+static struct mem_arena *mem_arenas;
+static u32 mem_alloc_used_blocks;
+static u32 mem_alloc_used_bytes;
+static u32 mem_alloc_requested;
+static u32 mem_alloc_consumed;
+static u32 mem_alloc_allocs;
+static u32 mem_alloc_frees;
+static u32 mem_alloc_failures;
+static u32 mem_alloc_bad_frees;
 
 /* Initializes the logical allocator. */
 void kalloc_init() {
-  mem_head.next = NULL;
-  mem_head.prev = NULL;
-  mem_head.size = 0;
-  mem_head.flags = MEM_ALLOC_ENTRY_NULL;
+  u32 c;
+
+  for (c = 0; c < MEM_ALLOC_CLASSES; c++)
+    mem_free_lists[c] = NULL;
+  mem_arenas = NULL;
+  mem_alloc_used_blocks = 0;
+  mem_alloc_used_bytes = 0;
+  mem_alloc_requested = 0;
+  mem_alloc_consumed = 0;
+  mem_alloc_allocs = 0;
+  mem_alloc_frees = 0;
+  mem_alloc_failures = 0;
+  mem_alloc_bad_frees = 0;
+}
+
+static u32 mem_alloc_class(u32 size) {
+  u32 c;
+
+  for (c = 0; c < MEM_ALLOC_CLASSES - 1 &&
+              size >> (c + MEM_ALLOC_CLASS_SHIFT + 1) != 0; c++);
+  return c;
+}
+
+static void mem_alloc_set(struct mem_block *b, u32 size, u32 magic) {
+  b->tag.size = size;
+  b->tag.magic = magic;
+  *MEM_ALLOC_FOOTER(b) = b->tag;
+}
+
+static void mem_alloc_push(struct mem_block *b) {
+  u32 c = mem_alloc_class(b->tag.size);
+
+  b->prev = NULL;
+  b->next = mem_free_lists[c];
+  if (b->next != NULL)
+    b->next->prev = b;
+  mem_free_lists[c] = b;
+}
+
+static void mem_alloc_unlink(struct mem_block *b) {
+  if (b->prev != NULL)
+    b->prev->next = b->next;
+  else
+    mem_free_lists[mem_alloc_class(b->tag.size)] = b->next;
+  if (b->next != NULL)
+    b->next->prev = b->prev;
+}
+
+/* Returns a free block of at least size bytes, or NULL. */
+static struct mem_block *mem_alloc_find(u32 size) {
+  struct mem_block *b;
+  u32 c, i;
+
+  c = mem_alloc_class(size);
+  for (b = mem_free_lists[c], i = 0; b != NULL && i < MEM_ALLOC_SCAN;
+       b = b->next, i++)
+    if (b->tag.size >= size)
+      return b;
+  for (c++; c < MEM_ALLOC_CLASSES - 1; c++)
+    if (mem_free_lists[c] != NULL)
+      return mem_free_lists[c];
+  /* The last class has no upper bound, so it must be searched. */
+  for (b = mem_free_lists[MEM_ALLOC_CLASSES - 1]; b != NULL; b = b->next)
+    if (b->tag.size >= size)
+      return b;
+  /* Past the scan limit of its own class. */
+  for (b = mem_free_lists[mem_alloc_class(size)]; b != NULL; b = b->next)
+    if (b->tag.size >= size)
+      return b;
+  return NULL;
+}
+
+/* Gets frames for an arena holding a free block of at least size bytes. */
+static struct mem_block *mem_alloc_grow(u32 size) {
+  struct mem_arena *a;
+  struct mem_block *b;
+  u32 frames;
+
+  frames = (sizeof(struct mem_arena) + size + sizeof(struct mem_tag) +
+            MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE;
+  if (frames < MEM_ALLOC_ARENA_FRAMES)
+    frames = MEM_ALLOC_ARENA_FRAMES;
+  a = (struct mem_arena *)mem_allocate_kernel_frames(frames);
+  if (a == NULL) /* There's no free space :( */
+    return NULL;
+  a->next = mem_arenas;
+  a->frames = frames;
+  a->prologue.size = 0;
+  a->prologue.magic = MEM_ALLOC_TAG_USED;
+  mem_arenas = a;
+
+  b = (struct mem_block *)(a + 1);
+  mem_alloc_set(b, frames * MEM_FRAME_SIZE - sizeof(struct mem_arena) -
+                   sizeof(struct mem_tag), MEM_ALLOC_TAG_FREE);
+  MEM_ALLOC_NEXT(b)->tag = a->prologue;   /* The epilogue. */
+  mem_alloc_push(b);
+  return b;
 }
 
 /* Allocates memory in a malloc fashion for the kernel to use. */
 void * kalloc(u32 bytes) {
-  struct mem_entry *e, *n;
-  u32 units, frames;
-
-  units = bytes / sizeof(struct mem_entry);
-  if (bytes % sizeof(struct mem_entry) > 0)
-    units += 1;
-
-  e = &mem_head;
-  while (1) {
-    if (e->flags == MEM_ALLOC_ENTRY_FREE) {
-      /* The reason for checking if there's an exact match with units + 1 is
-       * that otherwise we'll be creating a zero-size entry which we won't
-       * be able to use if we don't. */
-      if (e->size == units || e->size == units + 1) {
-        e->flags = MEM_ALLOC_ENTRY_USED;
-        return (void*)(e + 1);
-      }
-      /* We found a hole, so we can make it fit here. */
-      if (e->size > units + 1) {
-        n = e + units + 1;      /* New entry's location. */
-        n->flags = MEM_ALLOC_ENTRY_FREE;
-        n->size = e->size - units - 1;
-        n->next = e->next;      /* Update the list. */
-        if (n->next != NULL)
-          n->next->prev = n;
-        n->prev = e;
-        e->next = n;
-        e->size = units;
-        e->flags = MEM_ALLOC_ENTRY_USED;
-        return (void *)(e + 1);
-      }
-    }
-    if (e->next != NULL) {
-      e = e->next;
-      continue;
-    }
-    /* Only if we reached the end of the list. */
-    frames = ((units + 1) * sizeof(struct mem_entry)) / MEM_FRAME_SIZE;
-    if ((units + 1) * sizeof(struct mem_entry) % MEM_FRAME_SIZE > 0)
-      frames += 1;
-    n = (struct mem_entry*)mem_allocate_frames(frames,
-                                               MEM_KERNEL_FIRST_FRAME,
-                                               MEM_USER_FIRST_FRAME);
-    if (n == NULL) /* There's no free space :( */
-      return NULL;
-    e->next = n;
-    n->prev = e;
-    n->next = NULL;
-    n->flags = MEM_ALLOC_ENTRY_FREE;
-    n->size = (frames * MEM_FRAME_SIZE) / sizeof(struct mem_entry) - 1;
-    e = e->next;
+  struct mem_block *b, *n;
+  u32 size;
+
+  size = (bytes + MEM_ALLOC_ALIGN - 1) & ~(MEM_ALLOC_ALIGN - 1);
+  size += MEM_ALLOC_OVERHEAD;
+  if (size < MEM_ALLOC_MIN_BLOCK)
+    size = MEM_ALLOC_MIN_BLOCK;
+  if (size < bytes || /* Wrapped around. */
+      ((b = mem_alloc_find(size)) == NULL &&
+       (b = mem_alloc_grow(size)) == NULL)) {
+    mem_alloc_failures++;
+    return NULL;
+  }
+  mem_alloc_unlink(b);
+
+  /* Split it if the rest is big enough to be a block. */
+  if (b->tag.size - size >= MEM_ALLOC_MIN_BLOCK) {
+    n = (struct mem_block *)((u8 *)b + size);
+    mem_alloc_set(n, b->tag.size - size, MEM_ALLOC_TAG_FREE);
+    mem_alloc_push(n);
+    mem_alloc_set(b, size, MEM_ALLOC_TAG_USED);
+  }
+  else {
+    mem_alloc_set(b, b->tag.size, MEM_ALLOC_TAG_USED);
   }
+  mem_alloc_used_blocks++;
+  mem_alloc_used_bytes += b->tag.size;
+  mem_alloc_requested += bytes;
+  mem_alloc_consumed += b->tag.size;
+  mem_alloc_allocs++;
+  return (void *)&b->next;
 }
 
 void kfree(void * ptr) {
-  struct mem_entry *e, *f;
+  struct mem_block *b, *n;
+  struct mem_tag *t;
+  struct mem_arena *a, **pa;
 
+  /* Just to avoid silly mistakes, pointers that kalloc never returned and
+   * double frees are ignored. */
   if (ptr == NULL)
-    return; /* Just to avoid silly mistakes. */
-
-  e = &mem_head;
-  while (1) {
-    if (e->next == NULL) {
-      /* We reached the end of the list without finding anything to free.
-       * Wrong pointer maybe? */
-      return;
-    }
-    if (e->next + 1 == ptr) {
-      /* Good, we found it. */
-      f = e->next;
-      if (f->flags == MEM_ALLOC_ENTRY_FREE)
-        /* What? Double free? */
-        return;
-      /* Free! */
-      f->flags = MEM_ALLOC_ENTRY_FREE;
-
-      if (f->next != NULL &&
-          f->next->flags == MEM_ALLOC_ENTRY_FREE) {
-        /* If the entry after the one being freed is also free, join them. */
-        f->size += f->next->size + 1;
-        f->next = f->next->next;
-        if (f->next != NULL)
-          f->next->prev = f;
-      }
-
-      if (e->flags == MEM_ALLOC_ENTRY_FREE) {
-        /* If e is also free, then join it with f */
-        e->size += f->size + 1;
-        e->next = f->next;
-        if (e->next != NULL)
-          e->next->prev = e;
-      }
-      return;
-    }
-    e = e->next;
+    return;
+  if ((u32)ptr % MEM_ALLOC_ALIGN != 0 ||
+      (u32)ptr < MEM_KERNEL_HEAP_ADDR + sizeof(struct mem_arena) +
+                 sizeof(struct mem_tag) ||
+      (u32)ptr / MEM_FRAME_SIZE >= mem_total_frames) {
+    mem_alloc_bad_frees++;
+    return;
+  }
+  b = (struct mem_block *)((struct mem_tag *)ptr - 1);
+  if (b->tag.magic != MEM_ALLOC_TAG_USED ||
+      b->tag.size < MEM_ALLOC_MIN_BLOCK ||
+      b->tag.size % MEM_ALLOC_ALIGN != 0 ||
+      b->tag.size / MEM_FRAME_SIZE >=
+        mem_total_frames - (u32)b / MEM_FRAME_SIZE ||
+      MEM_ALLOC_FOOTER(b)->size != b->tag.size ||
+      MEM_ALLOC_FOOTER(b)->magic != MEM_ALLOC_TAG_USED) {
+    mem_alloc_bad_frees++;
+    return;
+  }
+  mem_alloc_used_blocks--;
+  mem_alloc_used_bytes -= b->tag.size;
+  mem_alloc_frees++;
+
+  /* Join it with the free neighbours. Its own tags are marked free first,
+   * so they don't pass for a used block if they end up inside a merged
+   * one and the pointer is freed again. */
+  mem_alloc_set(b, b->tag.size, MEM_ALLOC_TAG_FREE);
+  n = MEM_ALLOC_NEXT(b);
+  if (n->tag.magic == MEM_ALLOC_TAG_FREE) {
+    mem_alloc_unlink(n);
+    b->tag.size += n->tag.size;
+  }
+  t = (struct mem_tag *)b - 1;
+  if (t->magic == MEM_ALLOC_TAG_FREE) {
+    n = (struct mem_block *)((u8 *)b - t->size);
+    mem_alloc_unlink(n);
+    n->tag.size += b->tag.size;
+    b = n;
   }
+  mem_alloc_set(b, b->tag.size, MEM_ALLOC_TAG_FREE);
+
+  /* Give whole arenas back, but the last one. */
+  t = (struct mem_tag *)b - 1;
+  if (t->size == 0 && MEM_ALLOC_NEXT(b)->tag.size == 0 &&
+      mem_arenas->next != NULL) {
+    a = (struct mem_arena *)((u8 *)b - sizeof(struct mem_arena));
+    for (pa = &mem_arenas; *pa != a; pa = &(*pa)->next);
+    *pa = a->next;
+    b->tag.magic = 0;
+    mem_release_kernel_frames(a, a->frames);
+    return;
+  }
+  mem_alloc_push(b);
 }
 
 void mem_inspect_alloc() {
-  struct mem_entry *e;
+  struct mem_arena *a;
+  struct mem_block *b;
+
   fb_printf("mem_inspect_alloc:\n");
-  e = &mem_head;
-  while (e != NULL) {
-    fb_printf("entry { flags: %dx, size: %dd, prev: %dx, next: %dx }\n",
-              e->flags, e->size, e->prev, e->next);
-    e = e->next;
+  for (a = mem_arenas; a != NULL; a = a->next) {
+    fb_printf("arena { addr: %dx, frames: %dd }\n", a, a->frames);
+    for (b = (struct mem_block *)(a + 1); b->tag.size != 0;
+         b = MEM_ALLOC_NEXT(b))
+      fb_printf("entry { %s, addr: %dx, size: %dd }\n",
+                b->tag.magic == MEM_ALLOC_TAG_FREE ? "free" : "used",
+                b, b->tag.size);
   }
 }
+
+/*****************************************************************************
+ * Statistics                                                                *
+ *****************************************************************************/
+
+void mem_stats(mem_stats_t *stats) {
+  struct mem_arena *a;
+  struct mem_block *b;
+  u32 c;
+
+  stats->frames = (u32)mem_total_frames;
+  stats->free = mem_free_frames;
+  stats->used = mem_used_frames;
+  stats->reserved = stats->frames - mem_free_frames - mem_used_frames;
+  stats->largest_free = 0;
+  for (c = MEM_BUDDY_MAX_ORDER + 1; c > 0; c--) {
+    if (mem_buddy_lists[c - 1] != NULL) {
+      stats->largest_free = 1 << (c - 1);
+      break;
+    }
+  }
+  stats->frame_frag = stats->free == 0 ? 0 :
+                      100 - stats->largest_free * 100 / stats->free;
+  stats->frame_allocs = mem_frame_allocs;
+  stats->frame_frees = mem_frame_frees;
+  stats->frame_failures = mem_frame_failures;
+  stats->kernel_frames = mem_kernel_used;
+  stats->kernel_limit = mem_kernel_limit;
+  stats->init_kcycles = mem_init_kcycles;
+
+  stats->arenas = 0;
+  stats->heap = 0;
+  for (a = mem_arenas; a != NULL; a = a->next) {
+    stats->arenas++;
+    stats->heap += a->frames * MEM_FRAME_SIZE;
+  }
+  stats->free_blocks = 0;
+  stats->free_bytes = 0;
+  stats->largest_block = 0;
+  for (c = 0; c < MEM_ALLOC_CLASSES; c++) {
+    for (b = mem_free_lists[c]; b != NULL; b = b->next) {
+      stats->free_blocks++;
+      stats->free_bytes += b->tag.size;
+      if (b->tag.size > stats->largest_block)
+        stats->largest_block = b->tag.size;
+    }
+  }
+  stats->heap_frag = stats->free_bytes == 0 ? 0 :
+                     100 - (u32)div64((u64)stats->largest_block * 100,
+                                      stats->free_bytes);
+  stats->used_blocks = mem_alloc_used_blocks;
+  stats->used_bytes = mem_alloc_used_bytes;
+  stats->requested = mem_alloc_requested;
+  stats->consumed = mem_alloc_consumed;
+  stats->allocs = mem_alloc_allocs;
+  stats->frees = mem_alloc_frees;
+  stats->failures = mem_alloc_failures;
+  stats->bad_frees = mem_alloc_bad_frees;
+}
+
+void mem_report(serial_device_t port) {
+  mem_stats_t s;
+  char line[256];
+  int len;
+
+  mem_stats(&s);
+  len = sprintf(line, "frames total=%dd free=%dd used=%dd reserved=%dd "
+                      "largest=%dd frag=%dd%% allocs=%dd frees=%dd "
+                      "fails=%dd kernel=%dd/%dd init=%ddk\n",
+                s.frames, s.free, s.used, s.reserved, s.largest_free,
+                s.frame_frag, s.frame_allocs, s.frame_frees,
+                s.frame_failures, s.kernel_frames, s.kernel_limit,
+                s.init_kcycles);
+  serial_write(port, line, len);
+  len = sprintf(line, "heap arenas=%dd bytes=%dd used=%dd/%dd free=%dd/%dd "
+                      "largest=%dd frag=%dd%% requested=%dd consumed=%dd "
+                      "allocs=%dd frees=%dd fails=%dd bad_frees=%dd\n",
+                s.arenas, s.heap, s.used_blocks, s.used_bytes,
+                s.free_blocks, s.free_bytes, s.largest_block, s.heap_frag,
+                s.requested, s.consumed, s.allocs, s.frees, s.failures,
+                s.bad_frees);
+  serial_write(port, line, len);
+}
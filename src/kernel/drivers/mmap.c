@@ -0,0 +1,307 @@
+/* This maps disk regions into memory and pages them in on demand.
+ *
+ * Resident pages are tracked by virtual address in mmap_resident, which
+ * the eviction clock sweeps. Their frames come from above the kernel space
+ * and are reached through their identity mapping to do the I/O, so DMA
+ * capable devices see physical addresses. Frames read in together are
+ * allocated contiguously and released one by one.
+ *
+ * Regions come from a slab cache and are kept in a list sorted by address,
+ * which mmap_map walks to find the first hole that fits.
+ */
+
+#include <mmap.h>
+#include <paging.h>
+#include <mem.h>
+#include <ata.h>
+#include <string.h>
+#include <fb.h>
+#include <slab.h>
+#include <typedef.h>
+
+typedef struct mmap_region {
+  ata_dev_t *dev;
+  u32 lba;
+  u32 sectors;
+  u32 base;             /* Virtual address of the first page. */
+  u32 pages;
+  struct mmap_region *next;
+} mmap_region_t;
+
+static slab_cache_t mmap_region_cache;
+static mmap_region_t *mmap_regions;         /* Sorted by base. */
+static u32 mmap_resident[MMAP_MAX_PAGES];   /* 0 when the slot is free. */
+static u32 mmap_resident_count;
+static u32 mmap_hand;
+static mmap_stats_t mmap_counters;
+
+static mmap_region_t *mmap_find(u32 addr) {
+  mmap_region_t *r;
+
+  for (r = mmap_regions; r != NULL && r->base <= addr; r = r->next) {
+    if (addr - r->base < r->pages * PAGING_PAGE_SIZE)
+      return r;
+  }
+  return NULL;
+}
+
+/* Writes the resident page at virt of r to the disk if it is dirty. */
+static int mmap_writeback(mmap_region_t *r, u32 virt) {
+  u32 phys, first, count;
+
+  if (!(paging_get_flags(virt) & PAGING_DIRTY))
+    return 0;
+  paging_translate(virt, &phys);
+  first = (virt - r->base) / PAGING_PAGE_SIZE * MMAP_PAGE_SECTORS;
+  count = r->sectors - first;
+  if (count > MMAP_PAGE_SECTORS)
+    count = MMAP_PAGE_SECTORS;
+  if (ata_write(r->dev, r->lba + first, count, (void *)phys))
+    return -1;
+  paging_clear_flags(virt, PAGING_DIRTY);
+  mmap_counters.writebacks++;
+  return 0;
+}
+
+/* Unmaps the page in slot and gives its frame back. */
+static void mmap_drop(u32 slot) {
+  u32 phys;
+
+  paging_translate(mmap_resident[slot], &phys);
+  paging_unmap(mmap_resident[slot]);
+  mem_release_frames((void *)phys, 1);
+  mmap_resident[slot] = 0;
+  mmap_resident_count--;
+}
+
+/* Evicts up to count pages, skipping the ones accessed since the hand last
+ * passed by. Dirty pages are skipped too unless flush is set, in which case
+ * they are written back first. Returns the number of pages evicted. */
+static u32 mmap_evict(u32 count, int flush) {
+  u32 evicted = 0, steps, slot, virt, flags;
+
+  for (steps = 0;
+       evicted < count && mmap_resident_count > 0 &&
+       steps < 2 * MMAP_MAX_PAGES;
+       steps++) {
+    slot = mmap_hand;
+    mmap_hand = (mmap_hand + 1) % MMAP_MAX_PAGES;
+    if ((virt = mmap_resident[slot]) == 0)
+      continue;
+    flags = paging_get_flags(virt);
+    if (flags & PAGING_ACCESSED) {
+      paging_clear_flags(virt, PAGING_ACCESSED);
+      continue;
+    }
+    if ((flags & PAGING_DIRTY) &&
+        (!flush || mmap_writeback(mmap_find(virt), virt) == -1))
+      continue;
+    mmap_drop(slot);
+    evicted++;
+  }
+  mmap_counters.evictions += evicted;
+  return evicted;
+}
+
+/* Evicts count pages, clean ones first. Returns the number evicted. */
+static u32 mmap_make_room(u32 count) {
+  u32 evicted = mmap_evict(count, 0);
+
+  if (evicted < count)
+    evicted += mmap_evict(count - evicted, 1);
+  return evicted;
+}
+
+/* Returns count contiguous frames for pages, evicting pages to stay under
+ * MMAP_MAX_PAGES or to free memory, or NULL if there's no way. */
+static u8 *mmap_frames(u32 count) {
+  u8 *frames;
+
+  if (mmap_resident_count + count > MMAP_MAX_PAGES &&
+      mmap_make_room(mmap_resident_count + count - MMAP_MAX_PAGES) <
+      mmap_resident_count + count - MMAP_MAX_PAGES)
+    return NULL;
+  frames = mem_allocate_frames(count, MEM_USER_FIRST_FRAME, 0);
+  if (frames == NULL && mmap_make_room(count) > 0)
+    frames = mem_allocate_frames(count, MEM_USER_FIRST_FRAME, 0);
+  return frames;
+}
+
+static void mmap_track(u32 virt) {
+  u32 slot;
+
+  for (slot = 0; mmap_resident[slot] != 0; slot++);
+  mmap_resident[slot] = virt;
+  mmap_resident_count++;
+}
+
+static void mmap_untrack(u32 virt) {
+  u32 slot;
+
+  for (slot = 0; mmap_resident[slot] != virt; slot++);
+  mmap_resident[slot] = 0;
+  mmap_resident_count--;
+}
+
+/* Page fault handler. Reads in the page at addr and the missing pages next
+ * to it in its fault-around block, or just that page if memory is short. */
+static int mmap_fault(u32 addr, u32 err) {
+  mmap_region_t *r;
+  u32 page, first, last, lo, hi, sector, count, i;
+  u8 *frames;
+
+  if ((err & PAGING_FAULT_PRESENT) || (r = mmap_find(addr)) == NULL)
+    return -1;
+
+  page = (addr - r->base) / PAGING_PAGE_SIZE;
+  first = page - page % MMAP_FAULT_AROUND;
+  last = first + MMAP_FAULT_AROUND;
+  if (last > r->pages)
+    last = r->pages;
+  for (lo = page;
+       lo > first && !paging_get_flags(r->base + (lo - 1) * PAGING_PAGE_SIZE);
+       lo--);
+  for (hi = page + 1;
+       hi < last && !paging_get_flags(r->base + hi * PAGING_PAGE_SIZE);
+       hi++);
+
+  if ((frames = mmap_frames(hi - lo)) == NULL) {
+    lo = page;
+    hi = page + 1;
+    if ((frames = mmap_frames(1)) == NULL)
+      return -1;
+  }
+
+  sector = lo * MMAP_PAGE_SECTORS;
+  count = (hi - lo) * MMAP_PAGE_SECTORS;
+  if (count > r->sectors - sector)
+    count = r->sectors - sector;
+  if (ata_read(r->dev, r->lba + sector, count, frames)) {
+    mem_release_frames(frames, hi - lo);
+    return -1;
+  }
+  memset(frames + count * 512, 0,
+         (hi - lo) * PAGING_PAGE_SIZE - count * 512);
+
+  for (i = lo; i < hi; i++) {
+    if (paging_map(r->base + i * PAGING_PAGE_SIZE,
+                   (u32)frames + (i - lo) * PAGING_PAGE_SIZE,
+                   PAGING_WRITE) == -1) {
+      /* No page table. Undo the pages mapped so far, otherwise the access
+       * would fault again and read the block in once more. */
+      while (i-- > lo) {
+        paging_unmap(r->base + i * PAGING_PAGE_SIZE);
+        mmap_untrack(r->base + i * PAGING_PAGE_SIZE);
+      }
+      mem_release_frames(frames, hi - lo);
+      return -1;
+    }
+    mmap_track(r->base + i * PAGING_PAGE_SIZE);
+  }
+  mmap_counters.faults++;
+  mmap_counters.pages_in += hi - lo;
+  return 0;
+}
+
+void mmap_init() {
+  slab_cache_init(&mmap_region_cache, "mmap_region", sizeof(mmap_region_t),
+                  NULL);
+  mmap_regions = NULL;
+  memset(mmap_resident, 0, sizeof(mmap_resident));
+  memset(&mmap_counters, 0, sizeof(mmap_counters));
+  mmap_resident_count = 0;
+  mmap_hand = 0;
+
+  paging_set_fault_handler(mmap_fault);
+  mem_set_reclaim_handler(mmap_reclaim);
+}
+
+void * mmap_map(ata_dev_t *dev, u32 lba, u32 sectors) {
+  mmap_region_t *r, **link;
+  u32 base, pages, i;
+
+  if (sectors == 0 || ata_identify(dev) == -1 ||
+      lba + sectors > dev->size || lba + sectors < lba)
+    return NULL;
+  pages = (sectors + MMAP_PAGE_SECTORS - 1) / MMAP_PAGE_SECTORS;
+  if (pages > MMAP_SIZE / PAGING_PAGE_SIZE)
+    return NULL;
+
+  /* First fit: the first hole between sorted regions that is big enough. */
+  base = MMAP_BASE;
+  for (link = &mmap_regions; *link != NULL; link = &(*link)->next) {
+    if ((*link)->base - base >= pages * PAGING_PAGE_SIZE)
+      break;
+    base = (*link)->base + (*link)->pages * PAGING_PAGE_SIZE;
+  }
+  if (base - MMAP_BASE > MMAP_SIZE - pages * PAGING_PAGE_SIZE)
+    return NULL;
+
+  for (i = 0; i < pages; i++) {
+    if (paging_unmap(base + i * PAGING_PAGE_SIZE) == -1)
+      return NULL;
+  }
+
+  if ((r = slab_alloc(&mmap_region_cache)) == NULL)
+    return NULL;
+  r->dev = dev;
+  r->lba = lba;
+  r->sectors = sectors;
+  r->base = base;
+  r->pages = pages;
+  r->next = *link;
+  *link = r;
+  mmap_counters.regions++;
+  return (void *)base;
+}
+
+int mmap_sync(void *addr) {
+  mmap_region_t *r = mmap_find((u32)addr);
+  u32 slot;
+  int ret = 0;
+
+  if (r == NULL)
+    return -1;
+  for (slot = 0; slot < MMAP_MAX_PAGES; slot++) {
+    if (mmap_resident[slot] != 0 && mmap_find(mmap_resident[slot]) == r &&
+        mmap_writeback(r, mmap_resident[slot]) == -1)
+      ret = -1;
+  }
+  return ret;
+}
+
+int mmap_unmap(void *addr) {
+  mmap_region_t *r = mmap_find((u32)addr), **link;
+  u32 slot;
+
+  if (r == NULL || r->base != (u32)addr || mmap_sync(addr) == -1)
+    return -1;
+  for (slot = 0; slot < MMAP_MAX_PAGES; slot++) {
+    if (mmap_resident[slot] != 0 && mmap_find(mmap_resident[slot]) == r)
+      mmap_drop(slot);
+  }
+  for (link = &mmap_regions; *link != r; link = &(*link)->next);
+  *link = r->next;
+  slab_free(&mmap_region_cache, r);
+  mmap_counters.regions--;
+  return 0;
+}
+
+u32 mmap_reclaim(u32 count) {
+  return mmap_evict(count, 0);
+}
+
+void mmap_stats(mmap_stats_t *stats) {
+  *stats = mmap_counters;
+  stats->resident = mmap_resident_count;
+}
+
+void mmap_report() {
+  mmap_stats_t s;
+
+  mmap_stats(&s);
+  fb_printf("mmap_report:\n");
+  fb_printf("regions: %dd, resident pages: %dd\n", s.regions, s.resident);
+  fb_printf("faults: %dd, pages in: %dd, evictions: %dd, writebacks: %dd\n",
+            s.faults, s.pages_in, s.evictions, s.writebacks);
+}
@@ -0,0 +1,165 @@
+/* This sets up paging and handles page faults.
+ *
+ * The page directory and the page tables come from the kernel heap frames,
+ * which stay identity mapped, so they can be reached at their physical
+ * address. Page tables are never freed: once a 4M page is split it stays
+ * split.
+ */
+
+#include <paging.h>
+#include <mem.h>
+#include <hw.h>
+#include <interrupts.h>
+#include <string.h>
+#include <fb.h>
+#include <typedef.h>
+
+#define PAGING_FAULT_VECTOR       14
+#define PAGING_DIR_INDEX(virt)    ((virt) >> 22)
+#define PAGING_TABLE_INDEX(virt)  (((virt) >> 12) & (PAGING_ENTRIES - 1))
+#define PAGING_ADDR(entry)        ((entry) & ~PAGING_FLAGS)
+#define PAGING_LARGE_ADDR(entry)  ((entry) & ~(PAGING_LARGE_PAGE_SIZE - 1))
+
+static u32 *paging_dir;
+static paging_fault_handler_t paging_fault_hook;
+
+/* Runs on the faulting stack, so it is never reached for an overflow of the
+ * kernel stack into its guard page, which triple faults instead. */
+void paging_fault_handler(itr_cpu_regs_t regs,
+                          itr_intr_data_t intr,
+                          itr_stack_state_t stack) {
+  u32 addr = hw_read_cr2();
+
+  if (paging_fault_hook != NULL && paging_fault_hook(addr, intr.err) == 0)
+    return;
+  fb_printf("\nPage fault at %dx: %s on a%s page, eip %dx\n",
+            addr,
+            intr.err & PAGING_FAULT_WRITE ? "write" : "read",
+            intr.err & PAGING_FAULT_PRESENT ? " protected" : "n unmapped",
+            stack.eip);
+  hw_cli();
+  hw_hlt();
+}
+
+int paging_init() {
+  u32 i, ram;
+
+  if (!(hw_cpuid_features() & HW_CPUID_PSE))
+    return -1;
+  paging_dir = (u32 *)mem_allocate_frames(1, MEM_KERNEL_FIRST_FRAME,
+                                          MEM_USER_FIRST_FRAME);
+  if (paging_dir == NULL)
+    return -1;
+  paging_fault_hook = NULL;
+
+  /* The user segments start at 3M, inside the first 4M page, so every page
+   * stays reachable from ring 3 as it was. */
+  ram = (mem_ram_frames() + PAGING_ENTRIES - 1) / PAGING_ENTRIES;
+  for (i = 0; i < PAGING_ENTRIES; i++) {
+    paging_dir[i] = i * PAGING_LARGE_PAGE_SIZE | PAGING_PRESENT |
+                    PAGING_WRITE | PAGING_USER | PAGING_LARGE;
+    if (i >= ram)
+      paging_dir[i] |= PAGING_WRITE_THROUGH | PAGING_NO_CACHE;
+  }
+
+  itr_set_interrupt_handler(PAGING_FAULT_VECTOR, paging_fault_handler,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+  hw_write_cr4(hw_read_cr4() | HW_CR4_PSE);
+  hw_write_cr3((u32)paging_dir);
+  hw_write_cr0(hw_read_cr0() | HW_CR0_PG);
+  return 0;
+}
+
+/* Returns the page table covering virt, splitting its 4M page or creating
+ * an empty table as needed, or NULL if there's no memory for it. */
+static u32 *paging_table(u32 virt) {
+  u32 *pde = paging_dir + PAGING_DIR_INDEX(virt);
+  u32 *table, i;
+
+  if ((*pde & PAGING_PRESENT) && !(*pde & PAGING_LARGE))
+    return (u32 *)PAGING_ADDR(*pde);
+
+  table = (u32 *)mem_allocate_frames(1, MEM_KERNEL_FIRST_FRAME,
+                                     MEM_USER_FIRST_FRAME);
+  if (table == NULL)
+    return NULL;
+  if (*pde & PAGING_PRESENT) {
+    for (i = 0; i < PAGING_ENTRIES; i++)
+      table[i] = (PAGING_LARGE_ADDR(*pde) + i * PAGING_PAGE_SIZE) |
+                 (*pde & (PAGING_FLAGS & ~PAGING_LARGE));
+  }
+  else {
+    memset(table, 0, PAGING_PAGE_SIZE);
+  }
+  *pde = (u32)table | PAGING_PRESENT | PAGING_WRITE | PAGING_USER;
+  /* The whole 4M page may be cached, drop it all. */
+  hw_write_cr3(hw_read_cr3());
+  return table;
+}
+
+int paging_map(u32 virt, u32 phys, u32 flags) {
+  u32 *table;
+
+  if ((table = paging_table(virt)) == NULL)
+    return -1;
+  table[PAGING_TABLE_INDEX(virt)] = PAGING_ADDR(phys) |
+                                    (flags & PAGING_FLAGS & ~PAGING_LARGE) |
+                                    PAGING_PRESENT;
+  hw_invlpg(virt);
+  return 0;
+}
+
+int paging_unmap(u32 virt) {
+  u32 *table;
+
+  if ((table = paging_table(virt)) == NULL)
+    return -1;
+  table[PAGING_TABLE_INDEX(virt)] = 0;
+  hw_invlpg(virt);
+  return 0;
+}
+
+/* Returns the entry of the 4K page at virt, or NULL if virt lies in a 4M
+ * page or in no page at all. */
+static u32 *paging_entry(u32 virt) {
+  u32 pde = paging_dir[PAGING_DIR_INDEX(virt)];
+
+  if (!(pde & PAGING_PRESENT) || (pde & PAGING_LARGE))
+    return NULL;
+  return (u32 *)PAGING_ADDR(pde) + PAGING_TABLE_INDEX(virt);
+}
+
+u32 paging_get_flags(u32 virt) {
+  u32 *pte = paging_entry(virt);
+
+  if (pte == NULL || !(*pte & PAGING_PRESENT))
+    return 0;
+  return *pte & PAGING_FLAGS;
+}
+
+void paging_clear_flags(u32 virt, u32 flags) {
+  u32 *pte = paging_entry(virt);
+
+  if (pte == NULL || !(*pte & PAGING_PRESENT))
+    return;
+  *pte &= ~(flags & PAGING_FLAGS & ~PAGING_PRESENT);
+  hw_invlpg(virt);
+}
+
+void paging_set_fault_handler(paging_fault_handler_t handler) {
+  paging_fault_hook = handler;
+}
+
+int paging_translate(u32 virt, u32 *phys) {
+  u32 pde = paging_dir[PAGING_DIR_INDEX(virt)], *pte;
+
+  if ((pde & PAGING_PRESENT) && (pde & PAGING_LARGE)) {
+    *phys = PAGING_LARGE_ADDR(pde) | (virt & (PAGING_LARGE_PAGE_SIZE - 1));
+    return 0;
+  }
+  pte = paging_entry(virt);
+  if (pte == NULL || !(*pte & PAGING_PRESENT))
+    return -1;
+  *phys = PAGING_ADDR(*pte) | (virt & (PAGING_PAGE_SIZE - 1));
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <pci.h>
+#include <io.h>
+#include <typedef.h>
+
+#define PCI_ENABLE                0x80000000
+#define PCI_BUSES                 256
+#define PCI_DEVICES               32
+#define PCI_FUNCTIONS             8
+
+u32 pci_read(pci_addr_t addr, u8 reg) {
+  outd(PCI_CONFIG_ADDRESS, PCI_ENABLE | addr | (reg & 0xfc));
+  return ind(PCI_CONFIG_DATA);
+}
+
+void pci_write(pci_addr_t addr, u8 reg, u32 value) {
+  outd(PCI_CONFIG_ADDRESS, PCI_ENABLE | addr | (reg & 0xfc));
+  outd(PCI_CONFIG_DATA, value);
+}
+
+pci_addr_t pci_find_class(u8 class, u8 subclass, u8 progif, int index) {
+  u32 bus, dev, fn, id, cls;
+  pci_addr_t addr;
+
+  for (bus = 0; bus < PCI_BUSES; bus++) {
+    for (dev = 0; dev < PCI_DEVICES; dev++) {
+      for (fn = 0; fn < PCI_FUNCTIONS; fn++) {
+        addr = PCI_ADDR(bus, dev, fn);
+        id = pci_read(addr, PCI_REG_ID);
+        if ((id & 0xffff) == 0xffff) {
+          /* No function 0 means no device at all. */
+          if (fn == 0)
+            break;
+          continue;
+        }
+
+        cls = pci_read(addr, PCI_REG_CLASS);
+        if ((cls >> 24) == class && ((cls >> 16) & 0xff) == subclass &&
+            ((cls >> 8) & 0xff) == progif && index-- == 0)
+          return addr;
+
+        /* Single function devices only answer on function 0. */
+        if (fn == 0 && !(pci_read(addr, PCI_REG_HEADER) & 0x00800000))
+          break;
+      }
+    }
+  }
+  return PCI_NONE;
+}
@@ -0,0 +1,212 @@
+/* This is the I/O scheduler that enforces the priority classes.
+ *
+ * The buckets are refilled from the timer and may go into debt: a request
+ * is admitted as long as the bucket isn't negative and then pays its full
+ * cost, so requests bigger than the bucket still get through, just less
+ * often. A bucket never holds more than a quarter of a second's worth of
+ * tokens, which bounds the bursts after an idle period.
+ */
+
+#include <qos.h>
+#include <timer.h>
+#include <hw.h>
+#include <fb.h>
+#include <string.h>
+#include <typedef.h>
+
+#define QOS_BURST_DIV             4     /* Bucket size, 1/4 of a second. */
+
+struct qos_bucket {
+  u32 rate;                     /* Tokens per second, 0 means no limit. */
+  s32 tokens;
+  u32 last;                     /* Tick of the last refill. */
+};
+
+struct qos_class {
+  struct qos_bucket bw;         /* Sectors. */
+  struct qos_bucket iops;       /* Requests. */
+  u32 holdoff;                  /* Quiet ticks required from the classes
+                                 * above. */
+  u32 last_active;              /* Tick of the last request. */
+  qos_stats_t stats;
+  u32 hist[QOS_BUCKETS];        /* Requests by log2 of their latency. */
+};
+
+static struct qos_class qos_classes[QOS_CLASSES];
+static u8 qos_current;
+
+static void qos_bucket_init(struct qos_bucket *b, u32 rate) {
+  b->rate = rate;
+  b->tokens = 0;
+  b->last = timer_ticks();
+}
+
+void qos_init() {
+  int i;
+
+  memset(qos_classes, 0, sizeof(qos_classes));
+  for (i = 0; i < QOS_CLASSES; i++) {
+    qos_bucket_init(&qos_classes[i].bw, 0);
+    qos_bucket_init(&qos_classes[i].iops, 0);
+    qos_classes[i].last_active = timer_ticks();
+  }
+  qos_classes[QOS_BACKGROUND].bw.rate = QOS_BACKGROUND_RATE;
+  qos_classes[QOS_BACKGROUND].holdoff = QOS_BACKGROUND_HOLDOFF;
+  qos_classes[QOS_IDLE].bw.rate = QOS_IDLE_RATE;
+  qos_classes[QOS_IDLE].holdoff = QOS_IDLE_HOLDOFF;
+  qos_current = QOS_FOREGROUND;
+}
+
+void qos_set_limit(u8 cls, u32 sectors_per_sec, u32 iops) {
+  if (cls >= QOS_CLASSES)
+    return;
+  qos_bucket_init(&qos_classes[cls].bw, sectors_per_sec);
+  qos_bucket_init(&qos_classes[cls].iops, iops);
+}
+
+u8 qos_set_class(u8 cls) {
+  u8 prev = qos_current;
+
+  if (cls < QOS_CLASSES)
+    qos_current = cls;
+  return prev;
+}
+
+u8 qos_class() {
+  return qos_current;
+}
+
+static void qos_refill(struct qos_bucket *b) {
+  u32 now, elapsed, add, max;
+
+  now = timer_ticks();
+  if (now - b->last > timer_hz())
+    b->last = now - timer_hz();
+  elapsed = now - b->last;
+
+  /* Only move b->last forward by the ticks the new tokens stand for, the
+   * remainder counts towards the next one. Slow rates would never earn a
+   * token otherwise, and fast ones would lose a fraction every time. */
+  add = b->rate * elapsed / timer_hz();
+  if (add == 0)
+    return;
+  b->last += (add * timer_hz() + b->rate - 1) / b->rate;
+
+  max = b->rate / QOS_BURST_DIV;
+  if (max == 0)
+    max = 1;
+  if (b->tokens + (s32)add > (s32)max)
+    b->tokens = max;
+  else
+    b->tokens += add;
+}
+
+/* Whether cls may issue now, without taking anything. */
+static int qos_ready(u8 cls) {
+  struct qos_class *c = qos_classes + cls;
+  u8 i;
+
+  for (i = 0; i < cls; i++)
+    if (timer_ticks() - qos_classes[i].last_active < c->holdoff)
+      return 0;
+
+  if (c->bw.rate != 0) {
+    qos_refill(&c->bw);
+    if (c->bw.tokens < 0)
+      return 0;
+  }
+  if (c->iops.rate != 0) {
+    qos_refill(&c->iops);
+    if (c->iops.tokens < 0)
+      return 0;
+  }
+  return 1;
+}
+
+static void qos_charge(u8 cls, u32 sectors) {
+  struct qos_class *c = qos_classes + cls;
+
+  if (c->bw.rate != 0)
+    c->bw.tokens -= sectors;
+  if (c->iops.rate != 0)
+    c->iops.tokens--;
+}
+
+int qos_admit(u8 cls, u32 sectors) {
+  if (cls >= QOS_CLASSES)
+    return 0;
+  if (!qos_ready(cls)) {
+    qos_classes[cls].stats.throttled++;
+    return 0;
+  }
+  qos_charge(cls, sectors);
+  return 1;
+}
+
+void qos_wait(u8 cls, u32 sectors) {
+  u32 t0;
+
+  if (cls >= QOS_CLASSES)
+    return;
+  if (!qos_ready(cls)) {
+    qos_classes[cls].stats.throttled++;
+    t0 = timer_ticks();
+    while (!qos_ready(cls))
+      hw_hlt();
+    qos_classes[cls].stats.waited += timer_ticks() - t0;
+  }
+  qos_charge(cls, sectors);
+}
+
+void qos_account(u8 cls, u32 sectors, u64 cycles) {
+  struct qos_class *c;
+  u32 lat, b;
+
+  if (cls >= QOS_CLASSES)
+    return;
+  c = qos_classes + cls;
+  lat = cycles > 0xffffffff ? 0xffffffff : (u32)cycles;
+  for (b = 0; b < QOS_BUCKETS - 1 && (lat >> (b + 1)) != 0; b++);
+
+  c->stats.requests++;
+  c->stats.sectors += sectors;
+  if (lat > c->stats.max)
+    c->stats.max = lat;
+  c->hist[b]++;
+  c->last_active = timer_ticks();
+}
+
+void qos_stats(u8 cls, qos_stats_t *stats) {
+  struct qos_class *c;
+  u32 b, seen, need;
+
+  if (cls >= QOS_CLASSES)
+    return;
+  c = qos_classes + cls;
+  *stats = c->stats;
+
+  stats->p99 = 0;
+  need = c->stats.requests - c->stats.requests / 100;
+  for (b = 0, seen = 0; b < QOS_BUCKETS && c->stats.requests > 0; b++) {
+    seen += c->hist[b];
+    if (seen >= need) {
+      stats->p99 = b == QOS_BUCKETS - 1 ? 0xffffffff : (2u << b) - 1;
+      break;
+    }
+  }
+}
+
+void qos_report() {
+  static char *names[QOS_CLASSES] = {"foreground", "background", "idle"};
+  qos_stats_t s;
+  u8 i;
+
+  fb_printf("qos_report:\n");
+  for (i = 0; i < QOS_CLASSES; i++) {
+    qos_stats(i, &s);
+    fb_printf("%s { requests: %dd, sectors: %dd, throttled: %dd, "
+              "waited: %dd }\n", names[i], s.requests, s.sectors,
+              s.throttled, s.waited);
+    fb_printf("  latency { p99: %dd, max: %dd }\n", s.p99, s.max);
+  }
+}
@@ -0,0 +1,80 @@
+/* This is the driver for the RAM disk. The sectors are contiguous in memory,
+ * priv points to the first one. */
+
+#include <rd.h>
+#include <ata.h>
+#include <mem.h>
+#include <string.h>
+#include <typedef.h>
+
+static int rd_read(ata_dev_t *dev, int start, int count, void *buf);
+static int rd_write(ata_dev_t *dev, int start, int count, void *buf);
+
+static ata_dev_ops_t rd_ops = {rd_read, rd_write};
+
+static u32 rd_frames(ata_dev_t *dev) {
+  return (dev->size + RD_SECTORS_PER_FRAME - 1) / RD_SECTORS_PER_FRAME;
+}
+
+static int rd_read(ata_dev_t *dev, int start, int count, void *buf) {
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+  memcpy(buf, (u8 *)dev->priv + start * 512, count * 512);
+  return 0;
+}
+
+static int rd_write(ata_dev_t *dev, int start, int count, void *buf) {
+  if (start < 0 || count < 0 || (u32)start + count > dev->size)
+    return -1;
+  memcpy((u8 *)dev->priv + start * 512, buf, count * 512);
+  return 0;
+}
+
+int rd_create(ata_dev_t *dev, u32 sectors, ata_dev_t *src, u32 start) {
+  u8 *mem;
+  u32 i, n;
+
+  if (sectors == 0 ||
+      (src != NULL && (ata_identify(src) == -1 ||
+                       start + sectors > src->size ||
+                       start + sectors < start)))
+    return -1;
+
+  mem = (u8 *)mem_allocate_frames((sectors + RD_SECTORS_PER_FRAME - 1) /
+                                  RD_SECTORS_PER_FRAME,
+                                  MEM_USER_FIRST_FRAME, 0);
+  if (mem == NULL)
+    return -1;
+
+  memset(dev, 0, sizeof(ata_dev_t));
+  dev->present = ATA_DEVICE_PRESENT;
+  dev->flags = ATA_FLAG_IDENTIFIED;
+  dev->type = ATA_TYPE_ATA;
+  dev->size = sectors;
+  strcpy(dev->model, "RAM disk");
+  dev->ops = &rd_ops;
+  dev->priv = mem;
+
+  if (src == NULL) {
+    memset(mem, 0, rd_frames(dev) * MEM_FRAME_SIZE);
+    return 0;
+  }
+
+  /* Preload straight into the disk, in large reads. */
+  for (i = 0; i < sectors; i += n) {
+    n = sectors - i > RD_LOAD_SECTORS ? RD_LOAD_SECTORS : sectors - i;
+    if (ata_read(src, start + i, n, mem + i * 512) == -1) {
+      rd_destroy(dev);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void rd_destroy(ata_dev_t *dev) {
+  mem_release_frames(dev->priv, rd_frames(dev));
+  dev->present = ATA_DEVICE_EMPTY;
+  dev->ops = NULL;
+  dev->priv = NULL;
+  dev->size = 0;
+}
@@ -0,0 +1,156 @@
+/* This is the background media scrubber.
+ *
+ * Every step verifies at most SCRUB_CHUNK_SECTORS of one device, rotating
+ * through the devices in round robin. Steps run in the QOS_IDLE class, whose
+ * token bucket caps the bandwidth and which is held back while the classes
+ * above it are busy. Since the PIO driver is synchronous, a foreground
+ * request can't preempt a chunk in flight, so chunks are kept small enough
+ * to bound that wait.
+ */
+
+#include <scrub.h>
+#include <ata.h>
+#include <timer.h>
+#include <qos.h>
+#include <hw.h>
+#include <fb.h>
+#include <typedef.h>
+
+struct scrub_dev {
+  ata_dev_t *dev;
+  u32 pos;                      /* Next sector to verify. */
+  u32 passes;                   /* Complete passes over the device. */
+  u32 nbad;                     /* Bad sectors found so far. */
+  u32 bad[SCRUB_MAX_BAD];
+};
+
+static struct scrub_dev scrub_devs[SCRUB_MAX_DEVICES];
+static int scrub_count;
+static int scrub_next;          /* Device to visit in the next step. */
+
+void scrub_init(ata_dev_t *devs[], int count) {
+  int i;
+
+  scrub_count = 0;
+  scrub_next = 0;
+  for (i = 0; i < count && scrub_count < SCRUB_MAX_DEVICES; i++) {
+    if (devs[i]->present != ATA_DEVICE_PRESENT || ATA_IS_VIRTUAL(devs[i]))
+      continue;
+    scrub_devs[scrub_count].dev = devs[i];
+    scrub_devs[scrub_count].pos = 0;
+    scrub_devs[scrub_count].passes = 0;
+    scrub_devs[scrub_count].nbad = 0;
+    scrub_count++;
+  }
+}
+
+void scrub_set_rate(u32 sectors_per_sec) {
+  qos_set_limit(QOS_IDLE, sectors_per_sec, 0);
+}
+
+static void scrub_drop(int idx) {
+  for (; idx + 1 < scrub_count; idx++)
+    scrub_devs[idx] = scrub_devs[idx + 1];
+  scrub_count--;
+  if (scrub_next >= scrub_count)
+    scrub_next = 0;
+}
+
+static void scrub_record_bad(struct scrub_dev *s, u32 lba) {
+  if (s->nbad < SCRUB_MAX_BAD)
+    s->bad[s->nbad] = lba;
+  s->nbad++;
+  fb_printf("scrub: bad sector at lba %dd on channel %dd drive %dd\n",
+            lba, s->dev->channel, s->dev->drive);
+}
+
+int scrub_step() {
+  struct scrub_dev *s;
+  u32 n, bad;
+  u64 t0;
+  int ret;
+
+  if (scrub_count == 0)
+    return 0;
+
+  s = scrub_devs + scrub_next;
+
+  /* Devices are only identified on their first use, drop the ones that
+   * turn out not to be ATA disks. */
+  if (ata_identify(s->dev) == -1 || s->dev->type != ATA_TYPE_ATA ||
+      s->dev->size == 0) {
+    scrub_drop(scrub_next);
+    return 1;
+  }
+
+  n = s->dev->size - s->pos;
+  if (n > SCRUB_CHUNK_SECTORS)
+    n = SCRUB_CHUNK_SECTORS;
+
+  if (!qos_admit(QOS_IDLE, n))
+    return 0;
+
+  t0 = hw_rdtsc();
+  ret = ata_verify(s->dev, s->pos, n, &bad);
+  qos_account(QOS_IDLE, n, hw_rdtsc() - t0);
+
+  if (ret == 0) {
+    s->pos += n;
+  }
+  else if (bad >= s->pos && bad < s->pos + n) {
+    /* Remember it and carry on right after the bad sector. */
+    scrub_record_bad(s, bad);
+    s->pos = bad + 1;
+  }
+  else {
+    /* The drive didn't tell us where it failed, blame the whole chunk's
+     * first sector and skip the chunk. */
+    scrub_record_bad(s, s->pos);
+    s->pos += n;
+  }
+
+  if (s->pos >= s->dev->size) {
+    s->pos = 0;
+    s->passes++;
+  }
+  scrub_next = (scrub_next + 1) % scrub_count;
+  return 1;
+}
+
+u32 scrub_position(int idx) {
+  if (idx < 0 || idx >= scrub_count)
+    return 0;
+  return scrub_devs[idx].pos;
+}
+
+void scrub_set_position(int idx, u32 lba) {
+  if (idx < 0 || idx >= scrub_count)
+    return;
+  scrub_devs[idx].pos = lba < scrub_devs[idx].dev->size ? lba : 0;
+}
+
+u32 scrub_bad_lbas(int idx, u32 *lbas, u32 max) {
+  u32 i;
+
+  if (idx < 0 || idx >= scrub_count)
+    return 0;
+  for (i = 0; i < max && i < scrub_devs[idx].nbad && i < SCRUB_MAX_BAD; i++)
+    lbas[i] = scrub_devs[idx].bad[i];
+  return scrub_devs[idx].nbad;
+}
+
+void scrub_report() {
+  int i;
+  u32 j;
+  struct scrub_dev *s;
+
+  fb_printf("scrub_report:\n");
+  for (i = 0; i < scrub_count; i++) {
+    s = scrub_devs + i;
+    fb_printf("dev %dd:%dd { pos: %dd/%dd, passes: %dd, bad: %dd }\n",
+              s->dev->channel, s->dev->drive, s->pos, s->dev->size,
+              s->passes, s->nbad);
+    for (j = 0; j < s->nbad && j < SCRUB_MAX_BAD; j++)
+      fb_printf("  bad lba %dd\n", s->bad[j]);
+  }
+}
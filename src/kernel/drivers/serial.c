@@ -4,6 +4,7 @@
 #include <serial.h>
 #include <interrupts.h>
 #include <mem.h>
+#include <arena.h>
 #include <hw.h>
 #include <pic.h>
 
@@ -123,7 +124,7 @@ int serial_init(serial_device_t dev, serial_port_config_t *config) {
   outb(SERIAL_MODEM_CONTROL_PORT(dev), 0x0);
 
   /* Prepare the buffer for the device. */
-  buffer->buffer = (char *)kalloc(SERIAL_BUFFER_LEN);
+  buffer->buffer = (char *)arena_alloc(&arena_boot, SERIAL_BUFFER_LEN);
   if (buffer->buffer == NULL) {
     return -1;
   }
@@ -139,11 +140,13 @@ int serial_init(serial_device_t dev, serial_port_config_t *config) {
 
 void serial_write(serial_device_t dev, void *buf, u32 len){
   int i;
+  IO_ACCT_BEGIN(IO_OP_SERIAL_WRITE);
   for (i = 0; i < len; i++) {
     while ((inb(SERIAL_LINE_STATUS_PORT(dev)) &
             SERIAL_LINE_STATUS_EMPTY_TRANSMITTER_REG) == 0);
     outb(SERIAL_DATA_PORT(dev), ((u8*)(buf))[i]);
   }
+  IO_ACCT_END();
 }
 
 u32 serial_read(serial_device_t dev, void *buf, u32 len) {
@@ -166,6 +169,19 @@ u32 serial_read(serial_device_t dev, void *buf, u32 len) {
   return 1;
 }
 
+u32 serial_pending(serial_device_t dev) {
+  serial_buffer_t *buffer;
+  int offset;
+
+  offset = serial_dev2offset(dev);
+  if (offset == SERIAL_OFFSET_INVALID) {
+    return 0;
+  }
+  buffer = serial_buffers + offset;
+  return (buffer->write_head + SERIAL_BUFFER_LEN - buffer->read_head) %
+         SERIAL_BUFFER_LEN;
+}
+
 int serial_dev2offset(serial_device_t dev) {
   switch (dev) {
     case SERIAL_COM1:
@@ -211,6 +227,7 @@ void serial_interrupt_handler(itr_cpu_regs_t regs,
   serial_buffer_t *buffer;
   int offset;
   serial_device_t dev;
+  IO_ACCT_BEGIN(IO_OP_SERIAL_IRQ);
 
   offset = serial_irq2offset(data.irq);
   if (offset != SERIAL_OFFSET_INVALID) {
@@ -225,4 +242,5 @@ void serial_interrupt_handler(itr_cpu_regs_t regs,
     }
   }
   pic_send_eoi(data.irq);
+  IO_ACCT_END();
 }
@@ -0,0 +1,206 @@
+/* This is the slab allocator for fixed-size kernel objects.
+ *
+ * A slab is on exactly one of the lists of its cache: partial while it has
+ * both free and used objects, full when it has no free ones and empty when
+ * it has no used ones. Allocations are served from the first partial slab,
+ * then from an empty one, and only then a new frame is requested.
+ *
+ * The header is followed by one u16 per object, then the objects at
+ * cache->offset. The entry of a free object holds the index of the next
+ * free one, the entry of an allocated object is SLAB_USED, which is also
+ * how slab_free tells a double free.
+ */
+
+#include <slab.h>
+#include <mem.h>
+#include <fb.h>
+#include <typedef.h>
+
+struct slab {
+  struct slab *next;
+  struct slab *prev;
+  slab_cache_t *cache;
+  u16 free;                     /* First free object, SLAB_NONE if none. */
+  u16 used;                     /* Objects allocated. */
+};
+
+#define SLAB_NONE                 0xffff
+#define SLAB_USED                 0xfffe
+
+#define SLAB_OF(obj) \
+  ((struct slab *)((u32)(obj) & ~(MEM_FRAME_SIZE - 1)))
+#define SLAB_LINKS(s)             ((u16 *)((s) + 1))
+#define SLAB_OBJECT(s, i) \
+  ((u8 *)(s) + (s)->cache->offset + (i) * (s)->cache->stats.size)
+
+static slab_cache_t *slab_caches;
+
+void slab_init() {
+  slab_caches = NULL;
+}
+
+static void slab_push(struct slab **list, struct slab *s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (s->next != NULL)
+    s->next->prev = s;
+  *list = s;
+}
+
+static void slab_unlink(struct slab **list, struct slab *s) {
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    *list = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+}
+
+int slab_cache_init(slab_cache_t *cache, char *name, u32 size,
+                    void (*ctor)(void *)) {
+  u32 n, offset;
+
+  if (size == 0 || size > SLAB_MAX_SIZE)
+    return -1;
+  size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+
+  /* As many objects as fit along with their links, the objects aligned. */
+  n = (MEM_FRAME_SIZE - sizeof(struct slab)) / (size + sizeof(u16));
+  while (1) {
+    offset = (sizeof(struct slab) + n * sizeof(u16) + SLAB_ALIGN - 1) &
+             ~(SLAB_ALIGN - 1);
+    if (offset + n * size <= MEM_FRAME_SIZE)
+      break;
+    n--;
+  }
+
+  cache->name = name;
+  cache->ctor = ctor;
+  cache->partial = NULL;
+  cache->full = NULL;
+  cache->empty = NULL;
+  cache->nempty = 0;
+  cache->offset = offset;
+  cache->stats.size = size;
+  cache->stats.per_slab = n;
+  cache->stats.slabs = 0;
+  cache->stats.used = 0;
+  cache->stats.peak = 0;
+  cache->stats.allocs = 0;
+  cache->stats.frees = 0;
+  cache->stats.failures = 0;
+
+  cache->next = slab_caches;
+  slab_caches = cache;
+  return 0;
+}
+
+/* Gets a frame and threads its objects in the free list, constructing
+ * them. */
+static struct slab *slab_grow(slab_cache_t *cache) {
+  struct slab *s;
+  u16 *links;
+  u32 i;
+
+  s = (struct slab *)mem_allocate_kernel_frames(1);
+  if (s == NULL)
+    return NULL;
+  s->cache = cache;
+  s->used = 0;
+  s->free = 0;
+  links = SLAB_LINKS(s);
+  for (i = 0; i < cache->stats.per_slab; i++) {
+    links[i] = i + 1 < cache->stats.per_slab ? i + 1 : SLAB_NONE;
+    if (cache->ctor != NULL)
+      cache->ctor(SLAB_OBJECT(s, i));
+  }
+  cache->stats.slabs++;
+  return s;
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+  struct slab *s;
+  u16 i;
+
+  if ((s = cache->partial) == NULL) {
+    if ((s = cache->empty) != NULL) {
+      slab_unlink(&cache->empty, s);
+      cache->nempty--;
+    }
+    else if ((s = slab_grow(cache)) == NULL) {
+      cache->stats.failures++;
+      return NULL;
+    }
+    slab_push(&cache->partial, s);
+  }
+
+  i = s->free;
+  s->free = SLAB_LINKS(s)[i];
+  SLAB_LINKS(s)[i] = SLAB_USED;
+  s->used++;
+  if (s->free == SLAB_NONE) {
+    slab_unlink(&cache->partial, s);
+    slab_push(&cache->full, s);
+  }
+
+  cache->stats.allocs++;
+  if (++cache->stats.used > cache->stats.peak)
+    cache->stats.peak = cache->stats.used;
+  return SLAB_OBJECT(s, i);
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+  struct slab *s;
+  u32 off, i;
+
+  if (obj == NULL)
+    return;
+  s = SLAB_OF(obj);
+  if (s->cache != cache)
+    return; /* Not ours. */
+  off = (u8 *)obj - (u8 *)s - cache->offset;
+  i = off / cache->stats.size;
+  if ((u8 *)obj < (u8 *)s + cache->offset || off % cache->stats.size != 0 ||
+      i >= cache->stats.per_slab || SLAB_LINKS(s)[i] != SLAB_USED)
+    return; /* Not an object, or a double free. */
+
+  if (s->free == SLAB_NONE) {
+    slab_unlink(&cache->full, s);
+    slab_push(&cache->partial, s);
+  }
+  SLAB_LINKS(s)[i] = s->free;
+  s->free = i;
+  s->used--;
+  cache->stats.frees++;
+  cache->stats.used--;
+
+  if (s->used == 0) {
+    slab_unlink(&cache->partial, s);
+    if (cache->nempty < SLAB_KEEP_EMPTY) {
+      slab_push(&cache->empty, s);
+      cache->nempty++;
+    }
+    else {
+      s->cache = NULL;
+      mem_release_kernel_frames(s, 1);
+      cache->stats.slabs--;
+    }
+  }
+}
+
+void slab_stats(slab_cache_t *cache, slab_stats_t *stats) {
+  *stats = cache->stats;
+}
+
+void slab_report() {
+  slab_cache_t *c;
+
+  fb_printf("slab_report:\n");
+  for (c = slab_caches; c != NULL; c = c->next) {
+    fb_printf("%s { size: %dd, slabs: %dd, used: %dd/%dd, peak: %dd }\n",
+              c->name, c->stats.size, c->stats.slabs, c->stats.used,
+              c->stats.slabs * c->stats.per_slab, c->stats.peak);
+    fb_printf("  allocs: %dd, frees: %dd, failures: %dd\n",
+              c->stats.allocs, c->stats.frees, c->stats.failures);
+  }
+}
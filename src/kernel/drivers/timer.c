@@ -0,0 +1,65 @@
+/* This is the driver for the PIT (8253/8254). */
+
+#include <timer.h>
+#include <io.h>
+#include <pic.h>
+#include <interrupts.h>
+#include <typedef.h>
+
+/* PIT ports. */
+#define TIMER_CHANNEL_0_PORT      0x40
+#define TIMER_COMMAND_PORT        0x43
+
+/* The PIT's input clock runs at this frequency; channel 0 divides it by a
+ * 16 bits reload value. */
+#define TIMER_BASE_FREQUENCY      1193182
+
+/* Command bits: channel 0, access lobyte/hibyte, mode 3 (square wave),
+ * binary counting. */
+#define TIMER_CMD_CHANNEL_0       0x00
+#define TIMER_CMD_ACCESS_LOHI     0x30
+#define TIMER_CMD_MODE_3          0x06
+
+static volatile u32 timer_tick_count;
+static u32 timer_frequency;
+
+void timer_interrupt_handler(itr_cpu_regs_t regs,
+                             itr_intr_data_t intr,
+                             itr_stack_state_t stack) {
+  IO_ACCT_BEGIN(IO_OP_TIMER_IRQ);
+  timer_tick_count++;
+  pic_send_eoi(intr.irq);
+  IO_ACCT_END();
+}
+
+int timer_init(u32 hz) {
+  u32 divisor;
+
+  if (hz == 0 || hz > TIMER_BASE_FREQUENCY)
+    return -1;
+
+  divisor = TIMER_BASE_FREQUENCY / hz;
+  if (divisor > 0xffff)
+    return -1;
+
+  timer_tick_count = 0;
+  timer_frequency = hz;
+
+  outb(TIMER_COMMAND_PORT, TIMER_CMD_CHANNEL_0 |
+                           TIMER_CMD_ACCESS_LOHI |
+                           TIMER_CMD_MODE_3);
+  outb(TIMER_CHANNEL_0_PORT, (u8)(divisor & 0x00ff));
+  outb(TIMER_CHANNEL_0_PORT, (u8)((divisor >> 8) & 0x00ff));
+
+  itr_set_interrupt_handler(PIC_TIMER_IRQ, timer_interrupt_handler,
+                            IDT_PRESENT | IDT_DPL_RING_0 | IDT_GATE_INTR);
+  return 0;
+}
+
+u32 timer_ticks() {
+  return timer_tick_count;
+}
+
+u32 timer_hz() {
+  return timer_frequency;
+}
@@ -0,0 +1,163 @@
+/* I/O trace capture. Check trace.h for the trace format.
+ *
+ * The trace lives in a single contiguous buffer laid out exactly as its
+ * binary encoding, header first, so saving it is just writing the buffer.
+ * Timestamps are taken with the TSC, which is calibrated against the timer
+ * once per trace to turn cycles into microseconds.
+ */
+
+#include <trace.h>
+#include <ata.h>
+#include <hw.h>
+#include <mem.h>
+#include <timer.h>
+#include <serial.h>
+#include <string.h>
+#include <typedef.h>
+
+#define TRACE_CALIBRATION_TICKS   5
+#define TRACE_MAX_COUNT           0xffff    /* Sectors in one record. */
+
+static trace_header_t *trace_buf;
+static u32 trace_frames;          /* Size of trace_buf in frames. */
+static u32 trace_max;             /* Records trace_buf can hold. */
+static u8 trace_active;
+static u64 trace_t0;              /* TSC at trace_start(). */
+static u32 trace_cycles_per_us;
+
+#define TRACE_RECORDS()           ((trace_record_t *)(trace_buf + 1))
+
+/* Measures how many TSC cycles fit in a microsecond. */
+static u32 trace_calibrate() {
+  u32 tick;
+  u64 t0;
+
+  tick = timer_ticks();
+  while (timer_ticks() == tick)
+    hw_hlt();
+  t0 = hw_rdtsc();
+  tick = timer_ticks();
+  while (timer_ticks() - tick < TRACE_CALIBRATION_TICKS)
+    hw_hlt();
+
+  return (u32)div64(hw_rdtsc() - t0,
+                    TRACE_CALIBRATION_TICKS * (1000000 / timer_hz()));
+}
+
+void trace_init() {
+  trace_buf = NULL;
+  trace_frames = 0;
+  trace_max = 0;
+  trace_active = 0;
+}
+
+int trace_start(u32 max_records) {
+  u32 frames;
+
+  trace_active = 0;
+  if (trace_buf != NULL) {
+    mem_release_kernel_frames(trace_buf, trace_frames);
+    trace_buf = NULL;
+  }
+
+  frames = (sizeof(trace_header_t) + max_records * sizeof(trace_record_t) +
+            MEM_FRAME_SIZE - 1) / MEM_FRAME_SIZE;
+  trace_buf = (trace_header_t *)mem_allocate_kernel_frames(frames);
+  if (trace_buf == NULL)
+    return -1;
+  trace_frames = frames;
+  trace_max = max_records;
+
+  trace_buf->magic = TRACE_MAGIC;
+  trace_buf->version = TRACE_VERSION;
+  trace_buf->record_size = sizeof(trace_record_t);
+  trace_buf->count = 0;
+  trace_buf->dropped = 0;
+
+  trace_cycles_per_us = trace_calibrate();
+  if (trace_cycles_per_us == 0)
+    trace_cycles_per_us = 1;
+  trace_t0 = hw_rdtsc();
+  trace_active = 1;
+  return 0;
+}
+
+void trace_stop() {
+  trace_active = 0;
+}
+
+void trace_record(u8 op, ata_dev_t *dev, u32 lba, u32 count, u64 t0, int ret) {
+  trace_record_t *r;
+  u32 time, latency, n;
+
+  if (!trace_active)
+    return;
+
+  time = (u32)div64(t0 - trace_t0, trace_cycles_per_us);
+  latency = (u32)div64(hw_rdtsc() - t0, trace_cycles_per_us);
+  if (ret != 0)
+    op |= TRACE_OP_FAILED;
+
+  for (; count > 0; lba += n, count -= n) {
+    n = count > TRACE_MAX_COUNT ? TRACE_MAX_COUNT : count;
+    if (trace_buf->count == trace_max) {
+      trace_buf->dropped++;
+      return;
+    }
+    r = TRACE_RECORDS() + trace_buf->count++;
+    r->time = time;
+    r->op = op;
+    r->dev = dev->channel * 2 + dev->drive;
+    r->count = n;
+    r->lba = lba;
+    r->latency = latency;
+  }
+}
+
+u32 trace_count() {
+  return trace_buf == NULL ? 0 : trace_buf->count;
+}
+
+void trace_dump(serial_device_t port) {
+  char line[96];
+  int len;
+  u32 i;
+  trace_record_t *r;
+
+  if (trace_buf == NULL)
+    return;
+
+  len = sprintf(line, "# ata-trace %dd %dd %dd\n", TRACE_VERSION,
+                trace_buf->count, trace_buf->dropped);
+  serial_write(port, line, len);
+  for (i = 0, r = TRACE_RECORDS(); i < trace_buf->count; i++, r++) {
+    len = sprintf(line, "%dd %s %dd %dd %dd %dd%s\n",
+                  r->time,
+                  (r->op & ~TRACE_OP_FAILED) == TRACE_OP_WRITE ? "W" : "R",
+                  r->dev, r->lba, r->count, r->latency,
+                  r->op & TRACE_OP_FAILED ? "!" : "");
+    serial_write(port, line, len);
+  }
+}
+
+int trace_save(ata_dev_t *dev, u32 lba) {
+  u8 active;
+  u32 bytes, sectors;
+  int ret;
+
+  if (trace_buf == NULL)
+    return -1;
+
+  bytes = sizeof(trace_header_t) + trace_buf->count * sizeof(trace_record_t);
+  sectors = (bytes + 511) / 512;
+  /* The buffer is frame sized, so the padding is already there. */
+  memset((u8 *)trace_buf + bytes, 0, sectors * 512 - bytes);
+
+  /* Don't trace our own writes. */
+  active = trace_active;
+  trace_active = 0;
+  ret = ata_write(dev, lba, sectors, trace_buf);
+  trace_active = active;
+
+  return ret == 0 ? sectors : -1;
+}
@@ -4,6 +4,19 @@
 global hw_hlt
 global hw_cli
 global hw_sti
+global hw_sti_hlt
+global hw_cli_save
+global hw_restore_flags
+global hw_rdtsc
+global hw_cpuid_features
+global hw_read_cr0
+global hw_write_cr0
+global hw_read_cr2
+global hw_read_cr3
+global hw_write_cr3
+global hw_read_cr4
+global hw_write_cr4
+global hw_invlpg
 
 ; Invoke hlt.
 hw_hlt:
@@ -19,3 +32,80 @@ hw_sti:
 hw_cli:
   cli
   ret
+
+; Enable interrupts and halt. STI only takes effect after the next
+; instruction, so no interrupt can sneak in between both: a caller that
+; checked its wake up condition with interrupts disabled won't sleep through
+; the interrupt it was waiting for.
+hw_sti_hlt:
+  sti
+  hlt
+  ret
+
+; Disable interrupts and return EFLAGS as it was before, so the caller can
+; put IF back the way it found it.
+hw_cli_save:
+  pushfd
+  pop eax
+  cli
+  ret
+
+; Load EFLAGS from [esp + 4], usually what hw_cli_save returned.
+hw_restore_flags:
+  push dword [esp + 4]
+  popfd
+  ret
+
+; Read the time stamp counter. RDTSC leaves it in EDX:EAX, which is exactly
+; where the C calling convention expects a 64 bits return value.
+hw_rdtsc:
+  rdtsc
+  ret
+
+; Return EDX of CPUID leaf 1, the feature flags. CPUID also clobbers EBX,
+; which the C calling convention wants preserved.
+hw_cpuid_features:
+  push ebx
+  mov eax, 1
+  cpuid
+  mov eax, edx
+  pop ebx
+  ret
+
+; Control registers. The write routines take the new value in [esp + 4].
+hw_read_cr0:
+  mov eax, cr0
+  ret
+
+hw_write_cr0:
+  mov eax, [esp + 4]
+  mov cr0, eax
+  ret
+
+hw_read_cr2:
+  mov eax, cr2
+  ret
+
+hw_read_cr3:
+  mov eax, cr3
+  ret
+
+hw_write_cr3:
+  mov eax, [esp + 4]
+  mov cr3, eax
+  ret
+
+hw_read_cr4:
+  mov eax, cr4
+  ret
+
+hw_write_cr4:
+  mov eax, [esp + 4]
+  mov cr4, eax
+  ret
+
+; Drop the TLB entry of the page holding the address in [esp + 4].
+hw_invlpg:
+  mov eax, [esp + 4]
+  invlpg [eax]
+  ret
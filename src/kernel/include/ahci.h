@@ -0,0 +1,55 @@
+/* AHCI host controller driver. SATA disks behind the first AHCI controller
+ * found on the PCI bus show up as ata_dev_t's whose ops issue DMA commands,
+ * so ata_read and ata_write work on them unchanged. Requests are split in
+ * chunks of AHCI_CHUNK_SECTORS and, when the disk supports native command
+ * queuing, up to AHCI_SLOTS of them are outstanding at once. Completions
+ * are reaped from the controller's interrupt.
+ *
+ * ahci_submit and ahci_complete expose the queue directly to callers that
+ * want to keep several requests in flight themselves. Buffers are handed to
+ * the controller as they are, so they must be 2 byte aligned and, since
+ * there's no paging, physically contiguous is the same as contiguous. */
+
+#ifndef __AHCI_H__
+#define __AHCI_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define AHCI_MAX_DEVICES          4
+#define AHCI_SLOTS                32    /* Command slots (NCQ tags) per port. */
+#define AHCI_PRDT_ENTRIES         8
+#define AHCI_PRD_BYTES            0x400000  /* 4M per PRDT entry. */
+#define AHCI_MAX_SECTORS          8192  /* Per command, one full PRDT entry.*/
+#define AHCI_CHUNK_SECTORS        128   /* ata_read/ata_write split size. */
+#define AHCI_TIMEOUT_TICKS        500   /* 5s at TIMER_HZ. */
+
+typedef struct ahci_stats {
+  u32 commands;         /* Commands issued. */
+  u32 queued;           /* Of which were NCQ commands. */
+  u32 depth;            /* Most commands outstanding at once. */
+  u32 irqs;             /* Interrupts serviced for the port. */
+  u32 errors;           /* Task file errors and timeouts. */
+} ahci_stats_t;
+
+/* Looks for an AHCI controller and sets up to count of its SATA disks in
+ * devs. Returns how many were found. */
+int ahci_init(ata_dev_t *devs[], int count);
+
+/* Queues a read (write == 0) or a write of count sectors at lba. Returns
+ * the tag to wait on with ahci_complete, or -1 if the request is invalid or
+ * every slot is busy. buf can't be in the mmap window, whose addresses the
+ * HBA doesn't see; copy through a buffer from iobuf_get instead. */
+int ahci_submit(ata_dev_t *dev, int write, u32 lba, u32 count, void *buf);
+
+/* Waits for the command with tag and releases it. Returns 0 on success and
+ * -1 on failure. */
+int ahci_complete(ata_dev_t *dev, int tag);
+
+/* Fills stats with the counters of dev. */
+void ahci_stats(ata_dev_t *dev, ahci_stats_t *stats);
+
+/* Prints the counters of dev to the framebuffer. */
+void ahci_report(ata_dev_t *dev);
+
+#endif /* __AHCI_H__ */
@@ -0,0 +1,67 @@
+/* Arenas. An arena hands out memory by bumping a pointer through chunks of
+ * frames, so allocating is O(1) and there's no per-object free: everything
+ * is given back at once, by arena_reset when the arena will be reused and
+ * by arena_release when it won't. They suit memory that lives as long as
+ * the kernel, like the tables and buffers set up at boot, and scratch
+ * memory that only lives for one operation, and keep both out of the
+ * kalloc heap.
+ *
+ * Arenas are declared by their users, usually as statics, and set up with
+ * arena_init; no memory is taken until the first allocation. Allocations
+ * bigger than a chunk get a chunk of their own. arena_boot is the arena for
+ * boot-time structures that are never freed. */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <typedef.h>
+
+#define ARENA_ALIGN               8     /* Default alignment. */
+#define ARENA_BOOT_FRAMES         2     /* Chunk size of arena_boot. */
+
+struct arena_chunk;
+
+typedef struct arena_stats {
+  u32 chunks;           /* Chunks right now. */
+  u32 frames;           /* Frames in them. */
+  u32 bytes;            /* Handed out since the last reset, padding
+                         * included. */
+  u32 allocs;           /* Since the last reset. */
+  u32 failures;         /* Allocations that found no memory. */
+  u32 resets;
+} arena_stats_t;
+
+typedef struct arena {
+  char *name;
+  u32 chunk_frames;             /* Usual size of a chunk. */
+  struct arena_chunk *chunks;   /* The current one first. */
+  arena_stats_t stats;
+} arena_t;
+
+extern arena_t arena_boot;
+
+/* Sets up arena_boot. Called once by mem_init. */
+void arena_boot_init();
+
+/* Sets up arena with chunks of chunk_frames frames. */
+void arena_init(arena_t *arena, char *name, u32 chunk_frames);
+
+/* Returns bytes bytes of arena aligned to ARENA_ALIGN, or NULL if there's
+ * no memory left. */
+void *arena_alloc(arena_t *arena, u32 bytes);
+
+/* Same as arena_alloc, aligned to align, a power of two up to a frame. */
+void *arena_alloc_aligned(arena_t *arena, u32 bytes, u32 align);
+
+/* Forgets every allocation. The current chunk is kept for the next ones
+ * and the others go back to the frame allocator. */
+void arena_reset(arena_t *arena);
+
+/* Forgets every allocation and gives all chunks back. The arena can still
+ * be used. */
+void arena_release(arena_t *arena);
+
+/* Fills stats with the counters of arena. */
+void arena_stats(arena_t *arena, arena_stats_t *stats);
+
+#endif /* __ARENA_H__ */
@@ -11,6 +11,11 @@
 #define ATA_DRIVE_SLAVE           0x01
 #define ATA_TYPE_ATA              0x00
 #define ATA_TYPE_ATAPI            0x01
+#define ATA_FLAG_VERIFY           0x01  /* Verify every write with READ
+                                         * VERIFY SECTORS. */
+#define ATA_FLAG_IDENTIFIED       0x02  /* IDENTIFY already ran. Until it
+                                         * does only present, channel and
+                                         * drive are valid. */
 
 
 #define ATA_SIZE
@@ -19,26 +24,68 @@ enum ata_type{ATA_TYPE_ATAA, ATA_TYPE_ATAPII, ATA_TYPE_PATAPI,
               ATA_TYPE_SATAPI, ATA_TYPE_SATA, ATA_TYPE_UNKNOWN};
 
 
+struct ata_dev;
+
+/* Virtual block devices (compressed, log-structured, RAM backed, ...) are
+ * ata_dev_t's with ops set. ata_read and ata_write hand their requests to
+ * ops instead of the IDE channel. */
+typedef struct ata_dev_ops {
+  int (*read)(struct ata_dev *, int, int, void *);
+  int (*write)(struct ata_dev *, int, int, void *);
+} ata_dev_ops_t;
+
 /* Public ATA device structure. */
 typedef struct ata_dev {
   u8 present;         /* ATA_DEVICE_* */
   u8 channel;         /* ATA_CHANNEL_* */
   u8 drive;           /* ATA_DRIVE_* */
+  u8 flags;           /* ATA_FLAG_* */
   u16 type;           /* ATA_TYPE_* */
   u16 signature;      /* Drive Signature */
   u16 capabilities;   /* Features */
   u32 commandsets;    /* Supported Command Sets */
   u32 size;           /* Size in sectors. */
   char model[41];     /* Model in string. */
+  ata_dev_ops_t *ops; /* NULL for IDE drives. */
+  void *priv;         /* Private state of a virtual device. */
 } ata_dev_t;
 
+#define ATA_IS_VIRTUAL(dev)       ((dev)->ops != NULL)
+
+/* Completion counters. Each wait for a data block is either spun on the
+ * alternate status register or slept on the channel's IRQ. */
+typedef struct ata_completion_stats {
+  u32 spins;          /* Waits that spun. */
+  u32 sleeps;         /* Waits that slept on the IRQ. */
+  u32 timeouts;       /* Sleeps whose IRQ never came. */
+  u32 latency;        /* Moving average of a spun wait, in TSC cycles. */
+} ata_completion_stats_t;
+
 int poll(int);
 void ata_build(ata_dev_t*, u8, char*);
 void detail_dev(ata_dev_t*);
 void delay(u16, int);
 u8 identify_command(ata_dev_t *, u8, char*);
+void ata_parse_identify(ata_dev_t *, char *);
 int ata_init(ata_dev_t * []);
+int ata_identify(ata_dev_t *);
+int ata_identify_step();
 int ata_read(ata_dev_t *, int, int, void *);
 int ata_write(ata_dev_t *, int, int, void *);
+int ata_issue(ata_dev_t *, u8, u8, u32, u32);
+u32 ata_error_lba(ata_dev_t *, int);
+int ata_flush(ata_dev_t *);
+int ata_verify(ata_dev_t *, int, int, u32 *);
+void ata_set_verify(ata_dev_t *, int);
+int ata_wait_data(ata_dev_t *, int);
+int ata_wait_done(ata_dev_t *);
+int ata_start_read(ata_dev_t *, u32, u32);
+int ata_start_write(ata_dev_t *, u32, u32);
+int ata_pio_in(ata_dev_t *, void *);
+int ata_pio_out(ata_dev_t *, void *, int);
+void ata_completion_stats(ata_dev_t *, ata_completion_stats_t *);
+void ata_set_spin_threshold(u32);
+int ata_pread(ata_dev_t *, u64, u32, void *);
+int ata_pwrite(ata_dev_t *, u64, u32, void *);
 
 #endif
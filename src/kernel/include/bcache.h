@@ -0,0 +1,81 @@
+/* Block cache. Cached devices are virtual ata_dev_t's layered on a whole
+ * device that keep its recently read blocks in memory. All of them share a
+ * pool of BCACHE_BLOCKS blocks, evicted least recently used first. Writes
+ * go through to the backing device and update the cached copies.
+ *
+ * To avoid starting cold after every reboot, the cache can keep hints in a
+ * reserved area of a disk, if the kernel was given one: a sorted list of the extents of the hottest
+ * blocks, saved from the idle loop every BCACHE_HINT_INTERVAL ticks when it
+ * changed. Once bcache_set_hints loaded them, bcache_create prefetches the
+ * extents of the new device in large sequential reads before returning.
+ * Devices are named in the hints by the order they were created in, so the
+ * kernel must create them in the same order on every boot; hints for a
+ * device whose size changed are ignored.
+ *
+ * Layout of the hint area:
+ *
+ *   header                   magic, sizes of the devices, checksum
+ *   extents                  device, first block and length, sorted
+ */
+
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define BCACHE_MAGIC              0x31484342  /* "BCH1" */
+#define BCACHE_VERSION            1
+#define BCACHE_MAX_DEVICES        4
+#define BCACHE_BLOCK_SECTORS      8     /* 4K blocks. */
+#define BCACHE_BLOCK_BYTES        (BCACHE_BLOCK_SECTORS * 512)
+#define BCACHE_BLOCKS             128   /* 512K shared by all devices. */
+#define BCACHE_HINT_SECTORS       4     /* Size of the hint area. */
+#define BCACHE_HINT_BLOCKS        96    /* Hottest blocks kept in hints. */
+#define BCACHE_HINT_INTERVAL      3000  /* 30s at TIMER_HZ. */
+#define BCACHE_BATCH_BLOCKS       16    /* Blocks prefetched per read. */
+#define BCACHE_BOOT_LOOKUPS       1024  /* Window for the boot hit rate. */
+
+typedef struct bcache_stats {
+  u32 hits;             /* Block lookups served from memory. */
+  u32 misses;           /* Block lookups that went to the disk. */
+  u32 prefetched;       /* Blocks loaded from the hints. */
+  u32 useful;           /* Of which were hit afterwards. */
+  u32 batches;          /* Reads issued to prefetch them. */
+  u32 saves;            /* Hint saves. */
+  u32 boot_hits;        /* Hits in the first BCACHE_BOOT_LOOKUPS lookups. */
+  u32 boot_lookups;
+  u32 hit_rate;         /* hits / lookups, times 100. */
+  u32 boot_hit_rate;    /* boot_hits / boot_lookups, times 100. */
+} bcache_stats_t;
+
+/* Forgets every cached device, the hint area and the counters. */
+void bcache_init();
+
+/* Uses the BCACHE_HINT_SECTORS sectors at lba of dev as the hint area and
+ * loads the hints saved there. They are overwritten on every save, so the
+ * area must belong to the cache alone. Returns the number of extents
+ * loaded, 0 if the area holds no valid hints, and -1 on failure, in which
+ * case no hints are saved either. */
+int bcache_set_hints(ata_dev_t *dev, u32 lba);
+
+/* Makes dev a cached device on the whole of backing and prefetches the
+ * blocks the hints list for it. Returns 0 on success and -1 on failure. */
+int bcache_create(ata_dev_t *dev, ata_dev_t *backing);
+
+/* Writes the hints of the blocks hot right now to the hint area. Returns 0
+ * on success and -1 on failure. */
+int bcache_save_hints();
+
+/* Saves the hints if they changed and BCACHE_HINT_INTERVAL elapsed since
+ * the last save, when the QOS_BACKGROUND class is admitted. Returns 1 if
+ * it did some work and 0 otherwise. */
+int bcache_step();
+
+/* Fills stats with the counters of the cache. */
+void bcache_stats(bcache_stats_t *stats);
+
+/* Prints the counters of the cache to the framebuffer. */
+void bcache_report();
+
+#endif /* __BCACHE_H__ */
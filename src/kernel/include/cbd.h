@@ -0,0 +1,73 @@
+/* Compressed block device. It is a virtual ata_dev_t layered on a range of
+ * sectors of another device, the backing partition. The logical device is
+ * split in chunks of CBD_CHUNK_SECTORS which are compressed with lz.h and
+ * stored as extents of whole sectors, so compressible data moves fewer
+ * sectors over the PIO bus. All-zero chunks aren't stored at all.
+ *
+ * Layout of the backing partition:
+ *
+ *   sector 0                 header (struct cbd_header)
+ *   sectors 1 .. map         chunk to extent map, 8 bytes per chunk
+ *   rest                     extents
+ *
+ * The map is kept in memory and only written back by cbd_sync, cbd_close
+ * and when CBD_PENDING_SLOTS extents are waiting to be reused. Chunks are
+ * always stored out of place and an extent is only reused once a map that
+ * no longer points to it is on disk, so after a crash every chunk reads
+ * either as of the last map written or, if the crash hit in the middle of
+ * writing the map, as of the one being written. Writes after the last sync
+ * are lost. */
+
+#ifndef __CBD_H__
+#define __CBD_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define CBD_MAGIC                 0x31444243  /* "CBD1" */
+#define CBD_VERSION               1
+#define CBD_CHUNK_SECTORS         8     /* 4K chunks. */
+#define CBD_CHUNK_BYTES           (CBD_CHUNK_SECTORS * 512)
+#define CBD_FREE_SLOTS            64    /* Freed extents remembered per
+                                         * size. Extents that don't fit are
+                                         * leaked until the free lists are
+                                         * rebuilt from the map, on open or
+                                         * when the device fills up. */
+#define CBD_PENDING_SLOTS         128   /* Extents freed since the last sync,
+                                         * cbd_sync runs when it fills up. */
+
+typedef struct cbd_stats {
+  u32 reads;            /* Read requests. */
+  u32 writes;           /* Write requests. */
+  u32 logical;          /* Sectors requested by callers. */
+  u32 physical;         /* Sectors moved to or from the backing device. */
+  u32 in;               /* Sectors handed to the compressor. */
+  u32 out;              /* Sectors it stored for them. */
+  u32 holes;            /* All-zero chunks written as holes. */
+  u32 leaked;           /* Sectors dropped by full free lists. */
+  u32 ticks;            /* Timer ticks spent serving requests. */
+  u32 ratio;            /* in / out, times 100. */
+  u32 rate;             /* Logical throughput, in sectors per second. */
+} cbd_stats_t;
+
+/* Makes dev a compressed device of logical sectors on the sectors of
+ * backing starting at start. An existing device with the same geometry is
+ * opened, anything else is formatted. Returns 0 on success and -1 on
+ * failure, which includes a header or map that can't be read and a map
+ * with extents outside the device. */
+int cbd_create(ata_dev_t *dev, ata_dev_t *backing, u32 start, u32 sectors,
+               u32 logical);
+
+/* Writes the header and map back to the backing device. */
+int cbd_sync(ata_dev_t *dev);
+
+/* Syncs dev and releases its memory. dev is no longer usable. */
+int cbd_close(ata_dev_t *dev);
+
+/* Fills stats with the counters of dev. */
+void cbd_stats(ata_dev_t *dev, cbd_stats_t *stats);
+
+/* Prints the counters of dev to the framebuffer. */
+void cbd_report(ata_dev_t *dev);
+
+#endif /* __CBD_H__ */
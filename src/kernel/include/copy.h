@@ -0,0 +1,38 @@
+/* Device to device copy engine. When source and destination sit on
+ * different channels the copy is pipelined: while the destination drive is
+ * committing chunk N the CPU is already pulling chunk N+1 from the source,
+ * and the source drive seeks to chunk N+1 while chunk N is pushed to the
+ * destination. On the same channel, or with devices that are not plain IDE
+ * drives, it falls back to alternating ata_read and ata_write. Both paths
+ * honor verify-after-write and show up in an active trace. Copies run in
+ * the QOS_BACKGROUND class and wait for admission before every chunk. */
+
+#ifndef __COPY_H__
+#define __COPY_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define COPY_CHUNK_SECTORS        128   /* 64K per chunk. */
+
+/* Flags. */
+#define COPY_SKIP_ZERO            0x01  /* Don't write all-zero chunks. Only
+                                         * safe if the destination is known
+                                         * to be zeroed. */
+#define COPY_VERBOSE              0x02  /* Print progress while copying. */
+
+typedef struct copy_stats {
+  u32 sectors;          /* Sectors read from the source. */
+  u32 written;          /* Sectors written to the destination. */
+  u32 skipped;          /* All-zero sectors not written. */
+  u32 ticks;            /* Timer ticks the copy took. */
+  u32 rate;             /* Throughput, in sectors per second. */
+} copy_stats_t;
+
+/* Copies count sectors from src, starting at src_lba, to dst, starting at
+ * dst_lba. Returns 0 on success and -1 on failure; stats, if not NULL, is
+ * filled in either case. */
+int copy_run(ata_dev_t *src, u32 src_lba, ata_dev_t *dst, u32 dst_lba,
+             u32 count, u32 flags, copy_stats_t *stats);
+
+#endif /* __COPY_H__ */
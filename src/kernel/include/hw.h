@@ -4,6 +4,8 @@
 #ifndef __HW_H__
 #define __HW_H__
 
+#include <typedef.h>
+
 /* halt. */
 void hw_hlt();
 
@@ -13,4 +15,36 @@ void hw_sti();
 /* cli. */
 void hw_cli();
 
+/* sti; hlt. Atomically enables interrupts and waits for the next one. */
+void hw_sti_hlt();
+
+/* pushfd; pop eax; cli. Returns EFLAGS from before interrupts were
+ * disabled. */
+#define HW_EFLAGS_IF              0x00000200
+u32 hw_cli_save();
+
+/* push flags; popfd. Restores what hw_cli_save returned, IF included. */
+void hw_restore_flags(u32 flags);
+
+/* rdtsc. Returns the CPU's time stamp counter. */
+u64 hw_rdtsc();
+
+/* cpuid with EAX = 1. Returns the feature flags in EDX. */
+#define HW_CPUID_PSE              0x00000008
+u32 hw_cpuid_features();
+
+/* Control registers. */
+#define HW_CR0_PG                 0x80000000
+#define HW_CR4_PSE                0x00000010
+u32 hw_read_cr0();
+void hw_write_cr0(u32 value);
+u32 hw_read_cr2();
+u32 hw_read_cr3();
+void hw_write_cr3(u32 value);
+u32 hw_read_cr4();
+void hw_write_cr4(u32 value);
+
+/* invlpg. Drops the TLB entry of the page holding addr. */
+void hw_invlpg(u32 addr);
+
 #endif
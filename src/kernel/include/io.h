@@ -12,25 +12,133 @@
 typedef u16 io_port_t;
 
 /*
- * x86 OUT wrappers.
- * Actual definitions at src/kernel/io.asm.
+ * x86 OUT and IN wrappers. They are inlined so a status poll or an EOI is
+ * just the instruction, with port and value kept in registers. always_inline
+ * makes sure of it even though the kernel is built without optimizations.
  */
+#define IO_INLINE                 static inline __attribute__((always_inline))
+
 /* byte (8) */
-void outb(io_port_t port, u8 value);
+IO_INLINE void outb(io_port_t port, u8 value) {
+  asm volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
+}
 /* word (16) */
-void outw(io_port_t port, u16 value);
+IO_INLINE void outw(io_port_t port, u16 value) {
+  asm volatile ("outw %0, %1" : : "a"(value), "Nd"(port));
+}
 /* double word (32) */
-void outd(io_port_t port, u32 value);
+IO_INLINE void outd(io_port_t port, u32 value) {
+  asm volatile ("outl %0, %1" : : "a"(value), "Nd"(port));
+}
 
-/*
- * x86 IN wrappers.
- * Actual definitions as src/kernel/io.asm.
- */
 /* byte (8) */
-u8 inb(io_port_t port);
+IO_INLINE u8 inb(io_port_t port) {
+  u8 value;
+  asm volatile ("inb %1, %0" : "=a"(value) : "Nd"(port));
+  return value;
+}
 /* word (16) */
-u16 inw(io_port_t port);
+IO_INLINE u16 inw(io_port_t port) {
+  u16 value;
+  asm volatile ("inw %1, %0" : "=a"(value) : "Nd"(port));
+  return value;
+}
 /* double word (32) */
-u32 ind(io_port_t port);
+IO_INLINE u32 ind(io_port_t port) {
+  u32 value;
+  asm volatile ("inl %1, %0" : "=a"(value) : "Nd"(port));
+  return value;
+}
+
+/*
+ * Out of line versions, for whoever needs a function pointer.
+ * Actual definitions at src/kernel/io.asm.
+ */
+void io_outb(io_port_t port, u8 value);
+void io_outw(io_port_t port, u16 value);
+void io_outd(io_port_t port, u32 value);
+u8 io_inb(io_port_t port);
+u16 io_inw(io_port_t port);
+u32 io_ind(io_port_t port);
+
+/*
+ * Port I/O accounting.
+ * Actual definitions at src/kernel/io_acct.c.
+ *
+ * When the kernel is built with IO_ACCOUNTING defined (make IO_ACCOUNTING=1)
+ * every port access made through the wrappers above is counted by port range
+ * and attributed to the operation in progress. Drivers bracket their
+ * operations with IO_ACCT_BEGIN/IO_ACCT_END; both compile to nothing in
+ * regular builds.
+ */
+
+/* Port ranges. */
+enum io_acct_range {
+  IO_RANGE_ATA_DATA,        /* ATA data register. */
+  IO_RANGE_ATA_TASKFILE,    /* ATA status, command and LBA registers. */
+  IO_RANGE_ATA_CONTROL,     /* ATA control and alternate status. */
+  IO_RANGE_PIC,
+  IO_RANGE_PIT,
+  IO_RANGE_SERIAL,
+  IO_RANGE_VGA_CRT,
+  IO_RANGE_OTHER,
+  IO_RANGE_MAX
+};
+
+/* Operations. */
+enum io_acct_op {
+  IO_OP_NONE,               /* Anything not bracketed. */
+  IO_OP_ATA_READ,
+  IO_OP_ATA_WRITE,
+  IO_OP_ATA_IDENTIFY,
+  IO_OP_ATA_VERIFY,
+  IO_OP_ATA_FLUSH,
+  IO_OP_ATA_IRQ,
+  IO_OP_FB_CURSOR,
+  IO_OP_SERIAL_WRITE,
+  IO_OP_SERIAL_IRQ,
+  IO_OP_KB_IRQ,
+  IO_OP_TIMER_IRQ,
+  IO_OP_MAX
+};
+
+/* Starts accounting accesses to op and returns the operation that was in
+ * progress so it can be restored by io_acct_end. */
+u8 io_acct_begin(u8 op);
+void io_acct_end(u8 prev);
+
+/* Clears all counters. */
+void io_acct_reset();
+
+/* Writes a per-operation report to the serial port at base port. It takes a
+ * plain port number to keep this header free of other drivers' types. */
+void io_acct_report(io_port_t serial);
+
+/* Counting wrappers. */
+void io_acct_outb(io_port_t port, u8 value);
+void io_acct_outw(io_port_t port, u16 value);
+void io_acct_outd(io_port_t port, u32 value);
+u8 io_acct_inb(io_port_t port);
+u16 io_acct_inw(io_port_t port);
+u32 io_acct_ind(io_port_t port);
+
+#ifdef IO_ACCOUNTING
+
+#define outb(p, v)                io_acct_outb(p, v)
+#define outw(p, v)                io_acct_outw(p, v)
+#define outd(p, v)                io_acct_outd(p, v)
+#define inb(p)                    io_acct_inb(p)
+#define inw(p)                    io_acct_inw(p)
+#define ind(p)                    io_acct_ind(p)
+
+#define IO_ACCT_BEGIN(op)         u8 __io_acct_prev = io_acct_begin(op)
+#define IO_ACCT_END()             io_acct_end(__io_acct_prev)
+
+#else
+
+#define IO_ACCT_BEGIN(op)         do {} while (0)
+#define IO_ACCT_END()             do {} while (0)
+
+#endif /* IO_ACCOUNTING */
 
 #endif /* __IO_H__ */
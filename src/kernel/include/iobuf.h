@@ -0,0 +1,49 @@
+/* I/O buffer pool. Buffers for sector and DMA transfers, allocated once at
+ * boot in three size classes and handed out and taken back in O(1). Every
+ * buffer is aligned to its own size, which makes it sector and cache line
+ * aligned, physically contiguous (there's no paging) and keeps it from
+ * crossing a 64K boundary, as ISA and PRD style DMA require. Buffers are
+ * never released to the frame allocator, so they stay where they are. */
+
+#ifndef __IOBUF_H__
+#define __IOBUF_H__
+
+#include <typedef.h>
+
+#define IOBUF_SMALL               0     /* 512 bytes, a sector. */
+#define IOBUF_PAGE                1     /* 4K, a frame or a cache block. */
+#define IOBUF_LARGE               2     /* 64K, a whole DMA chunk. */
+#define IOBUF_CLASSES             3
+
+#define IOBUF_SMALL_COUNT         32
+#define IOBUF_PAGE_COUNT          16
+#define IOBUF_LARGE_COUNT         4
+
+typedef struct iobuf_stats {
+  u32 size;             /* Bytes per buffer. */
+  u32 count;            /* Buffers in the class. */
+  u32 used;             /* Handed out right now. */
+  u32 peak;             /* High-water mark of used. */
+  u32 gets;             /* Successful iobuf_get calls. */
+  u32 failures;         /* iobuf_get calls that found the class empty. */
+} iobuf_stats_t;
+
+/* Allocates the buffers of every class. Returns 0 on success and -1 if
+ * there's not enough memory. */
+int iobuf_init();
+
+/* Returns a buffer of the smallest class that holds bytes, or NULL if
+ * bytes is larger than 64K or that class has none left. */
+void *iobuf_get(u32 bytes);
+
+/* Gives back a buffer returned by iobuf_get. Anything else, including a
+ * buffer that was already given back, is ignored. */
+void iobuf_put(void *buf);
+
+/* Fills stats with the counters of class cls. */
+void iobuf_stats(u8 cls, iobuf_stats_t *stats);
+
+/* Prints the counters of every class to the framebuffer. */
+void iobuf_report();
+
+#endif /* __IOBUF_H__ */
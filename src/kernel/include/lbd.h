@@ -0,0 +1,84 @@
+/* Log-structured block device. It is a virtual ata_dev_t layered on a range
+ * of sectors of another device, like the compressed device in cbd.h, that
+ * turns random writes into sequential ones: every block written is appended
+ * to the open segment of a log, and whole segments go to the disk in a
+ * single command. A logical to physical map, kept in memory, says where the
+ * latest copy of every block lives. Segments full of stale copies are
+ * reclaimed by a cleaner that moves their live blocks to the head of the
+ * log, in the background from the idle loop, or in the foreground when the
+ * log runs out of free segments.
+ *
+ * Layout of the backing partition:
+ *
+ *   checkpoint 0             header sector and map
+ *   checkpoint 1             header sector and map
+ *   rest                     segments of LBD_SEGMENT_BLOCKS blocks
+ *
+ * Checkpoints alternate between both slots, so a torn one leaves the other
+ * intact. Blocks written after the last checkpoint are lost on a crash;
+ * lbd_sync takes one and the idle loop takes one once the device is
+ * quiet. */
+
+#ifndef __LBD_H__
+#define __LBD_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define LBD_MAGIC                 0x3144424c  /* "LBD1" */
+#define LBD_VERSION               1
+#define LBD_MAX_DEVICES           4
+#define LBD_BLOCK_SECTORS         8     /* 4K blocks. */
+#define LBD_BLOCK_BYTES           (LBD_BLOCK_SECTORS * 512)
+#define LBD_SEGMENT_BLOCKS        16    /* 64K segments. */
+#define LBD_SEGMENT_SECTORS       (LBD_SEGMENT_BLOCKS * LBD_BLOCK_SECTORS)
+#define LBD_RESERVE_SEGMENTS      2     /* Kept free for the cleaner. */
+
+typedef struct lbd_stats {
+  u32 writes;           /* Write requests. */
+  u32 reads;            /* Read requests. */
+  u32 appended;         /* Blocks appended for callers. */
+  u32 cleaned;          /* Live blocks moved by the cleaner. */
+  u32 segments;         /* Segment writes issued. */
+  u32 checkpoints;      /* Checkpoints taken. */
+  u32 free;             /* Free segments right now. */
+  u32 total;            /* Segments in the log. */
+  u32 amplification;    /* (appended + cleaned) / appended, times 100. */
+} lbd_stats_t;
+
+/* Resets the list of devices cleaned from the idle loop. */
+void lbd_init();
+
+/* Makes dev a log-structured device of logical sectors on the sectors of
+ * backing starting at start. The newest valid checkpoint is loaded if
+ * there's one with the same geometry, otherwise the device is formatted.
+ * A checkpoint that can't be read is a failure, not a reason to format.
+ * logical must leave room for LBD_RESERVE_SEGMENTS + 1 segments beyond
+ * the data. Returns 0 on success and -1 on failure. */
+int lbd_create(ata_dev_t *dev, ata_dev_t *backing, u32 start, u32 sectors,
+               u32 logical);
+
+/* Writes the open segment out and takes a checkpoint. */
+int lbd_sync(ata_dev_t *dev);
+
+/* Syncs dev and releases its memory. dev is no longer usable. */
+int lbd_close(ata_dev_t *dev);
+
+/* Runs one step of background work, a checkpoint or the cleaning of one
+ * segment, on one registered device if the QOS_BACKGROUND class is
+ * admitted. Returns 1 if it did some work and 0 otherwise. */
+int lbd_step();
+
+/* Fills stats with the counters of dev. */
+void lbd_stats(ata_dev_t *dev, lbd_stats_t *stats);
+
+/* Prints the counters of dev to the framebuffer. */
+void lbd_report(ata_dev_t *dev);
+
+/* Writes count random blocks of LBD_BLOCK_SECTORS within the first sectors
+ * of dev, syncing it at the end if it's a log-structured device, and
+ * returns the blocks written per second or 0 on failure. Run it on a
+ * log-structured device and on a plain partition to compare them. */
+u32 lbd_bench(ata_dev_t *dev, u32 sectors, u32 count);
+
+#endif /* __LBD_H__ */
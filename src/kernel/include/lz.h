@@ -0,0 +1,25 @@
+/* A small, fast LZ77 codec. It trades ratio for speed: one greedy pass with
+ * a single-entry hash table, which is plenty to shrink the zero runs,
+ * tables and text that make up most disk blocks.
+ *
+ * Stream format, a sequence of tokens:
+ *
+ *   0lllllll <l + 1 literal bytes>         literal run, 1 to 128 bytes
+ *   1mmmmmmm <offset lo> <offset hi>       copy m + 3 bytes (3 to 130) from
+ *                                          offset bytes back (1 to 65535)
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <typedef.h>
+
+/* Compresses len bytes from src into dst, which holds at most max bytes.
+ * Returns the compressed size or 0 if it doesn't fit in max. */
+u32 lz_compress(u8 *src, u32 len, u8 *dst, u32 max);
+
+/* Decompresses len bytes from src into dst, which holds at most max bytes.
+ * Returns the decompressed size or 0 if the stream is corrupt. */
+u32 lz_decompress(u8 *src, u32 len, u8 *dst, u32 max);
+
+#endif /* __LZ_H__ */
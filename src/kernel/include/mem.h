@@ -28,6 +28,13 @@
  * This means we need at least 3M of RAM to run and, for the time being, we
  * won't be able to run on systems with reserved regions in the [1M,3M] range.
  *
+ * Paging, set up by paging.h, keeps this picture: the whole address space is
+ * identity mapped, so virtual and physical addresses are the same unless
+ * someone maps a page elsewhere.
+ *
+ * The heap window is small, so the kernel is allowed to take part of the RAM
+ * above 3M too, for the heap and for its caches. How much is configurable.
+ *
  * This file includes all memory-related facilities. Part of it is implemented
  * in mem.c, while the other, smaller part requires some assembly and is thus
  * coded in mem.asm.
@@ -38,6 +45,7 @@
 #define __MEMORY_H__
 
 #include <typedef.h>
+#include <serial.h>
 
 /* All GDT related functionality are part of the memory subsystem.
  * We know the earliest stage of the kernel set the GDT with three entries
@@ -68,6 +76,18 @@
 #define MEM_USER_SPACE_ADDR       ((MEM_KERNEL_HEAP_ADDR) + (MEM_KERNEL_HEAP_SIZE))
 #define MEM_USER_FIRST_FRAME      ((MEM_USER_SPACE_ADDR) / (MEM_FRAME_SIZE))
 
+/* The kernel may also take this much of the free RAM above the user space
+ * base for itself, see mem_allocate_kernel_frames. */
+#define MEM_KERNEL_POOL_PERCENT   75
+
+/* Window of the address space for memory mapped disk regions (mmap.h). The
+ * RAM under it, if any, is never handed out since it can't be reached once
+ * a region is mapped over it. */
+#define MEM_MMAP_ADDR             0xc0000000  /* 3G */
+#define MEM_MMAP_SIZE             0x10000000  /* 256M */
+#define MEM_MMAP_FIRST_FRAME      ((MEM_MMAP_ADDR) / (MEM_FRAME_SIZE))
+#define MEM_MMAP_FRAMES           ((MEM_MMAP_SIZE) / (MEM_FRAME_SIZE))
+
 #include <typedef.h>
 
 /* Initializes memory management system. It receives two addresses: the current
@@ -93,13 +113,94 @@ void * mem_allocate_frames(u32 count, u32 first_frame, u32 last_frame);
  * released. */
 void mem_release_frames(void *addr, u32 count);
 
-/* This is the internal logical allocator. It only reserves space inside the
- * kernel heap. */
+/* Requests count contiguous frames for the kernel's own use. They come from
+ * the RAM above the user space base while the kernel holds less than its
+ * limit there, and from the kernel heap otherwise. The kernel heap and
+ * caches that may grow big should use these instead of taking frames from
+ * the kernel heap directly. When both are out it asks the reclaim handler,
+ * if any, for frames and tries once more. Returns NULL if there's no room. */
+void * mem_allocate_kernel_frames(u32 count);
+
+/* Gives back up to count frames held by a cache that can refill them later.
+ * Returns the number of frames freed. */
+typedef u32 (*mem_reclaim_handler_t)(u32 count);
+
+/* Sets the handler mem_allocate_kernel_frames calls when it runs out. NULL
+ * removes it, and mem_init starts without one. */
+void mem_set_reclaim_handler(mem_reclaim_handler_t handler);
+
+/* Releases count frames obtained from mem_allocate_kernel_frames. */
+void mem_release_kernel_frames(void *addr, u32 count);
+
+/* Sets how many frames above the user space base the kernel may hold. Frames
+ * already taken are kept even if they exceed it. The default is
+ * MEM_KERNEL_POOL_PERCENT percent of the frames free there after boot. */
+void mem_set_kernel_limit(u32 frames);
+
+/* Sets used and limit to the frames the kernel holds above the user space
+ * base and how many it may hold. */
+void mem_kernel_usage(u32 *used, u32 *limit);
+
+/* This is the internal logical allocator. Its arenas come from
+ * mem_allocate_kernel_frames, so it isn't bound to the kernel heap. */
 void * kalloc(u32 bytes);
 
 /* This is the internal logical allocator's free routine. */
 void kfree(void *ptr);
 
+/* Returns the number of frames of physical memory, as far as the highest
+ * address in the BIOS memory map. */
+u32 mem_frames();
+
+/* Returns the number of frames up to the end of the highest available region
+ * of the BIOS memory map, which is where RAM ends. Reserved regions above it,
+ * like the BIOS ROM, don't count. */
+u32 mem_ram_frames();
+
+typedef struct mem_stats {
+  /* Physical allocator, in frames. */
+  u32 frames;           /* All of them, up to the end of RAM. */
+  u32 free;
+  u32 used;             /* Handed out by mem_allocate_frames. */
+  u32 reserved;         /* By the BIOS, the kernel image, holes, ... */
+  u32 largest_free;     /* Largest free block, the most one call can get. */
+  u32 frame_frag;       /* 100 - largest_free / free, times 100. */
+  u32 frame_allocs;
+  u32 frame_frees;
+  u32 frame_failures;
+  u32 kernel_frames;    /* Held by the kernel above the user space base. */
+  u32 kernel_limit;
+  u32 init_kcycles;     /* Time mem_init took, in thousands of cycles. */
+  /* Logical allocator, in bytes unless told otherwise. */
+  u32 arenas;
+  u32 heap;             /* Size of all the arenas. */
+  u32 used_blocks;
+  u32 used_bytes;       /* Of the used blocks, tags included. */
+  u32 free_blocks;
+  u32 free_bytes;
+  u32 largest_block;    /* Largest free block. */
+  u32 heap_frag;        /* 100 - largest_block / free_bytes, times 100. */
+  u32 requested;        /* Bytes asked for since boot. */
+  u32 consumed;         /* Bytes taken from the heap for them. */
+  u32 allocs;
+  u32 frees;
+  u32 failures;
+  u32 bad_frees;        /* Pointers kfree ignored. */
+} mem_stats_t;
+
+/* Fills stats with the counters of both allocators. */
+void mem_stats(mem_stats_t *stats);
+
+/* Writes the counters of both allocators to port, one line each:
+ *
+ *   frames total=<n> free=<n> used=<n> reserved=<n> largest=<n> frag=<n>%
+ *     allocs=<n> frees=<n> fails=<n> kernel=<n>/<limit> init=<kcycles>k
+ *   heap arenas=<n> bytes=<n> used=<blocks>/<bytes> free=<blocks>/<bytes>
+ *     largest=<n> frag=<n>% requested=<n> consumed=<n> allocs=<n>
+ *     frees=<n> fails=<n> bad_frees=<n>
+ */
+void mem_report(serial_device_t port);
+
 /* Prints a map to the framebuffer device of how the physical pages are
  * allocated. */
 void mem_inspect();
@@ -0,0 +1,70 @@
+/* Memory mapped disk regions. mmap_map reserves a range of virtual memory
+ * backed by a run of sectors of a device and leaves it unmapped; the first
+ * access to each page faults and the fault handler reads it in with
+ * ata_read, together with the neighbouring pages of the same
+ * MMAP_FAULT_AROUND-page block that aren't there yet, so sequential scans
+ * pay one read per block and random lookups one read per page.
+ *
+ * Pages can be written. Dirty pages are written back by mmap_sync and
+ * mmap_unmap, or when they are evicted. At most MMAP_MAX_PAGES pages are
+ * resident at a time; when that limit or the frame allocator runs out the
+ * least recently used clean pages are evicted first, using the accessed
+ * bits the CPU keeps in the page tables.
+ *
+ * The regions live in a window of the address space at MMAP_BASE, which
+ * mem_init keeps out of the frame allocator. Faults are served on the
+ * faulting stack and ata_read enables interrupts, so mapped memory must not
+ * be touched from interrupt handlers. */
+
+#ifndef __MMAP_H__
+#define __MMAP_H__
+
+#include <typedef.h>
+#include <ata.h>
+#include <mem.h>
+
+#define MMAP_BASE                 MEM_MMAP_ADDR
+#define MMAP_SIZE                 MEM_MMAP_SIZE
+#define MMAP_MAX_PAGES            1024        /* 4M resident at most. */
+#define MMAP_FAULT_AROUND         16          /* Pages per block, 64K. */
+#define MMAP_PAGE_SECTORS         8
+
+typedef struct mmap_stats {
+  u32 regions;          /* Regions mapped right now. */
+  u32 resident;         /* Pages in memory right now. */
+  u32 faults;           /* Faults served. */
+  u32 pages_in;         /* Pages read in, fault-around included. */
+  u32 evictions;        /* Pages dropped to make room. */
+  u32 writebacks;       /* Dirty pages written to the disk. */
+} mmap_stats_t;
+
+/* Forgets every region, reserves the window and installs the page fault and
+ * frame reclaim handlers. Paging must be on. */
+void mmap_init();
+
+/* Maps sectors sectors of dev starting at lba. Returns the address of the
+ * first one, or NULL on failure. The tail of the last page past the region
+ * reads as zeros and isn't written back. */
+void * mmap_map(ata_dev_t *dev, u32 lba, u32 sectors);
+
+/* Writes back the dirty pages of the region at addr and drops the mapping.
+ * Returns 0 on success and -1 on failure, in which case the region stays
+ * mapped. */
+int mmap_unmap(void *addr);
+
+/* Writes back the dirty pages of the region holding addr. Returns 0 on
+ * success and -1 on failure. */
+int mmap_sync(void *addr);
+
+/* Evicts up to count clean pages nobody used lately, giving their frames
+ * back. Returns the number of pages evicted. mmap_init makes it the reclaim
+ * handler of mem_allocate_kernel_frames. */
+u32 mmap_reclaim(u32 count);
+
+/* Fills stats with the counters of the mapped regions. */
+void mmap_stats(mmap_stats_t *stats);
+
+/* Prints the counters of the mapped regions to the framebuffer. */
+void mmap_report();
+
+#endif /* __MMAP_H__ */
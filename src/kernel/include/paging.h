@@ -0,0 +1,76 @@
+/* Paging. The kernel keeps running on the flat model described in mem.h:
+ * paging_init identity maps the whole 4G address space with 4M pages, so
+ * every address means what it meant before and a handful of TLB entries
+ * cover the kernel. On top of that, single 4K pages can be mapped anywhere
+ * and unmapped, to place guard pages, map device memory somewhere else or
+ * back memory on demand. The 4M page around such a page is turned into a
+ * page table of identity mapped 4K pages first.
+ *
+ * Memory past the end of RAM is mapped uncached, since anything there is a
+ * device. Page faults go to the handler set with paging_set_fault_handler,
+ * if any; a fault it doesn't resolve halts the machine with the faulting
+ * address on the screen. Faults on the kernel stack's guard page never get
+ * there: the stack is gone, and they end in a triple fault and a reset.
+ *
+ * RAM ends where the highest available region of the BIOS memory map does,
+ * which mem_ram_frames reports. */
+
+#ifndef __PAGING_H__
+#define __PAGING_H__
+
+#include <typedef.h>
+
+#define PAGING_PAGE_SIZE          0x00001000  /* 4K */
+#define PAGING_LARGE_PAGE_SIZE    0x00400000  /* 4M */
+#define PAGING_ENTRIES            1024
+
+/* Page directory and page table entry flags. */
+#define PAGING_PRESENT            0x001
+#define PAGING_WRITE              0x002
+#define PAGING_USER               0x004
+#define PAGING_WRITE_THROUGH      0x008
+#define PAGING_NO_CACHE           0x010
+#define PAGING_ACCESSED           0x020
+#define PAGING_DIRTY              0x040
+#define PAGING_LARGE              0x080       /* Directory entries only. */
+#define PAGING_FLAGS              0xfff
+
+/* Page fault error code bits. */
+#define PAGING_FAULT_PRESENT      0x01  /* Protection, not a missing page. */
+#define PAGING_FAULT_WRITE        0x02
+#define PAGING_FAULT_USER         0x04
+
+/* Resolves a page fault at addr with the error code err (PAGING_FAULT_*).
+ * Returns 0 if it made addr accessible and the faulting instruction can be
+ * retried, -1 otherwise. Runs in the fault, on the faulting stack. */
+typedef int (*paging_fault_handler_t)(u32 addr, u32 err);
+
+/* Builds the identity mapped directory, turns paging on and installs the
+ * page fault handler. The CPU must support 4M pages. Returns 0 on success
+ * and -1 on failure. */
+int paging_init();
+
+/* Maps the 4K page at virt to the frame at phys with flags (PAGING_WRITE,
+ * ...). Returns 0 on success and -1 if a page table couldn't be
+ * allocated. */
+int paging_map(u32 virt, u32 phys, u32 flags);
+
+/* Unmaps the 4K page at virt, so touching it faults. Returns 0 on success
+ * and -1 if a page table couldn't be allocated. */
+int paging_unmap(u32 virt);
+
+/* Returns the flags of the 4K page at virt, PAGING_DIRTY and PAGING_ACCESSED
+ * included, or 0 if virt isn't mapped by a present 4K page. */
+u32 paging_get_flags(u32 virt);
+
+/* Clears flags (PAGING_ACCESSED, PAGING_DIRTY) in the entry of the 4K page
+ * at virt, if it is mapped. */
+void paging_clear_flags(u32 virt, u32 flags);
+
+/* Sets the handler page faults are passed to. NULL removes it. */
+void paging_set_fault_handler(paging_fault_handler_t handler);
+
+/* Translates virt. Returns 0 and sets phys if it is mapped, -1 if not. */
+int paging_translate(u32 virt, u32 *phys);
+
+#endif /* __PAGING_H__ */
@@ -0,0 +1,38 @@
+/* PCI configuration space access through configuration mechanism #1, the
+ * CONFIG_ADDRESS/CONFIG_DATA port pair. */
+
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <typedef.h>
+
+#define PCI_CONFIG_ADDRESS        0x0cf8
+#define PCI_CONFIG_DATA           0x0cfc
+
+/* Configuration space registers. */
+#define PCI_REG_ID                0x00  /* Device ID << 16 | vendor ID. */
+#define PCI_REG_COMMAND           0x04
+#define PCI_REG_CLASS             0x08  /* Class, subclass, prog IF, rev. */
+#define PCI_REG_HEADER            0x0c
+#define PCI_REG_BAR(n)            (0x10 + (n) * 4)
+#define PCI_REG_INTERRUPT         0x3c  /* Low byte is the IRQ line. */
+
+/* Command register bits. */
+#define PCI_COMMAND_MEMORY        0x0002
+#define PCI_COMMAND_MASTER        0x0004
+#define PCI_COMMAND_INTX_DISABLE  0x0400
+
+/* A function's address, as in bus << 16 | device << 11 | function << 8. */
+typedef u32 pci_addr_t;
+
+#define PCI_ADDR(bus, dev, fn)    (((bus) << 16) | ((dev) << 11) | ((fn) << 8))
+#define PCI_NONE                  0xffffffff
+
+u32 pci_read(pci_addr_t addr, u8 reg);
+void pci_write(pci_addr_t addr, u8 reg, u32 value);
+
+/* Returns the index-th function of the given class, subclass and
+ * programming interface, or PCI_NONE if there's no such function. */
+pci_addr_t pci_find_class(u8 class, u8 subclass, u8 progif, int index);
+
+#endif /* __PCI_H__ */
@@ -0,0 +1,68 @@
+/* I/O quality of service. Every request that reaches ata_read and
+ * ata_write belongs to the priority class set with qos_set_class, which is
+ * QOS_FOREGROUND unless a background job says otherwise, and is accounted
+ * to it.
+ *
+ * Background jobs ask for admission before each chunk of work. A class is
+ * admitted while its token buckets, one for bandwidth and one for IOPS,
+ * aren't in debt and no higher priority class has issued a request in its
+ * holdoff window. Since the driver is synchronous there's no queue to
+ * reorder: holding lower classes back while a higher one is active, and
+ * keeping their chunks small, is what keeps foreground latency flat. */
+
+#ifndef __QOS_H__
+#define __QOS_H__
+
+#include <typedef.h>
+
+/* Classes, from the highest priority to the lowest. */
+#define QOS_FOREGROUND            0
+#define QOS_BACKGROUND            1     /* Copies, log cleaning. */
+#define QOS_IDLE                  2     /* Scrubbing. */
+#define QOS_CLASSES               3
+
+#define QOS_BACKGROUND_RATE       4096  /* Sectors per second (2 MiB/s). */
+#define QOS_IDLE_RATE             2048  /* Sectors per second (1 MiB/s). */
+#define QOS_BACKGROUND_HOLDOFF    10    /* Quiet ticks of the classes above */
+#define QOS_IDLE_HOLDOFF          50    /* required before admission. */
+#define QOS_BUCKETS               32    /* Latency histogram buckets. */
+
+typedef struct qos_stats {
+  u32 requests;         /* Requests completed. */
+  u32 sectors;          /* Sectors they moved. */
+  u32 throttled;        /* Admissions refused. */
+  u32 waited;           /* Ticks spent waiting in qos_wait. */
+  u32 p99;              /* 99th percentile latency, in TSC cycles, rounded
+                         * up to a power of two. */
+  u32 max;              /* Worst latency, in TSC cycles. */
+} qos_stats_t;
+
+/* Resets the counters and sets the default limits. */
+void qos_init();
+
+/* Limits cls to sectors_per_sec and iops. 0 removes a limit. */
+void qos_set_limit(u8 cls, u32 sectors_per_sec, u32 iops);
+
+/* Sets the class of the requests that follow and returns the previous
+ * one. */
+u8 qos_set_class(u8 cls);
+u8 qos_class();
+
+/* Asks whether a request of sectors may be issued in cls now. On success
+ * its cost is taken from the buckets and 1 is returned, otherwise it
+ * returns 0 and the caller should try again later. */
+int qos_admit(u8 cls, u32 sectors);
+
+/* Like qos_admit, but halts until the request is admitted. */
+void qos_wait(u8 cls, u32 sectors);
+
+/* Accounts a completed request of cls that took cycles. */
+void qos_account(u8 cls, u32 sectors, u64 cycles);
+
+/* Fills stats with the counters of cls. */
+void qos_stats(u8 cls, qos_stats_t *stats);
+
+/* Prints the counters of every class to the framebuffer. */
+void qos_report();
+
+#endif /* __QOS_H__ */
@@ -0,0 +1,28 @@
+/* RAM disk. It is a virtual ata_dev_t whose sectors live in physical frames
+ * instead of on a disk, so requests cost a memcpy and nothing else. It can
+ * be used anywhere an ata_dev_t is, to measure the layers above the driver
+ * without the media in the way or as scratch space for temporary data.
+ *
+ * The frames come from above the kernel space, where there's room for
+ * something bigger than the kernel heap, so the contents are lost on
+ * reboot. */
+
+#ifndef __RD_H__
+#define __RD_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define RD_SECTORS_PER_FRAME      8
+#define RD_LOAD_SECTORS           128   /* Sectors read per command by
+                                         * rd_create. */
+
+/* Makes dev a RAM disk of sectors. If src isn't NULL it is preloaded with
+ * the sectors of src starting at start, a partition for example, otherwise
+ * it starts zeroed. Returns 0 on success and -1 on failure. */
+int rd_create(ata_dev_t *dev, u32 sectors, ata_dev_t *src, u32 start);
+
+/* Releases the memory of dev. dev is no longer usable. */
+void rd_destroy(ata_dev_t *dev);
+
+#endif /* __RD_H__ */
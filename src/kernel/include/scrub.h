@@ -0,0 +1,41 @@
+/* Background media scrubber. It walks every present ATA device with READ
+ * VERIFY SECTORS during idle time so latent bad sectors show up before a
+ * foreground read hits them. It steps aside whenever foreground I/O is seen
+ * and never verifies more than its bandwidth cap allows. */
+
+#ifndef __SCRUB_H__
+#define __SCRUB_H__
+
+#include <typedef.h>
+#include <ata.h>
+
+#define SCRUB_MAX_DEVICES         4
+#define SCRUB_MAX_BAD             16    /* Bad LBAs remembered per device. */
+#define SCRUB_CHUNK_SECTORS       256   /* Sectors verified per step. */
+
+/* Registers the devices to scrub. Empty and virtual devices are skipped,
+ * and so are non-ATA ones once they are identified. */
+void scrub_init(ata_dev_t *devs[], int count);
+
+/* Sets the bandwidth cap in sectors per second. 0 removes the cap. It is
+ * the bandwidth limit of the QOS_IDLE class. */
+void scrub_set_rate(u32 sectors_per_sec);
+
+/* Runs one step of the scrubber if it is allowed to. Returns 1 if it did
+ * some work and 0 if there was nothing it could do right now, in which case
+ * the caller may halt until the next interrupt. */
+int scrub_step();
+
+/* Saved position of the scrubber on the idx-th registered device. Setting
+ * it lets a caller resume a pass from where a previous one stopped. */
+u32 scrub_position(int idx);
+void scrub_set_position(int idx, u32 lba);
+
+/* Copies up to max bad LBAs found on the idx-th device into lbas and returns
+ * how many were found in total. */
+u32 scrub_bad_lbas(int idx, u32 *lbas, u32 max);
+
+/* Prints the scrubber's progress and findings to the framebuffer. */
+void scrub_report();
+
+#endif /* __SCRUB_H__ */
@@ -46,4 +46,7 @@ void serial_write(serial_device_t dev, void *buf, u32 len);
 
 u32 serial_read(serial_device_t dev, void *buf, u32 len);
 
+/* Number of received bytes waiting to be read. It never blocks. */
+u32 serial_pending(serial_device_t dev);
+
 #endif
@@ -0,0 +1,70 @@
+/* Slab caches. A cache hands out objects of a single size, carved from
+ * slabs of one frame each, so allocating and freeing are O(1) and never
+ * touch the kalloc heap. Every slab starts with a small header and the free
+ * list links, one u16 per object, followed by as many objects as fit. The
+ * allocator never writes to the objects themselves, and the slab of an
+ * object is found by rounding its address down to the frame.
+ *
+ * Caches are declared by their users, usually as statics, and set up with
+ * slab_cache_init. If a constructor is given it runs once per object when
+ * its slab is created, not on every slab_alloc, so objects must be handed
+ * back to slab_free in their constructed state. */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <typedef.h>
+
+#define SLAB_MAX_SIZE             1024  /* At least three per slab. */
+#define SLAB_ALIGN                8
+#define SLAB_KEEP_EMPTY           1     /* Empty slabs kept per cache, the
+                                         * others go back to the frame
+                                         * allocator. */
+
+struct slab;
+
+typedef struct slab_stats {
+  u32 size;             /* Object size, after alignment. */
+  u32 per_slab;         /* Objects per slab. */
+  u32 slabs;            /* Slabs (frames) right now. */
+  u32 used;             /* Objects allocated right now. */
+  u32 peak;             /* Most objects allocated at once. */
+  u32 allocs;           /* slab_alloc calls that succeeded. */
+  u32 frees;            /* slab_free calls. */
+  u32 failures;         /* slab_alloc calls that found no memory. */
+} slab_stats_t;
+
+typedef struct slab_cache {
+  char *name;
+  void (*ctor)(void *);
+  struct slab *partial;         /* Slabs with free and used objects. */
+  struct slab *full;
+  struct slab *empty;
+  u32 nempty;
+  u32 offset;                   /* Of the first object in a slab. */
+  slab_stats_t stats;
+  struct slab_cache *next;      /* All caches, for slab_report. */
+} slab_cache_t;
+
+/* Forgets every cache. Called once by mem_init. */
+void slab_init();
+
+/* Sets up cache for objects of size bytes, 1 to SLAB_MAX_SIZE. ctor may be
+ * NULL. Returns 0 on success and -1 if size is out of range. */
+int slab_cache_init(slab_cache_t *cache, char *name, u32 size,
+                    void (*ctor)(void *));
+
+/* Returns an object of cache, or NULL if there's no memory left. */
+void *slab_alloc(slab_cache_t *cache);
+
+/* Gives obj back to cache. Pointers that aren't an allocated object of
+ * cache are ignored. */
+void slab_free(slab_cache_t *cache, void *obj);
+
+/* Fills stats with the counters of cache. */
+void slab_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+/* Prints the counters of every cache to the framebuffer. */
+void slab_report();
+
+#endif /* __SLAB_H__ */
@@ -21,4 +21,8 @@ int memcmp(void *p1, void *p2, u32 count);
 
 int sprintf(char *dst, char *format, ...);
 
+/* 64 by 32 bits unsigned division. We don't link against libgcc, so plain
+ * 64 bits divisions are not available. */
+u64 div64(u64 n, u32 d);
+
 #endif
@@ -0,0 +1,22 @@
+/* Driver for the Programmable Interval Timer (Intel 8253/8254). We only use
+ * channel 0, wired to IRQ 0, as the kernel's periodic tick. */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <typedef.h>
+
+/* Default tick frequency. */
+#define TIMER_HZ                  100
+
+/* Programs channel 0 to fire hz times per second and registers the tick
+ * handler. The caller must unmask PIC_TIMER_IRQ afterwards. */
+int timer_init(u32 hz);
+
+/* Ticks elapsed since timer_init(). */
+u32 timer_ticks();
+
+/* Tick frequency set by timer_init(). */
+u32 timer_hz();
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,95 @@
+/* I/O trace capture. While a trace is active, every ata_read and ata_write
+ * is recorded so the same workload can later be replayed against a disk
+ * image on the host with `btool replay` (see tools/src/replay.c).
+ *
+ * Trace format, version 1. There are two equivalent encodings.
+ *
+ * Binary (what trace_save() writes to disk, little endian):
+ *
+ *   header, 16 bytes:
+ *     u32 magic        TRACE_MAGIC ("ATRC")
+ *     u16 version      TRACE_VERSION
+ *     u16 record_size  sizeof(trace_record_t), i.e. 16
+ *     u32 count        number of records that follow
+ *     u32 dropped      requests lost because the buffer was full
+ *   count records, 16 bytes each:
+ *     u32 time         submission time, microseconds since trace_start()
+ *     u8  op           TRACE_OP_*, ORed with TRACE_OP_FAILED on error
+ *     u8  dev          device slot: channel * 2 + drive
+ *     u16 count        sectors
+ *     u32 lba          first sector
+ *     u32 latency      service time measured by the kernel, microseconds
+ *
+ *   The whole thing is padded with zeroes to a sector boundary.
+ *
+ * Text (what trace_dump() writes to a serial port): one header line
+ *
+ *   # ata-trace 1 <count> <dropped>
+ *
+ * followed by one line per record with the same fields, in the same order,
+ * in decimal, where op is spelled R or W and failed requests get a trailing
+ * !, e.g.
+ *
+ *   1520 R 0 2048 8 312
+ *
+ * Requests longer than 65535 sectors are recorded as several records with
+ * the same timestamp.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <typedef.h>
+#include <ata.h>
+#include <serial.h>
+
+#define TRACE_MAGIC               0x43525441  /* "ATRC" */
+#define TRACE_VERSION             1
+
+#define TRACE_OP_READ             0x00
+#define TRACE_OP_WRITE            0x01
+#define TRACE_OP_FAILED           0x80
+
+typedef struct trace_header {
+  u32 magic;
+  u16 version;
+  u16 record_size;
+  u32 count;
+  u32 dropped;
+} __attribute__((__packed__)) trace_header_t;
+
+typedef struct trace_record {
+  u32 time;
+  u8  op;
+  u8  dev;
+  u16 count;
+  u32 lba;
+  u32 latency;
+} __attribute__((__packed__)) trace_record_t;
+
+/* Resets the trace facility. Nothing is recorded until trace_start(). */
+void trace_init();
+
+/* Starts recording into a freshly allocated buffer of max_records entries.
+ * Any previous trace is discarded. It calibrates the TSC against the timer,
+ * which takes a few ticks, so interrupts must be enabled. */
+int trace_start(u32 max_records);
+
+/* Stops recording. The trace is kept until the next trace_start(). */
+void trace_stop();
+
+/* Called by the ATA driver once a request is over. t0 is the TSC at
+ * submission and ret the request's result. */
+void trace_record(u8 op, ata_dev_t *dev, u32 lba, u32 count, u64 t0, int ret);
+
+/* Number of records captured so far. */
+u32 trace_count();
+
+/* Writes the trace in text form to a serial port. */
+void trace_dump(serial_device_t port);
+
+/* Writes the trace in binary form to dev starting at lba. Returns the
+ * number of sectors written or -1 on failure. */
+int trace_save(ata_dev_t *dev, u32 lba);
+
+#endif /* __TRACE_H__ */
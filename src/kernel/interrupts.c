@@ -2,6 +2,7 @@
 #include <typedef.h>
 #include <string.h>
 #include <mem.h>
+#include <arena.h>
 #include <pic.h>
 #include <fb.h>
 
@@ -69,11 +70,14 @@ int itr_set_up() {
   itr_lidt_t l;
 
   interrupt_handlers =
-    (interrupt_handler_t *)kalloc(sizeof(interrupt_handler_t) * IDT_ENTRIES);
+    (interrupt_handler_t *)arena_alloc(&arena_boot,
+                                       sizeof(interrupt_handler_t) *
+                                       IDT_ENTRIES);
   if (interrupt_handlers == NULL)
     return -1;
 
-  idt = (itr_idt_entry_t *)kalloc(sizeof(itr_idt_entry_t) * IDT_ENTRIES);
+  idt = (itr_idt_entry_t *)arena_alloc(&arena_boot,
+                                       sizeof(itr_idt_entry_t) * IDT_ENTRIES);
   if (idt == NULL)
     return -1;
 
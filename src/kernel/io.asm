@@ -1,7 +1,8 @@
-; This are the actual implementations of the port-based I/O routines
-; defined in src/includes/io.h. They all follow the C-style argument
-; passing to make them compatible with the wrapping declarations made
-; there, i.e. the arguments are placed in the stack in reverse order.
+; This are the out of line versions of the port-based I/O routines
+; declared in src/includes/io.h, for callers that need a function pointer;
+; drivers use the inline ones defined there. They all follow the C-style
+; argument passing to make them compatible with the declarations, i.e.
+; the arguments are placed in the stack in reverse order.
 ; For the outX family, this means:
 ;   [esp + 8] holds the value.
 ;   [esp + 4] holds the port.
@@ -12,42 +13,42 @@
 ;   al, ax, eax will hold the retrieved value according to the case.
 
 [bits 32]
-global outb
-global outw
-global outd
-global inb
-global inw
-global ind
+global io_outb
+global io_outw
+global io_outd
+global io_inb
+global io_inw
+global io_ind
 
-outb:
+io_outb:
   mov al, [esp + 8]
   mov dx, [esp + 4]
   out dx, al
   ret
 
-outw:
+io_outw:
   mov ax, [esp + 8]
   mov dx, [esp + 4]
   out dx, ax
   ret
 
-outd:
+io_outd:
   mov eax, [esp + 8]
   mov dx, [esp + 4]
   out dx, eax
   ret
 
-inb:
+io_inb:
   mov dx, [esp + 4]
   in al, dx
   ret
 
-inw:
+io_inw:
   mov dx, [esp + 4]
   in ax, dx
   ret
 
-ind:
+io_ind:
   mov dx, [esp + 4]
   in eax, dx
   ret
@@ -0,0 +1,136 @@
+/* Port I/O accounting. See io.h.
+ *
+ * This file is built the same way in every configuration; it's io.h that
+ * decides whether drivers go through the counting wrappers or not. Here we
+ * always need the real routines, so the redirections are undone.
+ */
+
+#include <io.h>
+#include <serial.h>
+#include <string.h>
+#include <typedef.h>
+
+#undef outb
+#undef outw
+#undef outd
+#undef inb
+#undef inw
+#undef ind
+
+static u32 io_acct_counts[IO_OP_MAX][IO_RANGE_MAX];
+static u32 io_acct_ops[IO_OP_MAX];
+static u8 io_acct_op;
+
+static char *io_acct_op_names[IO_OP_MAX] = {
+  "none", "ata_read", "ata_write", "ata_identify", "ata_verify", "ata_flush",
+  "ata_irq", "fb_cursor", "serial_write", "serial_irq", "kb_irq", "timer_irq"
+};
+
+static char *io_acct_range_names[IO_RANGE_MAX] = {
+  "ata_data", "ata_tf", "ata_ctl", "pic", "pit", "serial", "vga_crt", "other"
+};
+
+static u8 io_acct_classify(io_port_t port) {
+  if (port == 0x1f0 || port == 0x170 || port == 0x1e8 || port == 0x168)
+    return IO_RANGE_ATA_DATA;
+  if ((port > 0x1f0 && port <= 0x1f7) || (port > 0x170 && port <= 0x177) ||
+      (port > 0x1e8 && port <= 0x1ef) || (port > 0x168 && port <= 0x16f))
+    return IO_RANGE_ATA_TASKFILE;
+  if (port == 0x3f6 || port == 0x376 || port == 0x3e6 || port == 0x366)
+    return IO_RANGE_ATA_CONTROL;
+  if (port == 0x20 || port == 0x21 || port == 0xa0 || port == 0xa1)
+    return IO_RANGE_PIC;
+  if (port >= 0x40 && port <= 0x43)
+    return IO_RANGE_PIT;
+  if ((port >= 0x3f8 && port <= 0x3ff) || (port >= 0x2f8 && port <= 0x2ff) ||
+      (port >= 0x3e8 && port <= 0x3ef) || (port >= 0x2e8 && port <= 0x2ef))
+    return IO_RANGE_SERIAL;
+  if (port == 0x3d4 || port == 0x3d5)
+    return IO_RANGE_VGA_CRT;
+  return IO_RANGE_OTHER;
+}
+
+#define IO_ACCT_COUNT(port) \
+  (io_acct_counts[io_acct_op][io_acct_classify(port)]++)
+
+u8 io_acct_begin(u8 op) {
+  u8 prev = io_acct_op;
+  io_acct_op = op < IO_OP_MAX ? op : IO_OP_NONE;
+  io_acct_ops[io_acct_op]++;
+  return prev;
+}
+
+void io_acct_end(u8 prev) {
+  io_acct_op = prev;
+}
+
+void io_acct_reset() {
+  memset(io_acct_counts, 0, sizeof(io_acct_counts));
+  memset(io_acct_ops, 0, sizeof(io_acct_ops));
+  io_acct_op = IO_OP_NONE;
+}
+
+void io_acct_outb(io_port_t port, u8 value) {
+  IO_ACCT_COUNT(port);
+  outb(port, value);
+}
+
+void io_acct_outw(io_port_t port, u16 value) {
+  IO_ACCT_COUNT(port);
+  outw(port, value);
+}
+
+void io_acct_outd(io_port_t port, u32 value) {
+  IO_ACCT_COUNT(port);
+  outd(port, value);
+}
+
+u8 io_acct_inb(io_port_t port) {
+  IO_ACCT_COUNT(port);
+  return inb(port);
+}
+
+u16 io_acct_inw(io_port_t port) {
+  IO_ACCT_COUNT(port);
+  return inw(port);
+}
+
+u32 io_acct_ind(io_port_t port) {
+  IO_ACCT_COUNT(port);
+  return ind(port);
+}
+
+/* The report is one line per operation that did any port I/O:
+ *
+ *   <op> ops=<n> <range>=<accesses> ... per_op=<accesses per operation>
+ *
+ * Counters are copied first since writing to the serial port is port I/O
+ * itself. */
+void io_acct_report(io_port_t serial) {
+  static u32 counts[IO_OP_MAX][IO_RANGE_MAX];
+  static u32 ops[IO_OP_MAX];
+  char line[64];
+  int len, op, r;
+  u32 total;
+
+  memcpy(counts, io_acct_counts, sizeof(counts));
+  memcpy(ops, io_acct_ops, sizeof(ops));
+
+  for (op = 0; op < IO_OP_MAX; op++) {
+    for (total = 0, r = 0; r < IO_RANGE_MAX; r++)
+      total += counts[op][r];
+    if (total == 0)
+      continue;
+
+    len = sprintf(line, "%s ops=%dd", io_acct_op_names[op], ops[op]);
+    serial_write(serial, line, len);
+    for (r = 0; r < IO_RANGE_MAX; r++) {
+      if (counts[op][r] == 0)
+        continue;
+      len = sprintf(line, " %s=%dd", io_acct_range_names[r], counts[op][r]);
+      serial_write(serial, line, len);
+    }
+    len = sprintf(line, " per_op=%dd\n", ops[op] ? total / ops[op] : total);
+    serial_write(serial, line, len);
+  }
+}
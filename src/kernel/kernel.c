@@ -2,14 +2,100 @@
 #include <hw.h>
 #include <string.h>
 #include <mem.h>
+#include <paging.h>
+#include <mmap.h>
+#include <iobuf.h>
 #include <pic.h>
 #include <serial.h>
 #include <kb.h>
 #include <ata.h>
+#include <ahci.h>
+#include <timer.h>
+#include <scrub.h>
+#include <lbd.h>
+#include <bcache.h>
+#include <qos.h>
+#include <trace.h>
+#include <io.h>
 
 /* Just the declaration of the second, main kernel routine. */
 void kmain2();
 
+/* MBR partition table. */
+#define KERNEL_MBR_ENTRIES        446
+#define KERNEL_MBR_ENTRY_SIZE     16
+#define KERNEL_MBR_SIGNATURE      0xaa55
+
+/* The cache hints are only kept if the boot disk has a partition of this
+ * type set aside for them, and they live at its start. 0x7f is reserved
+ * for experimental use, so no other system claims it. */
+#define KERNEL_HINT_PART_TYPE     0x7f
+
+/* Looks for the hint partition in the MBR of dev. Returns 0 and sets lba
+ * to its first sector if there is one, -1 otherwise. */
+static int kernel_find_hints(ata_dev_t *dev, u32 *lba) {
+  u8 *buf, *entry;
+  int i, ret = -1;
+
+  if ((buf = (u8 *)iobuf_get(512)) == NULL)
+    return -1;
+  if (ata_read(dev, 0, 1, buf) == 0 &&
+      *(u16 *)(buf + 510) == KERNEL_MBR_SIGNATURE) {
+    for (i = 0; i < 4 && ret == -1; i++) {
+      entry = buf + KERNEL_MBR_ENTRIES + i * KERNEL_MBR_ENTRY_SIZE;
+      if (entry[4] == KERNEL_HINT_PART_TYPE &&
+          *(u32 *)(entry + 12) >= BCACHE_HINT_SECTORS) {
+        *lba = *(u32 *)(entry + 8);
+        ret = 0;
+      }
+    }
+  }
+  iobuf_put(buf);
+  return ret;
+}
+
+/* Reads what mounting the partitions of dev would: the partition table and
+ * the first block of every partition, boot sector and superblock. Goes
+ * through the block cache, so it's what the hints learn to prefetch. */
+static void kernel_scan_partitions(ata_dev_t *dev) {
+  u8 *buf, *entry;
+  u32 lba, count;
+  int i;
+
+  if ((buf = (u8 *)iobuf_get(BCACHE_BLOCK_BYTES)) == NULL)
+    return;
+  if (ata_read(dev, 0, 1, buf) == 0) {
+    for (i = 0; i < 4; i++) {
+      entry = buf + KERNEL_MBR_ENTRIES + i * KERNEL_MBR_ENTRY_SIZE;
+      lba = *(u32 *)(entry + 8);
+      count = *(u32 *)(entry + 12);
+      if (entry[4] != KERNEL_HINT_PART_TYPE &&
+          count >= BCACHE_BLOCK_SECTORS && lba + count <= dev->size)
+        ata_read(dev, lba, BCACHE_BLOCK_SECTORS, buf);
+    }
+  }
+  iobuf_put(buf);
+}
+
+/* Commands typed on COM1 as '!' followed by a letter. The reports go back
+ * over the same port. Returns -1 for letters that aren't commands. */
+#define KERNEL_COMMAND_PREFIX     '!'
+
+static int kernel_command(char c) {
+  switch (c) {
+    case 'i':   /* Port I/O per operation, when built with IO_ACCOUNTING. */
+      io_acct_report(SERIAL_COM1);
+      return 0;
+    case 'm':   /* Frame and heap allocator counters. */
+      mem_report(SERIAL_COM1);
+      return 0;
+    case 'c':   /* Block cache counters, on the screen. */
+      bcache_report();
+      return 0;
+  }
+  return -1;
+}
+
 /* In case we run into PANIC. */
 void kernel_panic(char *msg) {
   fb_set_fg_color(FB_COLOR_WHITE);
@@ -48,6 +134,13 @@ void kmain(void *gdt_base, void *mem_map) {
                           MEM_USER_FIRST_FRAME) == NULL) {
     kernel_panic("Could not allocate a frame for the kernel's stack :(");
   }
+  /* The frame below it will be the stack's guard page once paging is on,
+   * keep the heap away from it. */
+  if (mem_allocate_frames(1,
+                          MEM_KERNEL_STACK_FRAME - 1,
+                          MEM_KERNEL_STACK_FRAME) == NULL) {
+    kernel_panic("Could not allocate the kernel's stack guard frame :(");
+  }
 
   /* And now comes the magic. Fingers crossed. */
   mem_relocate_stack_to((void *)MEM_KERNEL_STACK_TOP);
@@ -60,17 +153,37 @@ void kmain(void *gdt_base, void *mem_map) {
 void kmain2() {
   serial_port_config_t sc;
   char buf[2];
+  u8 command = 0;
 
+  io_acct_reset();
   fb_reset();
   fb_set_fg_color(FB_COLOR_BLUE);
   fb_set_bg_color(FB_COLOR_WHITE);
   fb_clear();
 
+  /* Set aside the buffers for sector and DMA transfers. */
+  if (iobuf_init() == -1) {
+    kernel_panic("Could not allocate the I/O buffers :(");
+  }
+
   /* Initializes the interrupt subsytem. */
   if (itr_set_up() == -1) {
     kernel_panic("Coult not initialize IDT :(");
   }
 
+  /* Turn paging on. Everything stays where it was, but now the frame right
+   * below the stack can be left unmapped so an overflow stops the machine
+   * instead of silently trashing the heap. Nothing reports it though: with
+   * no TSS to switch stacks, the CPU can't push the page fault or the double
+   * fault on the overflowed stack and resets on the triple fault. */
+  if (paging_init() == -1) {
+    kernel_panic("Could not initialize paging :(");
+  }
+  if (paging_unmap((MEM_KERNEL_STACK_FRAME - 1) * MEM_FRAME_SIZE) == -1) {
+    kernel_panic("Could not set the stack guard page :(");
+  }
+  mmap_init();
+
   /* Initializes the PICs. This mask all interrupts. */
   pic_init();
 
@@ -90,6 +203,12 @@ void kmain2() {
   }
   pic_unmask_dev(PIC_SERIAL_1_IRQ);
 
+  /* Start the periodic tick. */
+  if (timer_init(TIMER_HZ) == -1) {
+    kernel_panic("Could not initialize the timer :(");
+  }
+  pic_unmask_dev(PIC_TIMER_IRQ);
+
   /* We can now turn interrupts on, they won't reach us (yet). */
   hw_sti();
 
@@ -97,13 +216,56 @@ void kmain2() {
   
   ata_dev_t dp[4];
   ata_dev_t* devs[] = {dp, dp+1, dp+2, dp+3};
+  ata_dev_t sp[AHCI_MAX_DEVICES];
+  ata_dev_t* sdevs[] = {sp, sp+1, sp+2, sp+3};
+  ata_dev_t cached;
+  u32 hint_lba;
 
+  trace_init();
+  qos_init();
   ata_init(devs);
+  ahci_init(sdevs, AHCI_MAX_DEVICES);
+  scrub_init(devs, 4);
+  lbd_init();
+  bcache_init();
+
+  /* Cache the boot disk, warmed up from the hints of the last boot if it
+   * has a partition for them, and tell how well that went for what the boot
+   * itself reads. */
+  if (kernel_find_hints(dp, &hint_lba) == 0)
+    bcache_set_hints(dp, hint_lba);
+  if (bcache_create(&cached, dp) == 0) {
+    kernel_scan_partitions(&cached);
+    bcache_report();
+  }
 
-  /* This is the idle loop. */
+  /* This is the idle loop. When there's nothing to read the idle time goes
+   * to identifying the disks nobody has used yet, the media scrubber, the
+   * log cleaner and saving the cache hints, and we only halt once they have
+   * nothing to do. What comes in over COM1 is echoed to the screen, except
+   * for the commands kernel_command knows. */
   while (1) {
+    if (serial_pending(SERIAL_COM1) == 0) {
+      if (ata_identify_step() == 0 && scrub_step() == 0 && lbd_step() == 0 &&
+          bcache_step() == 0)
+        hw_hlt();
+      continue;
+    }
     buf[0] = 0; buf[1] = 0;
     serial_read(SERIAL_COM1, buf, 1);
+    if (command) {
+      command = 0;
+      if (kernel_command(buf[0]) == 0)
+        continue;
+      buf[1] = buf[0];
+      buf[0] = KERNEL_COMMAND_PREFIX;
+      fb_write(buf, 2);
+      continue;
+    }
+    if (buf[0] == KERNEL_COMMAND_PREFIX) {
+      command = 1;
+      continue;
+    }
     fb_write(buf, 1);
   }
 }
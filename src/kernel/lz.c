@@ -0,0 +1,98 @@
+#include <lz.h>
+#include <typedef.h>
+
+#define LZ_HASH_BITS              12
+#define LZ_HASH_SIZE              (1 << LZ_HASH_BITS)
+#define LZ_MIN_MATCH              3
+#define LZ_MAX_MATCH              (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS           0x80
+#define LZ_MAX_OFFSET             0xffff
+#define LZ_MATCH_FLAG             0x80
+
+#define LZ_HASH(p) \
+  ((((u32)(p)[0] << 16 | (u32)(p)[1] << 8 | (p)[2]) * 2654435761u) >> \
+   (32 - LZ_HASH_BITS))
+
+/* Positions are stored plus one so that a zeroed table means empty. Being
+ * static keeps 16K off the stack; the kernel is not reentrant anyway. */
+static u32 lz_table[LZ_HASH_SIZE];
+
+/* Emits the pending literal run. */
+static int lz_flush(u8 *src, u32 from, u32 to, u8 *dst, u32 *o, u32 max) {
+  u32 n;
+
+  while (from < to) {
+    n = to - from > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : to - from;
+    if (*o + 1 + n > max)
+      return -1;
+    dst[(*o)++] = (u8)(n - 1);
+    for (; n > 0; n--)
+      dst[(*o)++] = src[from++];
+  }
+  return 0;
+}
+
+u32 lz_compress(u8 *src, u32 len, u8 *dst, u32 max) {
+  u32 i, h, cand, m, lit, o;
+
+  for (h = 0; h < LZ_HASH_SIZE; h++)
+    lz_table[h] = 0;
+
+  for (i = 0, lit = 0, o = 0; i + LZ_MIN_MATCH <= len; ) {
+    h = LZ_HASH(src + i);
+    cand = lz_table[h];
+    lz_table[h] = i + 1;
+
+    if (cand == 0 || i - (cand - 1) > LZ_MAX_OFFSET ||
+        src[cand - 1] != src[i] || src[cand] != src[i + 1] ||
+        src[cand + 1] != src[i + 2]) {
+      i++;
+      continue;
+    }
+    cand--;
+
+    for (m = LZ_MIN_MATCH;
+         m < LZ_MAX_MATCH && i + m < len && src[cand + m] == src[i + m];
+         m++);
+
+    if (lz_flush(src, lit, i, dst, &o, max) == -1 || o + 3 > max)
+      return 0;
+    dst[o++] = LZ_MATCH_FLAG | (u8)(m - LZ_MIN_MATCH);
+    dst[o++] = (u8)((i - cand) & 0xff);
+    dst[o++] = (u8)((i - cand) >> 8);
+    i += m;
+    lit = i;
+  }
+
+  if (lz_flush(src, lit, len, dst, &o, max) == -1)
+    return 0;
+  return o;
+}
+
+u32 lz_decompress(u8 *src, u32 len, u8 *dst, u32 max) {
+  u32 i, o, n, off;
+
+  for (i = 0, o = 0; i < len; ) {
+    if (src[i] & LZ_MATCH_FLAG) {
+      if (i + 3 > len)
+        return 0;
+      n = (src[i] & ~LZ_MATCH_FLAG) + LZ_MIN_MATCH;
+      off = src[i + 1] | (src[i + 2] << 8);
+      i += 3;
+      if (off == 0 || off > o || o + n > max)
+        return 0;
+      /* Byte by byte, since source and destination may overlap. */
+      for (; n > 0; n--, o++)
+        dst[o] = dst[o - off];
+    }
+    else {
+      n = src[i] + 1;
+      i++;
+      if (i + n > len || o + n > max)
+        return 0;
+      for (; n > 0; n--)
+        dst[o++] = src[i++];
+    }
+  }
+  return o;
+}
@@ -75,6 +75,23 @@ int memcmp(void *p1, void *p2, u32 count) {
   return 0;
 }
 
+/* Plain shift-and-subtract long division. */
+u64 div64(u64 n, u32 d) {
+  u64 q, r;
+  int i;
+
+  if (d == 0)
+    return 0;
+  for (q = 0, r = 0, i = 63; i >= 0; i--) {
+    r = (r << 1) | ((n >> i) & 1);
+    if (r >= d) {
+      r -= d;
+      q |= (u64)1 << i;
+    }
+  }
+  return q;
+}
+
 int strcmp(char *s, char *z) {
   int i;
   i = 0;
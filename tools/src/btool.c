@@ -10,6 +10,7 @@ void help(int argc, char *argv[]) {
 "         mbr     : Partitions the disk and installs boot code into MBR.\n"
 "         boot    : Installs the bootloader into the given partition.\n"
 "         kernel  : Installs the kernel.\n"
+"         replay  : Replays a kernel I/O trace against a disk image.\n"
 "         help : Prints this small help and exits.\n"
   , PROG);
 }
@@ -26,6 +27,8 @@ int main(int argc, char *argv[]) {
     return bootloader_write(argc, argv);
   else if (strcmp(CMD, "kernel") == 0)
     return minix_write(argc, argv);
+  else if (strcmp(CMD, "replay") == 0)
+    return replay_run(argc, argv);
   else
     help(argc, argv);
 
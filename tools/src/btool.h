@@ -67,3 +67,6 @@ int bootloader_write(int, char *[]);
 
 /* minix.c */
 int minix_write(int, char *[]);
+
+/* replay.c */
+int replay_run(int, char *[]);
@@ -0,0 +1,258 @@
+/* Replays an I/O trace captured by the kernel (see src/kernel/include/trace.h
+ * for the format) against a disk image file, and reports throughput and
+ * latency. Writes keep their size and location but not their content, so
+ * always replay against a copy of the image.
+ *
+ * A trace saved to disk with trace_save() can be pulled out of the image
+ * with dd, e.g. for a trace saved at sector 200000:
+ *
+ *    dd if=disk.img of=trace.bin bs=512 skip=200000 count=64
+ *
+ * Traces dumped over the serial port can be used as they are.
+ *
+ * The image is opened with O_DIRECT so the numbers are those of the disk
+ * and not of the host's page cache. Filesystems that don't support it (e.g.
+ * tmpfs) get a warning and a buffered replay, whose numbers mostly measure
+ * memory copies.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "btool.h"
+
+/* This subcommands syntax is:
+ *    replay DISK_IMAGE TRACE [--timed] [--dev N]
+ */
+#define HELP_OPT          argv[2]
+
+#define DISK_IMG          argv[2]
+#define TRACE_FILE        argv[3]
+#define FIRST_OPT_INDEX   4
+
+#define TRACE_MAGIC       0x43525441  /* "ATRC" */
+#define DIRECT_ALIGN      4096        /* Buffer alignment O_DIRECT wants. */
+#define TRACE_OP_WRITE    0x01
+#define TRACE_OP_FAILED   0x80
+
+struct trace_header {
+  unsigned int magic;
+  unsigned short version;
+  unsigned short record_size;
+  unsigned int count;
+  unsigned int dropped;
+}__attribute__((__packed__));
+
+struct trace_record {
+  unsigned int time;
+  unsigned char op;
+  unsigned char dev;
+  unsigned short count;
+  unsigned int lba;
+  unsigned int latency;
+}__attribute__((__packed__));
+
+struct trace {
+  struct trace_record *records;
+  unsigned int count;
+  unsigned int dropped;
+};
+
+void replay_help(int argc, char *argv[]) {
+  printf(
+"usage: %s %s DISK_IMAGE TRACE [--timed] [--dev N]\n"
+"       DISK_IMAGE : path to the disk image to replay against. Writes will\n"
+"                    clobber it, use a copy.\n"
+"       TRACE      : trace file, either binary (as saved by trace_save) or\n"
+"                    text (as dumped by trace_dump).\n"
+"       --timed    : honor the trace's timing instead of replaying as fast\n"
+"                    as possible.\n"
+"       --dev N    : only replay requests to device slot N (default 0).\n"
+  , PROG, CMD);
+}
+
+static void trace_add(struct trace *t, struct trace_record *r, unsigned int *cap) {
+  if (t->count == *cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    t->records = realloc(t->records, *cap * sizeof(struct trace_record));
+    if (t->records == NULL)
+      scream_and_quit("Out of memory.");
+  }
+  t->records[t->count++] = *r;
+}
+
+static void trace_load(char *path, struct trace *t) {
+  FILE *f;
+  struct trace_header h;
+  struct trace_record r;
+  char line[256], op[4], flag[4];
+  unsigned int i, cap, version;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+    scream_and_quit("Could not open trace file.");
+
+  t->records = NULL;
+  t->count = 0;
+  t->dropped = 0;
+  cap = 0;
+
+  if (fread(&h, 1, sizeof(h), f) == sizeof(h) && h.magic == TRACE_MAGIC) {
+    if (h.record_size != sizeof(struct trace_record))
+      scream_and_quit("Unsupported trace record size.");
+    t->dropped = h.dropped;
+    for (i = 0; i < h.count; i++) {
+      if (fread(&r, 1, sizeof(r), f) != sizeof(r))
+        scream_and_quit("Truncated trace file.");
+      trace_add(t, &r, &cap);
+    }
+    fclose(f);
+    return;
+  }
+
+  /* Text form. Lines that don't parse (e.g. console noise captured along
+   * with the serial output) are ignored. */
+  rewind(f);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "# ata-trace %u %*u %u", &version, &t->dropped) == 2)
+      continue;
+    flag[0] = '\0';
+    if (sscanf(line, "%u %3s %hhu %u %hu %u%3s", &r.time, op, &r.dev, &r.lba,
+               &r.count, &r.latency, flag) < 6)
+      continue;
+    r.op = op[0] == 'W' ? TRACE_OP_WRITE : 0;
+    if (flag[0] == '!')
+      r.op |= TRACE_OP_FAILED;
+    trace_add(t, &r, &cap);
+  }
+  fclose(f);
+}
+
+static double now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_until_us(double t) {
+  struct timespec ts;
+  double d;
+
+  d = t - now_us();
+  if (d <= 0)
+    return;
+  ts.tv_sec = (time_t)(d / 1e6);
+  ts.tv_nsec = (long)((d - ts.tv_sec * 1e6) * 1e3);
+  nanosleep(&ts, NULL);
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(double *)a, y = *(double *)b;
+  return x < y ? -1 : x > y;
+}
+
+int replay_run(int argc, char *argv[]) {
+  struct trace t;
+  struct trace_record *r;
+  int fd, timed, i;
+  unsigned int dev, n, j, reads, writes;
+  unsigned long long sectors;
+  double start, t0, elapsed, *lat, sum, kernel_sum;
+  char *buf;
+  ssize_t rw;
+
+  if (argc < 4) {
+    replay_help(argc, argv);
+    return 1;
+  }
+  if (strcmp(HELP_OPT, "--help") == 0) {
+    replay_help(argc, argv);
+    return 0;
+  }
+
+  timed = 0;
+  dev = 0;
+  for (i = FIRST_OPT_INDEX; i < argc; i++) {
+    if (strcmp(argv[i], "--timed") == 0)
+      timed = 1;
+    else if (strcmp(argv[i], "--dev") == 0 && i + 1 < argc)
+      dev = atoi(argv[++i]);
+    else
+      scream_and_quit("Unknown option.");
+  }
+
+  trace_load(TRACE_FILE, &t);
+
+  fd = open(DISK_IMG, O_RDWR | O_DIRECT);
+  if (fd == -1) {
+    fd = open(DISK_IMG, O_RDWR);
+    if (fd == -1)
+      scream_and_quit("Could not open disk image.");
+    fprintf(stderr, "warning: O_DIRECT not supported, the replay goes "
+                    "through the page cache\n");
+  }
+
+  if (posix_memalign((void **)&buf, DIRECT_ALIGN, 0x10000 * SECTOR_SIZE))
+    buf = NULL;
+  lat = malloc((t.count + 1) * sizeof(double));
+  if (buf == NULL || lat == NULL)
+    scream_and_quit("Out of memory.");
+  memset(buf, 0, 0x10000 * SECTOR_SIZE);
+
+  n = reads = writes = 0;
+  sectors = 0;
+  kernel_sum = 0;
+  start = now_us();
+  for (j = 0; j < t.count; j++) {
+    r = t.records + j;
+    if (r->dev != dev || (r->op & TRACE_OP_FAILED))
+      continue;
+    if (timed)
+      sleep_until_us(start + r->time);
+
+    t0 = now_us();
+    if ((r->op & ~TRACE_OP_FAILED) == TRACE_OP_WRITE) {
+      rw = pwrite(fd, buf, r->count * SECTOR_SIZE, LBA2OFF((off_t)r->lba));
+      writes++;
+    }
+    else {
+      rw = pread(fd, buf, r->count * SECTOR_SIZE, LBA2OFF((off_t)r->lba));
+      reads++;
+    }
+    if (rw != r->count * SECTOR_SIZE)
+      fprintf(stderr, "short transfer at lba %u (%u sectors)\n",
+              r->lba, r->count);
+    lat[n++] = now_us() - t0;
+    sectors += r->count;
+    kernel_sum += r->latency;
+  }
+  fsync(fd);
+  elapsed = now_us() - start;
+  close(fd);
+
+  printf("requests   : %u (%u reads, %u writes, %u dropped at capture)\n",
+         n, reads, writes, t.dropped);
+  printf("sectors    : %llu\n", sectors);
+  printf("elapsed    : %.3f s\n", elapsed / 1e6);
+  if (n > 0 && elapsed > 0) {
+    qsort(lat, n, sizeof(double), cmp_double);
+    for (sum = 0, j = 0; j < n; j++)
+      sum += lat[j];
+    printf("throughput : %.2f MiB/s, %.1f IOPS\n",
+           sectors * SECTOR_SIZE / (elapsed / 1e6) / (1 << 20),
+           n / (elapsed / 1e6));
+    printf("latency us : avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+           sum / n, lat[n / 2], lat[(n * 99) / 100], lat[n - 1]);
+    printf("kernel avg : %.1f us\n", kernel_sum / n);
+  }
+
+  free(lat);
+  free(buf);
+  free(t.records);
+  return 0;
+}